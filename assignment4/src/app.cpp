@@ -144,13 +144,15 @@ void App::run()
 
     vector<string> vecStatusMessages;
 
-    static array<const char*, 4> integrator_list = { "EULER (F1)", "TRAPEZOID (F2)", "MIDPOINT (F3)", "RK4 (F4)" };
-    static array<IntegratorType, 4> name2integrator = { EULER_INTEGRATOR, TRAPEZOID_INTEGRATOR, MIDPOINT_INTEGRATOR, RK4_INTEGRATOR };
+    static array<const char*, 6> integrator_list = { "EULER (F1)", "TRAPEZOID (F2)", "MIDPOINT (F3)", "RK4 (F4)", "IMPLICIT EULER (F5)", "ADAPTIVE RK23 (F6)" };
+    static array<IntegratorType, 6> name2integrator = { EULER_INTEGRATOR, TRAPEZOID_INTEGRATOR, MIDPOINT_INTEGRATOR, RK4_INTEGRATOR, IMPLICIT_EULER_INTEGRATOR, ADAPTIVE_INTEGRATOR };
     static map<IntegratorType, int> integrator2index;
     integrator2index[EULER_INTEGRATOR] = 0;
     integrator2index[TRAPEZOID_INTEGRATOR] = 1;
     integrator2index[MIDPOINT_INTEGRATOR] = 2;
     integrator2index[RK4_INTEGRATOR] = 3;
+    integrator2index[IMPLICIT_EULER_INTEGRATOR] = 4;
+    integrator2index[ADAPTIVE_INTEGRATOR] = 5;
 
     static array<const char*, 5> system_list = { "Simple (1)", "Spring (2)", "Multi-pendulum (3)", "Cloth (4)", "Sprinkler (5)"};
     static array<ParticleSystemType, 5> name2system = { SIMPLE_SYSTEM, SPRING_SYSTEM, PENDULUM_SYSTEM, CLOTH_SYSTEM, SPRINKLER_SYSTEM};
@@ -231,6 +233,17 @@ void App::run()
             if (ImGui::SliderInt("Steps per update", &steps_per_update_log2, 0, 8, fmt::format("{}", 1 << steps_per_update_log2).c_str()))
                 steps_per_update_ = 1 << steps_per_update_log2;
 
+            // The adaptive integrator chooses its own steps to cover step_ * steps_per_update_ every frame.
+            if (integrator_ == ADAPTIVE_INTEGRATOR && !ownSolver())
+            {
+                static int tolerance_log10 = int(round(log10(double(adaptive_integrator_.tolerance))));
+                if (ImGui::SliderInt("Tolerance", &tolerance_log10, -8, -1, fmt::format("{:.0e}", pow(10.0, tolerance_log10)).c_str()))
+                    adaptive_integrator_.tolerance = float(pow(10.0, tolerance_log10));
+                ImGui::SliderFloat("Time budget (ms/frame)", &adaptive_budget_ms_, 1.0f, 100.0f, "%.0f");
+                vecStatusMessages.push_back(fmt::format("Adaptive: {} steps ({} rejected) simulated {:.2e} of {:.2e} s, next step {:.2e} s",
+                    adaptive_integrator_.steps(), adaptive_integrator_.rejected(), adaptive_advanced_,
+                    step_ * steps_per_update_, adaptive_integrator_.step_size()));
+            }
 
             if (ImGui::Button("Reset system (R)"))
                 ps_->reset();
@@ -311,29 +324,50 @@ void App::run()
     glfwTerminate();
 }
 
+// The sprinkler, and the cloth when it is position-based, advance themselves rather than with the integrators.
+bool App::ownSolver() const
+{
+    return ps_type_ == SPRINKLER_SYSTEM || (ps_type_ == CLOTH_SYSTEM && cloth_system_.position_based());
+}
+
 void App::step()
 {
+    // This resolves the collisions after each of its steps.
+    if (integrator_ == ADAPTIVE_INTEGRATOR && !ownSolver())
+    {
+        adaptive_advanced_ = adaptive_integrator_.advance(*ps_, step_ * steps_per_update_, adaptive_budget_ms_);
+        return;
+    }
     for (int i = 0; i < steps_per_update_; ++i) {
         // sprinkler only uses the simple integrator for the sake of simplicity 
         if (SprinklerSystem* sprinkler = dynamic_cast<SprinklerSystem*>(ps_)) {
             sprinkler->update(step_);
             sprinkler->emit();
         }
+        else if (ps_type_ == CLOTH_SYSTEM && cloth_system_.position_based()) {
+            cloth_system_.stepPositionBased(step_);
+        }
         else {
             switch (integrator_)
             {
             case EULER_INTEGRATOR:
-                stepSystem(*ps_, eulerStep, step_); break;
+                stepSystem(*ps_, euler_integrator_, step_); break;
             case TRAPEZOID_INTEGRATOR:
-                stepSystem(*ps_, trapezoidStep, step_); break;
+                stepSystem(*ps_, trapezoid_integrator_, step_); break;
             case MIDPOINT_INTEGRATOR:
-                stepSystem(*ps_, midpointStep, step_); break;
+                stepSystem(*ps_, midpoint_integrator_, step_); break;
             case RK4_INTEGRATOR:
-                stepSystem(*ps_, rk4Step, step_); break;
+                stepSystem(*ps_, rk4_integrator_, step_); break;
+            case IMPLICIT_EULER_INTEGRATOR:
+                stepSystem(*ps_, implicitEulerStep, step_); break;
+            case ADAPTIVE_INTEGRATOR:
+                // Stepped before the loop, or by the system itself (see ownSolver()).
+                break;
             default:
                 assert(false && " invalid integrator type");
             }
         }
+        ps_->resolveCollisions();
     }
 }
 
@@ -517,6 +551,10 @@ void App::handleKeypress(GLFWwindow* window, int key, int scancode, int action,
             integrator_ = MIDPOINT_INTEGRATOR;
         else if (key == GLFW_KEY_F4)
             integrator_ = RK4_INTEGRATOR;
+        else if (key == GLFW_KEY_F5)
+            integrator_ = IMPLICIT_EULER_INTEGRATOR;
+        else if (key == GLFW_KEY_F6)
+            integrator_ = ADAPTIVE_INTEGRATOR;
         else if (key == GLFW_KEY_O)
             decreaseUIScale();
         else if (key == GLFW_KEY_P)
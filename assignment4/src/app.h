@@ -10,6 +10,7 @@
 
 #include <Eigen/Dense>              // Linear algebra
 #include <Eigen/Geometry>
+#include <Eigen/Sparse>
 
 #include <string>
 #include <vector>
@@ -23,6 +24,7 @@ using namespace Eigen;      // enables writing "Vector3f" instead of "Eigen::Vec
 #include "Utils.h"
 
 #include "particle_system.h"
+#include "integrators.h"
 
 
 struct Vertex
@@ -58,7 +60,8 @@ private:
 		TRAPEZOID_INTEGRATOR,
 		MIDPOINT_INTEGRATOR,
 		RK4_INTEGRATOR,
-		//IMPLICIT_EULER_INTEGRATOR,
+		IMPLICIT_EULER_INTEGRATOR,
+		ADAPTIVE_INTEGRATOR,
 		//IMPLICIT_MIDPOINT_INTEGRATOR,
 		//CRANK_NICOLSON_INTEGRATOR,
 		//COMPUTE_CLOTH_INTEGRATOR
@@ -72,6 +75,7 @@ public:
 private:
 	void			initRendering();
 	void			step();
+	bool			ownSolver() const;
 	void			render(int window_width, int window_height, vector<string>& vecStatusMessages);
 
 private:
@@ -100,6 +104,18 @@ private:
 	ClothSystem			cloth_system_;
 	SprinklerSystem     sprinkler_system_;
 
+	// The integrators keep their buffers from step to step.
+	EulerIntegrator		euler_integrator_;
+	TrapezoidIntegrator	trapezoid_integrator_;
+	MidpointIntegrator	midpoint_integrator_;
+	RK4Integrator		rk4_integrator_;
+
+	// Advances the system by step_ * steps_per_update_ per frame in steps of its own, for at most
+	// adaptive_budget_ms_ of wall time.
+	AdaptiveIntegrator	adaptive_integrator_;
+	float				adaptive_budget_ms_ = 20.0f;
+	float				adaptive_advanced_ = 0.0f;		// the simulated time of the last frame
+
 	// ------------------------------------------
 	static GLFWkeyfun           default_key_callback_;
 	static GLFWmousebuttonfun   default_mouse_button_callback_;
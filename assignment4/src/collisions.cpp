@@ -0,0 +1,74 @@
+#include <Eigen/Dense>
+using namespace Eigen;
+
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+#include "collisions.h"
+
+bool SphereCollider::collide(Vector3f& p, Vector3f& v) const
+{
+    Vector3f d = p - center;
+    float length = d.norm();
+    if (length >= radius || length == 0.0f)
+        return false;
+    Vector3f normal = d / length;
+    p = center + radius * normal;
+    float into = v.dot(normal);
+    if (into < 0.0f)
+        v -= (1.0f + restitution) * into * normal;
+    return true;
+}
+
+bool PlaneCollider::collide(Vector3f& p, Vector3f& v) const
+{
+    float depth = offset - normal.dot(p);
+    if (depth <= 0.0f)
+        return false;
+    p += depth * normal;
+    float into = v.dot(normal);
+    if (into < 0.0f)
+        v -= (1.0f + restitution) * into * normal;
+    return true;
+}
+
+void SpatialHash::build(const vector<Vector3f>& points, float cell_size)
+{
+    const int n = int(points.size());
+    uint32_t size = 1;
+    while (size < 2 * uint32_t(n))
+        size *= 2;
+    mask_ = size - 1;
+    inv_cell_size_ = 1.0f / cell_size;
+
+    cell_of_.resize(n);
+    entry_of_.resize(n);
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+        cell_of_[i] = cellOf(points[i]);
+        entry_of_[i] = hash(cell_of_[i].x(), cell_of_[i].y(), cell_of_[i].z());
+    }
+
+    // Counting sort by entry, which keeps the points of an entry in order.
+    entry_begin_.assign(size + 1, 0);
+    for (int i = 0; i < n; ++i)
+        ++entry_begin_[entry_of_[i] + 1];
+    partial_sum(entry_begin_.begin(), entry_begin_.end(), entry_begin_.begin());
+    sorted_.resize(n);
+    sorted_cells_.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t k = entry_begin_[entry_of_[i]]++;
+        sorted_[k] = i;
+        sorted_cells_[k] = cell_of_[i];
+    }
+    // The insertion moved the beginning of every entry to the beginning of the next.
+    for (uint32_t e = size; e > 0; --e)
+        entry_begin_[e] = entry_begin_[e - 1];
+    entry_begin_[0] = 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Colliders that the particles bounce off. A point is moved onto the surface, and the part of its velocity
+// that points into the collider is reflected, scaled by the restitution (0 stops it, 1 bounces it back fully).
+struct SphereCollider
+{
+    Vector3f                center;
+    float                   radius;
+    float                   restitution = 0.0f;
+
+    // Returns true if the point was inside.
+    bool                    collide(Vector3f& p, Vector3f& v) const;
+};
+
+// The half-space of the points x with normal.dot(x) < offset is solid.
+struct PlaneCollider
+{
+    Vector3f                normal;
+    float                   offset;
+    float                   restitution = 0.0f;
+
+    bool                    collide(Vector3f& p, Vector3f& v) const;
+};
+
+// A uniform grid of cubic cells, hashed into a table of about twice as many entries as there are points, for
+// finding the points near a point. build() sorts the points by their cells with a counting sort, and a query
+// visits the points of the 27 cells around a point, so both take time proportional to the points involved.
+class SpatialHash
+{
+public:
+    // Sorts the points into cells of the given size. The neighbours of a point within cell_size are found.
+    void                    build(const vector<Vector3f>& points, float cell_size);
+
+    // Calls visit(j) for every point j of the cells around p. These include all the points that are within
+    // cell_size of p, and some that are further.
+    template <typename Visit>
+    void                    forNeighbours(const Vector3f& p, Visit visit) const
+    {
+        Vector3i cell = cellOf(p);
+        for (int z = cell.z() - 1; z <= cell.z() + 1; ++z)
+            for (int y = cell.y() - 1; y <= cell.y() + 1; ++y)
+                for (int x = cell.x() - 1; x <= cell.x() + 1; ++x)
+                {
+                    // Cells that hash to the same entry share it; the points of the others are skipped.
+                    uint32_t entry = hash(x, y, z);
+                    for (uint32_t k = entry_begin_[entry]; k < entry_begin_[entry + 1]; ++k)
+                        if (sorted_cells_[k] == Vector3i(x, y, z))
+                            visit(int(sorted_[k]));
+                }
+    }
+
+    // The points sorted by their entries. Going through the points in this order keeps the neighbours of
+    // consecutive points together in memory.
+    int                     size() const                { return int(sorted_.size()); }
+    int                     sortedPoint(int k) const    { return int(sorted_[k]); }
+
+private:
+    Vector3i                cellOf(const Vector3f& p) const
+    {
+        return Vector3i(int(floorf(p.x() * inv_cell_size_)), int(floorf(p.y() * inv_cell_size_)), int(floorf(p.z() * inv_cell_size_)));
+    }
+    uint32_t                hash(int x, int y, int z) const
+    {
+        return (uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u) & mask_;
+    }
+
+    float                   inv_cell_size_ = 1.0f;
+    uint32_t                mask_ = 0;              // the size of the table - 1, a power of two - 1
+    vector<Vector3i>        cell_of_;               // of every point
+    vector<uint32_t>        entry_of_;
+    vector<uint32_t>        entry_begin_;           // the points of entry e are sorted_[entry_begin_[e] .. entry_begin_[e + 1])
+    vector<uint32_t>        sorted_;                // the indices of the points sorted by entry
+    vector<Vector3i>        sorted_cells_;          // and their cells
+};
+
+// Pushes apart the points that are closer than distance to each other, half of the overlap each, and takes away
+// the velocity that brings them closer. All the corrections are computed from the points as they are, and added
+// to dp and dv, which must be the size of p; this is done in parallel. The hash must have been built from p with
+// a cell size of at least distance. ignore(i, j) tells if the points i and j are allowed to overlap.
+template <typename Ignore>
+void separatePoints(const SpatialHash& hash, const vector<Vector3f>& p, const vector<Vector3f>& v, float distance,
+                    Ignore ignore, vector<Vector3f>& dp, vector<Vector3f>& dv)
+{
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int k = 0; k < hash.size(); ++k)
+    {
+        int i = hash.sortedPoint(k);
+        hash.forNeighbours(p[i], [&](int j)
+        {
+            if (j == i || ignore(i, j))
+                return;
+            Vector3f d = p[i] - p[j];
+            float length2 = d.squaredNorm();
+            if (length2 >= distance * distance || length2 == 0.0f)
+                return;
+            float length = sqrtf(length2);
+            Vector3f normal = d / length;
+            dp[i] += 0.5f * (distance - length) * normal;
+            float approach = (v[i] - v[j]).dot(normal);
+            if (approach < 0.0f)
+                dv[i] -= 0.5f * approach * normal;
+        });
+    }
+}
@@ -0,0 +1,316 @@
+// Runs a particle system without a window, for benchmarking the simulation:
+//
+//   assignment4_headless -system cloth -size 64 -integrator rk4 -dt 0.0001 -steps 10000 -dump states.txt 100
+//
+// and reports the steps per second, the change in energy and the peak memory use. With -dump, every interval
+// steps the state is written to the file as a line of the step number and the state vector (see StateLayout).
+// -integrator xpbd steps the cloth with its position-based solver, with -iterations per step.
+// -shuffle numbers the particles of the cloth at random, like a mesh with no useful numbering, and -reorder
+// renumbers them by reverse Cuthill-McKee; the bandwidth of the springs is reported after each.
+// With -integrator adaptive, each of the steps is a frame of dt that AdaptiveIntegrator divides into as many
+// steps as -tolerance requires, and the steps it took are reported as well.
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Sparse>
+using namespace Eigen;
+
+#include "fmt/core.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+#include "particle_system.h"
+#include "integrators.h"
+
+namespace {
+
+    const char* usage =
+        "usage: assignment4_headless [-system simple|spring|pendulum|cloth|sprinkler] [-size n]\n"
+        "                            [-integrator euler|trapezoid|midpoint|rk4|implicit|adaptive|xpbd] [-tolerance e]\n"
+        "                            [-iterations n] [-dt seconds] [-steps n] [-dump file interval]\n"
+        "                            [-self_collisions] [-drop_collisions] [-shuffle] [-reorder]\n"
+        "  -size is the number of particles of the pendulum, the width and height of the cloth,\n"
+        "  or the drops emitted per step by the sprinkler.\n"
+        "  -self_collisions and -drop_collisions turn on the collisions of the cloth with itself\n"
+        "  and of the sprinkler's drops with each other, which are off by default.\n";
+
+    struct Options
+    {
+        string  system          = "cloth";
+        int     size            = 20;
+        string  integrator      = "rk4";
+        float   tolerance       = 1e-4f;    // of the adaptive integrator
+        int     iterations      = 20;       // of the position-based cloth
+        float   dt              = 0.0001f;
+        int     steps           = 10000;
+        string  dump_file;
+        int     dump_interval   = 0;
+        bool    self_collisions = false;    // of the cloth
+        bool    drop_collisions = false;    // of the sprinkler
+        bool    shuffle         = false;    // the particles of the cloth
+        bool    reorder         = false;
+    };
+
+    // The largest the resident memory of the process has been, in megabytes.
+    double peakMemoryMB()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / (1024.0 * 1024.0);     // bytes
+#else
+        return usage.ru_maxrss / 1024.0;                // kilobytes
+#endif
+#endif
+    }
+
+    unique_ptr<ParticleSystem> makeSystem(const Options& options)
+    {
+        if (options.system == "simple")
+            return make_unique<SimpleSystem>();
+        if (options.system == "spring")
+            return make_unique<SpringSystem>();
+        if (options.system == "pendulum")
+            return make_unique<MultiPendulumSystem>(options.size);
+        if (options.system == "cloth")
+        {
+            auto cloth = make_unique<ClothSystem>(options.size, options.size);
+            cloth->set_self_collisions(options.self_collisions);
+            return cloth;
+        }
+        if (options.system == "sprinkler")
+        {
+            auto sprinkler = make_unique<SprinklerSystem>(10);
+            sprinkler->set_drops_per_step(options.size);
+            sprinkler->set_drop_collisions(options.drop_collisions);
+            return sprinkler;
+        }
+        return nullptr;
+    }
+
+    unique_ptr<Integrator> makeIntegrator(const string& name)
+    {
+        if (name == "euler")
+            return make_unique<EulerIntegrator>();
+        if (name == "trapezoid")
+            return make_unique<TrapezoidIntegrator>();
+        if (name == "midpoint")
+            return make_unique<MidpointIntegrator>();
+        if (name == "rk4")
+            return make_unique<RK4Integrator>();
+        return nullptr;
+    }
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    vector<string> args(argv + 1, argv + argc);
+    for (auto it = args.begin(); it != args.end(); ++it)
+    {
+        auto remaining = args.end() - it - 1;
+        if (*it == "-system" && remaining >= 1) {
+            options.system = *++it;
+        } else if (*it == "-size" && remaining >= 1) {
+            options.size = stoi(*++it);
+        } else if (*it == "-integrator" && remaining >= 1) {
+            options.integrator = *++it;
+        } else if (*it == "-tolerance" && remaining >= 1) {
+            options.tolerance = stof(*++it);
+        } else if (*it == "-iterations" && remaining >= 1) {
+            options.iterations = stoi(*++it);
+        } else if (*it == "-dt" && remaining >= 1) {
+            options.dt = stof(*++it);
+        } else if (*it == "-steps" && remaining >= 1) {
+            options.steps = stoi(*++it);
+        } else if (*it == "-dump" && remaining >= 2) {
+            options.dump_file = *++it;
+            options.dump_interval = stoi(*++it);
+        } else if (*it == "-self_collisions") {
+            options.self_collisions = true;
+        } else if (*it == "-drop_collisions") {
+            options.drop_collisions = true;
+        } else if (*it == "-shuffle") {
+            options.shuffle = true;
+        } else if (*it == "-reorder") {
+            options.reorder = true;
+        } else {
+            cerr << "Unknown or incomplete argument " << *it << "\n" << usage;
+            return 1;
+        }
+    }
+
+    // The pendulum and the cloth need two particles along each side to have springs at all.
+    int min_size = (options.system == "pendulum" || options.system == "cloth") ? 2 : 0;
+    if (options.size < min_size)
+    {
+        cerr << "The size of the " << options.system << " must be at least " << min_size << "\n" << usage;
+        return 1;
+    }
+    if (options.steps <= 0)
+    {
+        cerr << "The number of steps must be positive\n" << usage;
+        return 1;
+    }
+
+    unique_ptr<ParticleSystem> ps = makeSystem(options);
+    if (!ps)
+    {
+        cerr << "Unknown system " << options.system << "\n" << usage;
+        return 1;
+    }
+    // The sprinkler moves its drops itself, like in App::step().
+    SprinklerSystem* sprinkler = dynamic_cast<SprinklerSystem*>(ps.get());
+    unique_ptr<Integrator> integrator = makeIntegrator(options.integrator);
+    unique_ptr<AdaptiveIntegrator> adaptive;
+    if (options.integrator == "adaptive")
+    {
+        adaptive = make_unique<AdaptiveIntegrator>();
+        adaptive->tolerance = options.tolerance;
+    }
+    ClothSystem* cloth = dynamic_cast<ClothSystem*>(ps.get());
+    if (options.integrator == "xpbd")
+    {
+        if (!cloth)
+        {
+            cerr << "Only the cloth has a position-based solver\n" << usage;
+            return 1;
+        }
+        cloth->set_position_based(true);
+        cloth->set_solver_iterations(options.iterations);
+    }
+    if (options.shuffle || options.reorder)
+    {
+        if (!cloth)
+        {
+            cerr << "Only the cloth can be renumbered\n" << usage;
+            return 1;
+        }
+        string bandwidths = fmt::format("Spring bandwidth: {} row by row", cloth->adjacency().bandwidth());
+        if (options.shuffle)
+        {
+            vector<unsigned> order(cloth->adjacency().size());
+            iota(order.begin(), order.end(), 0u);
+            shuffle(order.begin(), order.end(), mt19937(1));
+            cloth->permuteParticles(order);
+            bandwidths += fmt::format(", {} shuffled", cloth->adjacency().bandwidth());
+        }
+        if (options.reorder)
+        {
+            cloth->permuteParticles(reverseCuthillMcKee(cloth->adjacency()));
+            bandwidths += fmt::format(", {} reordered", cloth->adjacency().bandwidth());
+        }
+        cout << bandwidths << endl;
+    }
+    if (!integrator && !adaptive && options.integrator != "implicit" && options.integrator != "xpbd")
+    {
+        cerr << "Unknown integrator " << options.integrator << "\n" << usage;
+        return 1;
+    }
+
+    ofstream dump;
+    if (options.dump_interval > 0)
+    {
+        dump.open(options.dump_file);
+        if (!dump)
+        {
+            cerr << "Cannot write " << options.dump_file << endl;
+            return 1;
+        }
+    }
+    auto dumpState = [&](int step)
+    {
+        dump << step;
+        for (int i = 0; i < ps->state().size(); ++i)
+            dump << ' ' << ps->state()(i);
+        dump << '\n';
+    };
+
+    double energy0 = 0.0, energy1 = 0.0;
+    bool has_energy = ps->evalEnergy(ps->state(), energy0);
+    if (dump.is_open())
+        dumpState(0);
+
+    // Only the steps are timed, not the dumps.
+    chrono::steady_clock::duration elapsed(0);
+    long long adaptive_steps = 0, adaptive_rejected = 0, evaluations = 0;
+    for (int step = 1; step <= options.steps; ++step)
+    {
+        auto start = chrono::steady_clock::now();
+        // Like App::step(), the systems that step themselves ignore the adaptive integrator and resolve their collisions here.
+        bool stepped_adaptively = false;
+        if (sprinkler) {
+            sprinkler->update(options.dt);
+            sprinkler->emit();
+        }
+        else if (cloth && cloth->position_based())
+            cloth->stepPositionBased(options.dt);
+        else if (adaptive) {
+            // This resolves the collisions after each of its steps.
+            adaptive->advance(*ps, options.dt);
+            stepped_adaptively = true;
+            adaptive_steps += adaptive->steps();
+            adaptive_rejected += adaptive->rejected();
+            evaluations += adaptive->evaluations();
+        }
+        else if (integrator)
+            stepSystem(*ps, *integrator, options.dt);
+        else
+            stepSystem(*ps, implicitEulerStep, options.dt);
+        if (!stepped_adaptively)
+            ps->resolveCollisions();
+        elapsed += chrono::steady_clock::now() - start;
+
+        if (dump.is_open() && step % options.dump_interval == 0)
+            dumpState(step);
+    }
+    double seconds = chrono::duration<double>(elapsed).count();
+
+    cout << fmt::format("{} (size {}), {}, dt {}: {} steps in {:.3f} s, {:.1f} steps/s, {:.3f} ms/step",
+                        options.system, options.size, sprinkler ? "own integrator" : options.integrator, options.dt,
+                        options.steps, seconds, options.steps / seconds, 1000.0 * seconds / options.steps) << endl;
+    // The collisions are resolved after every step, and can cost more than the step itself.
+    if (cloth)
+        cout << fmt::format("Collisions: self collisions {}", cloth->self_collisions() ? "on" : "off") << endl;
+    else if (sprinkler)
+        cout << fmt::format("Collisions: ground and ball, drop-drop {}", options.drop_collisions ? "on" : "off") << endl;
+    if (sprinkler)
+        cout << fmt::format("Drops: {}", sprinkler->num_drops()) << endl;
+    else if (adaptive)
+        cout << fmt::format("Adaptive steps: {} ({:.2f} per frame), {} rejected, {} evaluations of f, tolerance {}",
+                            adaptive_steps, double(adaptive_steps) / options.steps, adaptive_rejected, evaluations,
+                            options.tolerance) << endl;
+    if (has_energy)
+    {
+        ps->evalEnergy(ps->state(), energy1);
+        cout << fmt::format("Energy: {:.6g} -> {:.6g}, change {:+.6g} ({:+.3g}%){}", energy0, energy1, energy1 - energy0,
+                            100.0 * (energy1 - energy0) / abs(energy0), ps->state().allFinite() ? "" : ", state is not finite") << endl;
+    }
+    else
+        cout << "Energy: not defined for this system" << endl;
+    cout << fmt::format("Peak memory: {:.1f} MB", peakMemoryMB()) << endl;
+    return 0;
+}
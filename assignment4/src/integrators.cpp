@@ -1,64 +1,214 @@
 
 #include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Sparse>
 using namespace Eigen;
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 using namespace std;
 
 #include "particle_system.h"
 #include "integrators.h"
 
+// Accuracy of the linear solve of implicitEulerStep(), relative to the right hand side, and the cap on its iterations.
+#define IMPLICIT_CG_TOLERANCE 1e-4f
+#define IMPLICIT_CG_MAX_ITERATIONS 200
+
+// The step size control of AdaptiveIntegrator: the next step is the current one times 0.9 / error^(1/3), but at
+// most ADAPTIVE_MAX_GROWTH times longer or ADAPTIVE_MIN_SHRINK times shorter. Steps shorter than ADAPTIVE_MIN_STEP
+// are accepted whatever their error, so that a system that cannot be integrated to the tolerance still moves on.
+#define ADAPTIVE_SAFETY 0.9f
+#define ADAPTIVE_MAX_GROWTH 5.0f
+#define ADAPTIVE_MIN_SHRINK 0.2f
+#define ADAPTIVE_MIN_STEP 1e-7f
+
 // This function uses the specified integrator to advance the system
 // from its current state to the next.
 void stepSystem(ParticleSystem& ps, integrator_t integrator, float dt)
 {
 	VectorXf new_state = integrator(ps, dt);
-	ps.set_state(new_state);
+	ps.swap_state(new_state);
 }
 
+void stepSystem(ParticleSystem& ps, Integrator& integrator, float dt)
+{
+	integrator.advance(ps, dt);
+}
 
-VectorXf eulerStep(const ParticleSystem& ps, float dt)
+// The integrators below evaluate the intermediate states into x1 before they overwrite it with the result.
+// The expressions assigned to the buffers are evaluated coefficient by coefficient without temporaries.
+
+void EulerIntegrator::step(const ParticleSystem& ps, float dt, VectorXf& x1)
 {
 	// YOUR CODE HERE (R1)
 	// Implement an Euler integrator.
 	// Use ps.state() to access the current state and
 	// ps.evalF(...) to compute the derivative dX/dt.
-	// Return the new state after the Euler step.
-	return ps.state() + (dt * ps.evalF(ps.state()));
-	//return ps.state();	// No-op, replace this
-};
+	// Write the new state after the Euler step into x1.
+	const auto& x0 = ps.state();
+	ps.evalF(x0, f0_);
+	x1 = x0 + dt * f0_;
+}
 
-VectorXf trapezoidStep(const ParticleSystem& ps, float dt)
+void TrapezoidIntegrator::step(const ParticleSystem& ps, float dt, VectorXf& x1)
 {
 	// YOUR CODE HERE (R3)
 	// Implement a trapezoid integrator.
-	//return ps.state();	// No-op, replace this
-	const auto f0 = ps.evalF(ps.state());
-	const auto f1 = ps.evalF(ps.state() + dt * f0);
-	return ps.state() + (dt / 2) * (f0 + f1);
+	const auto& x0 = ps.state();
+	ps.evalF(x0, f0_);
+	x1 = x0 + dt * f0_;
+	ps.evalF(x1, f1_);
+	x1 = x0 + (dt / 2) * (f0_ + f1_);
+}
 
+void MidpointIntegrator::step(const ParticleSystem& ps, float dt, VectorXf& x1)
+{
+	const auto& x0 = ps.state();
+	ps.evalF(x0, f_);
+	x1 = x0 + 0.5f * dt * f_;
+	ps.evalF(x1, f_);
+	x1 = x0 + dt * f_;
 }
 
-VectorXf midpointStep(const ParticleSystem& ps, float dt)
+void RK4Integrator::step(const ParticleSystem& ps, float dt, VectorXf& x1)
 {
+	// EXTRA: Implement the RK4 Runge-Kutta integrator.
 	const auto& x0 = ps.state();
-	auto f0 = ps.evalF(x0);
-	VectorXf xm = x0 + 0.5f * dt * f0;
-	auto fm = ps.evalF(xm);
-	VectorXf x1 = x0 + dt * fm;
+	ps.evalF(x0, k1_);
+	x1 = x0 + dt * 0.5f * k1_;
+	ps.evalF(x1, k2_);
+	x1 = x0 + dt * 0.5f * k2_;
+	ps.evalF(x1, k3_);
+	x1 = x0 + dt * k3_;
+	ps.evalF(x1, k4_);
+	x1 = x0 + (dt / 6) * (k1_ + 2 * k2_ + 2 * k3_ + k4_);
+}
+
+float AdaptiveIntegrator::tryStep(const ParticleSystem& ps, float h)
+{
+	const auto& x0 = ps.state();
+	if (k1_state_.size() != x0.size() || k1_state_ != x0)
+	{
+		ps.evalF(x0, k1_);
+		k1_state_ = x0;
+		++evaluations_;
+	}
+	next_ = x0 + (h / 2) * k1_;
+	ps.evalF(next_, k2_);
+	next_ = x0 + (h * 3 / 4) * k2_;
+	ps.evalF(next_, k3_);
+	next_ = x0 + h * ((2.0f / 9) * k1_ + (1.0f / 3) * k2_ + (4.0f / 9) * k3_);
+	ps.evalF(next_, k4_);
+	evaluations_ += 3;
+
+	// The third order solution above minus the second order one, scaled by what is allowed of each variable.
+	// The root mean square of these is the error; a NaN fails the test in advance() and shortens the step.
+	auto difference = h * ((-5.0f / 72) * k1_ + (1.0f / 12) * k2_ + (1.0f / 9) * k3_ - (1.0f / 8) * k4_);
+	auto allowed = tolerance * (1.0f + x0.array().abs().max(next_.array().abs()));
+	return sqrtf((difference.array() / allowed).square().sum() / float(max<Index>(x0.size(), 1)));
+}
+
+float AdaptiveIntegrator::advance(ParticleSystem& ps, float duration, double budget_ms)
+{
+	auto start = chrono::steady_clock::now();
+	steps_ = rejected_ = evaluations_ = 0;
+	if (!(h_ > 0.0f))
+		h_ = duration;
+
+	float t = 0.0f;
+	while (t < duration)
+	{
+		if (budget_ms > 0.0 && chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() > budget_ms)
+			break;
+
+		// The last step is cut to end at duration; it does not change the step size the error asks for.
+		float h = min(h_, duration - t);
+		float error = tryStep(ps, h);
+		float factor = ADAPTIVE_MAX_GROWTH;
+		if (!isfinite(error))
+			factor = ADAPTIVE_MIN_SHRINK;
+		else if (error > 0.0f)
+			factor = min(ADAPTIVE_MAX_GROWTH, max(ADAPTIVE_MIN_SHRINK, ADAPTIVE_SAFETY / cbrtf(error)));
+		if (error <= 1.0f || h <= ADAPTIVE_MIN_STEP)
+		{
+			ps.swap_state(next_);
+			// The last stage is the derivative at the new state.
+			k1_.swap(k4_);
+			k1_state_ = ps.state();
+			ps.resolveCollisions();
+			t += h;
+			++steps_;
+			if (h == h_ || factor < 1.0f)
+				h_ = max(h * factor, ADAPTIVE_MIN_STEP);
+		}
+		else
+		{
+			++rejected_;
+			h_ = max(h * factor, ADAPTIVE_MIN_STEP);
+		}
+	}
+	return min(t, duration);
+}
+
+VectorXf eulerStep(const ParticleSystem& ps, float dt)
+{
+	VectorXf x1;
+	EulerIntegrator().step(ps, dt, x1);
+	return x1;
+};
+
+VectorXf trapezoidStep(const ParticleSystem& ps, float dt)
+{
+	VectorXf x1;
+	TrapezoidIntegrator().step(ps, dt, x1);
+	return x1;
+}
+
+VectorXf midpointStep(const ParticleSystem& ps, float dt)
+{
+	VectorXf x1;
+	MidpointIntegrator().step(ps, dt, x1);
 	return x1;
 }
 
 VectorXf rk4Step(const ParticleSystem& ps, float dt)
 {
-	// EXTRA: Implement the RK4 Runge-Kutta integrator.
-	//return ps.state();	// No-op, replace this
+	VectorXf x1;
+	RK4Integrator().step(ps, dt, x1);
+	return x1;
+}
+
+VectorXf implicitEulerStep(const ParticleSystem& ps, float dt)
+{
+	// Backward Euler, linearized around the current state (Baraff & Witkin 1998, "Large Steps in Cloth Simulation"):
+	// the change of the velocities dv solves (I - dt * dadv - dt^2 * dadx) dv = dt * (a0 + dt * dadx * v0),
+	// and the particles then move with the new velocities. The matrix is symmetric and positive definite,
+	// so the system is solved with conjugate gradients, preconditioned with its diagonal.
 	const auto& x0 = ps.state();
-	auto k1 = ps.evalF(x0); // f0
-	VectorXf x2 = x0 + dt * 0.5f * k1;
-	auto k2 = ps.evalF(x2);
-	VectorXf x3 = x0 + dt * 0.5f * k2;
-	auto k3 = ps.evalF(x3);
-	VectorXf x4 = x0 + dt * k3;
-	auto k4 = ps.evalF(x4);
-
-	return (x0 + (dt / 6.0) * (k1 + 2 * k2 + 2 * k3 + k4));
+	ParticleSystem::Jacobians J;
+	if (!ps.evalJacobians(x0, J))
+		return eulerStep(ps, dt);	// no positions and velocities to linearize
+
+	// The positions are the first half of the state, and the velocities the second (see StateLayout).
+	const int m = int(x0.size()) / 2;
+	const VectorXf f0 = ps.evalF(x0);
+	const VectorXf v0 = x0.tail(m);
+	const VectorXf a0 = f0.tail(m);
+
+	SparseMatrix<float> identity(m, m);
+	identity.setIdentity();
+	SparseMatrix<float> A = identity - dt * J.dadv - (dt * dt) * J.dadx;
+	VectorXf b = dt * (a0 + dt * (J.dadx * v0));
+
+	ConjugateGradient<SparseMatrix<float>, Lower | Upper> cg;
+	cg.setTolerance(IMPLICIT_CG_TOLERANCE);
+	cg.setMaxIterations(IMPLICIT_CG_MAX_ITERATIONS);
+	cg.compute(A);
+	VectorXf v1 = v0 + cg.solve(b);
+
+	VectorXf x1(x0.size());
+	x1.head(m) = x0.head(m) + dt * v1;
+	x1.tail(m) = v1;
+	return x1;
 }
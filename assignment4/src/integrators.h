@@ -6,6 +6,98 @@ typedef std::function<VectorXf(const ParticleSystem&, float)> integrator_t;
 
 void stepSystem(ParticleSystem&, integrator_t integrator, float dt);
 
+// An integrator that keeps its vectors from step to step. It computes the next state into a buffer of its own,
+// which is then swapped with the state of the system, so once the buffers have the size of the state,
+// a step allocates no memory.
+class Integrator
+{
+public:
+    virtual					~Integrator() {}
+
+    // Computes the state of ps after a step of dt into x1, which must not be the state of ps.
+    virtual void			step(const ParticleSystem& ps, float dt, VectorXf& x1) = 0;
+
+    // Advances ps by a step of dt.
+    void					advance(ParticleSystem& ps, float dt)
+    {
+        step(ps, dt, next_);
+        ps.swap_state(next_);
+    }
+
+private:
+    VectorXf				next_;
+};
+
+void stepSystem(ParticleSystem&, Integrator& integrator, float dt);
+
+class EulerIntegrator : public Integrator
+{
+public:
+    void					step(const ParticleSystem& ps, float dt, VectorXf& x1) override;
+private:
+    VectorXf				f0_;
+};
+
+class TrapezoidIntegrator : public Integrator
+{
+public:
+    void					step(const ParticleSystem& ps, float dt, VectorXf& x1) override;
+private:
+    VectorXf				f0_, f1_;
+};
+
+class MidpointIntegrator : public Integrator
+{
+public:
+    void					step(const ParticleSystem& ps, float dt, VectorXf& x1) override;
+private:
+    VectorXf				f_;
+};
+
+class RK4Integrator : public Integrator
+{
+public:
+    void					step(const ParticleSystem& ps, float dt, VectorXf& x1) override;
+private:
+    VectorXf				k1_, k2_, k3_, k4_;
+};
+
+// The Bogacki-Shampine 3(2) pair with step size control. Every step also computes a second order solution, and
+// the difference between the two estimates the error of the step. A step whose error is above the tolerance is
+// taken again with a shorter step; after every step the step size is set to what the error says it can be.
+// So the integrator takes long steps where the motion is smooth, and as many short ones as it needs elsewhere.
+// The last stage of a step is the derivative at the next state, which is reused as the first stage of the
+// following step as long as nothing else has changed the state.
+class AdaptiveIntegrator
+{
+public:
+    // Advances ps by duration in as many steps as the tolerance requires, calling ps.resolveCollisions() after
+    // each. If budget_ms is positive, no step is started after that many milliseconds of wall time, and the
+    // simulation falls behind. Returns the simulated time advanced.
+    float					advance(ParticleSystem& ps, float duration, double budget_ms = 0.0);
+
+    // The error allowed in a step, both absolute and relative to the size of the state variables.
+    float					tolerance = 1e-4f;
+
+    // Of the last call of advance().
+    int						steps() const			{ return steps_; }
+    int						rejected() const		{ return rejected_; }
+    int						evaluations() const		{ return evaluations_; }
+    // The size of the next step.
+    float					step_size() const		{ return h_; }
+
+private:
+    // Takes a step of h from the state of ps into next_ and returns the error relative to the tolerance.
+    float					tryStep(const ParticleSystem& ps, float h);
+
+    float					h_ = 0.0f;
+    int						steps_ = 0, rejected_ = 0, evaluations_ = 0;
+    VectorXf				k1_, k2_, k3_, k4_, next_;
+    VectorXf				k1_state_;				// the state k1_ is the derivative at
+};
+
+// The steps below return the next state in a new vector, and they allocate their intermediate vectors anew.
+
 // R1
 VectorXf eulerStep(const ParticleSystem& ps, float dt);
 
@@ -18,3 +110,7 @@ VectorXf midpointStep(const ParticleSystem& ps, float dt);
 // Extra
 VectorXf rk4Step(const ParticleSystem& ps, float dt);
 
+// Backward Euler for stiff systems, with a sparse linear solve per step (see ParticleSystem::evalJacobians).
+// Stable at much longer steps than the explicit integrators.
+VectorXf implicitEulerStep(const ParticleSystem& ps, float dt);
+
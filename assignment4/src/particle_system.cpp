@@ -1,4 +1,5 @@
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 using namespace Eigen;
 
 #include "im3d.h"
@@ -8,6 +9,7 @@ using namespace Eigen;
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <limits>
 #include <numeric>
 
 using namespace std;
@@ -54,6 +56,93 @@ inline typename Eigen::MatrixBase<Derived>::PlainObject fDrag(const Eigen::Matri
     return -k*v;
 }
 
+// Below this many particles, stepPositionBased() runs on one thread: every colour of every iteration ends in a
+// barrier, a few hundred per step, and a small cloth has too few springs per colour to pay for them.
+static const int XPBD_PARALLEL_MIN_PARTICLES = 64 * 64;
+
+// Names coordinate d of a state of particles in D dimensions, laid out as described at StateLayout.
+static string particleDimensionName(unsigned d, int D, size_t state_size)
+{
+    static const char* coordinates[] = { ".x", ".y", ".z" };
+    unsigned stride = unsigned(state_size / (2 * D));
+    unsigned array = d / stride;
+    unsigned idx = d % stride;
+    string r = array >= unsigned(D) ? fmt::format("velocity{}", idx) : fmt::format("position{}", idx);
+    return r + coordinates[array % D];
+}
+
+// Derivative of fSpring(pos1, pos2, k, rest_length) with respect to pos2; with respect to pos1, it is the negation.
+// Across a compressed spring the derivative would be negative. It is clamped to zero there, as is usual in implicit
+// cloth, which keeps the matrix of the implicit step positive definite for the conjugate gradient solver.
+template <typename Derived>
+Matrix<float, Derived::RowsAtCompileTime, Derived::RowsAtCompileTime> dfSpring(const Eigen::MatrixBase<Derived>& pos1,
+                                                                               const Eigen::MatrixBase<Derived>& pos2,
+                                                                               float k,
+                                                                               float rest_length)
+{
+    typedef Matrix<float, Derived::RowsAtCompileTime, Derived::RowsAtCompileTime> Block;
+    typename Eigen::MatrixBase<Derived>::PlainObject spring = pos2 - pos1;
+    float length = spring.norm();
+    Block along = spring * spring.transpose() / (length * length);
+    return k * (along + max(0.0f, 1.0f - rest_length / length) * (Block::Identity() - along));
+}
+
+// Jacobians of a system of particles of equal mass under gravity and drag, connected by springs of stiffness k.
+// position(X, i) reads the position of particle i, and fixed(i) tells if it is held in place.
+template <int D, typename Position, typename Fixed>
+void springSystemJacobians(const VectorXf& X, int n, const vector<Spring>& springs, float k, float mass, float drag_k,
+                           Position position, Fixed fixed, ParticleSystem::Jacobians& J)
+{
+    // Coordinate r of particle i is at r * stride + i in either half of the state.
+    const int stride = StateLayout::stride(n);
+    vector<Triplet<float>> triplets;
+    triplets.reserve(springs.size() * 4 * D * D);
+    auto add_block = [&](unsigned i, unsigned j, const Matrix<float, D, D>& block)
+    {
+        if (fixed(i) || fixed(j))
+            return;
+        for (int c = 0; c < D; ++c)
+            for (int r = 0; r < D; ++r)
+                triplets.emplace_back(r * stride + i, c * stride + j, block(r, c));
+    };
+    for (const auto& s : springs)
+    {
+        Matrix<float, D, D> K = dfSpring(position(X, s.i1), position(X, s.i2), k, s.rlen) / mass;
+        add_block(s.i1, s.i1, -K);
+        add_block(s.i1, s.i2, K);
+        add_block(s.i2, s.i1, K);
+        add_block(s.i2, s.i2, -K);
+    }
+    J.dadx.resize(stride * D, stride * D);
+    J.dadx.setFromTriplets(triplets.begin(), triplets.end());
+
+    triplets.clear();
+    for (int r = 0; r < D; ++r)
+        for (int i = 0; i < n; ++i)
+            if (!fixed(i))
+                triplets.emplace_back(r * stride + i, r * stride + i, -drag_k / mass);
+    J.dadv.resize(stride * D, stride * D);
+    J.dadv.setFromTriplets(triplets.begin(), triplets.end());
+}
+
+// Kinetic, gravitational and spring energy of the same kind of system. The particles that are held in place
+// neither move nor lose height, so they are left out.
+template <typename Position, typename Velocity, typename Fixed>
+double springSystemEnergy(const VectorXf& X, int n, const vector<Spring>& springs, float k, float mass,
+                          Position position, Velocity velocity, Fixed fixed)
+{
+    double energy = 0.0;
+    for (int i = 0; i < n; ++i)
+        if (!fixed(i))
+            energy += 0.5 * mass * velocity(X, i).squaredNorm() + 9.8 * mass * position(X, i)(1);
+    for (const auto& s : springs)
+    {
+        double stretch = (position(X, s.i2) - position(X, s.i1)).norm() - s.rlen;
+        energy += 0.5 * k * stretch * stretch;
+    }
+    return energy;
+}
+
 // ----------------------------------------------------------------------------
 // ----------------------------------------------------------------------------
 // Simple system
@@ -66,11 +155,17 @@ void SimpleSystem::reset()
 }
 
 // the derivative at state (x,y) is (-y, x)
-VectorXf SimpleSystem::evalF(const VectorXf& X) const
+void SimpleSystem::evalF(const VectorXf& X, VectorXf& f) const
 {
-    VectorXf f(2);
+    f.resize(2);
     f << -X[1], X[0];
-    return f;
+}
+
+// the motion keeps the point on its circle, so this stands in for the energy
+bool SimpleSystem::evalEnergy(const VectorXf& X, double& energy) const
+{
+    energy = 0.5 * X.squaredNorm();
+    return true;
 }
 
 // draw the state X, as well as lines that mark the path of the actual solution
@@ -107,7 +202,7 @@ void SpringSystem::reset()
 {
     const auto start_pos = Vector2f(0.1f, -0.5f);
     const auto rest_length = 0.5f;
-    current_state_.setZero(2 * 4);	// 2 points that have 4 variables each (2 pos + 2 velocity)
+    current_state_.setZero(StateLayout::size(2, 2));	// 2 points that have 4 variables each (2 pos + 2 velocity)
     position(current_state_, 0) = Vector2f::Zero();  // position of point #0
     velocity(current_state_, 0) = Vector2f::Zero();  // velocity of point #0
     // YOUR CODE HERE (R2)
@@ -128,11 +223,11 @@ void SpringSystem::imgui_interface()
     }
 }
 
-VectorXf SpringSystem::evalF(const VectorXf& X) const
+void SpringSystem::evalF(const VectorXf& X, VectorXf& f) const
 {
-    const auto drag_k = 0.5f;
-    const auto mass = 1.0f;
-    VectorXf f(0*X);	// initialize f into 0*X
+    const auto drag_k = drag_k_;
+    const auto mass = mass_;
+    f.setZero(X.size());
     position(f, 0) = Vector2f::Zero();
     velocity(f, 0) = Vector2f::Zero();
     // YOUR CODE HERE (R2)
@@ -141,16 +236,30 @@ VectorXf SpringSystem::evalF(const VectorXf& X) const
  
     position(f, 1) = velocity(X, 1);
     velocity(f, 1) = ( fGravity2(mass) + fDrag(velocity(X, 1), drag_k) + fSpring(position(X,1), position(X, 0), k_, 0.5f) ) / mass;
+}
+
+bool SpringSystem::evalJacobians(const VectorXf& X, Jacobians& J) const
+{
+    vector<Spring> springs = { Spring(1, 0, k_, 0.5f) };
+    springSystemJacobians<2>(X, 2, springs, k_, mass_, drag_k_,
+                             [](const VectorXf& X, int i) { return position(X, i); },
+                             [](unsigned i) { return i == 0; }, J);
+    return true;
+}
 
-    return f;
+bool SpringSystem::evalEnergy(const VectorXf& X, double& energy) const
+{
+    vector<Spring> springs = { Spring(1, 0, k_, 0.5f) };
+    energy = springSystemEnergy(X, 2, springs, k_, mass_,
+                                [](const VectorXf& X, int i) { return position(X, i); },
+                                [](const VectorXf& X, int i) { return velocity(X, i); },
+                                [](int i) { return i == 0; });
+    return true;
 }
 
 string SpringSystem::dimension_name(unsigned d) const
 {
-    unsigned idx = d >> 2;
-    string r = d & 0x02 ? fmt::format("velocity{}", idx) : fmt::format("position{}", idx);
-    r += d & 0x01 ? ".y" : ".x";
-    return r;
+    return particleDimensionName(d, 2, current_state_.size());
 }
 
 void SpringSystem::render(const VectorXf& state) const
@@ -178,7 +287,7 @@ void MultiPendulumSystem::reset()
 {
     const auto start_point = Vector2f(0.0f, 1.0f);
     Vector2f end_point = start_point + Vector2f(1.5f, 0.1f); // (1.5, 1.1)
-    current_state_.setZero(4 * n_);
+    current_state_.setZero(StateLayout::size(n_, 2));
     springs_.clear(); // clear string array when resetting
     // YOUR CODE HERE (R4)
     // Set the initial state for a pendulum system with n_ particles
@@ -220,10 +329,10 @@ void MultiPendulumSystem::imgui_interface()
     }
 }
 
-VectorXf MultiPendulumSystem::evalF(const VectorXf& X) const
+void MultiPendulumSystem::evalF(const VectorXf& X, VectorXf& dXdt) const
 {
-    const auto mass = 0.5f;
-    VectorXf dXdt(0 * X);	// initialize with 0*X
+    const auto mass = mass_;
+    dXdt.setZero(X.size());
     // YOUR CODE HERE (R4)
     // As in R2, return a derivative of the system state specified by the input vector X.
     position(dXdt, 0) = Vector2f::Zero();
@@ -242,15 +351,28 @@ VectorXf MultiPendulumSystem::evalF(const VectorXf& X) const
         velocity(dXdt, s.i1) += forceSum1 / mass;
         velocity(dXdt, s.i2) += forceSum2 / mass;
     };
-    return dXdt;
+}
+
+bool MultiPendulumSystem::evalJacobians(const VectorXf& X, Jacobians& J) const
+{
+    springSystemJacobians<2>(X, n_, springs_, k_, mass_, drag_k_,
+                             [](const VectorXf& X, int i) { return position(X, i); },
+                             [](unsigned i) { return i == 0; }, J);
+    return true;
+}
+
+bool MultiPendulumSystem::evalEnergy(const VectorXf& X, double& energy) const
+{
+    energy = springSystemEnergy(X, n_, springs_, k_, mass_,
+                                [](const VectorXf& X, int i) { return position(X, i); },
+                                [](const VectorXf& X, int i) { return velocity(X, i); },
+                                [](int i) { return i == 0; });
+    return true;
 }
 
 string MultiPendulumSystem::dimension_name(unsigned d) const
 {
-    unsigned idx = d >> 2;
-    string r = d & 0x02 ? fmt::format("velocity{}", idx) : fmt::format("position{}", idx);
-    r += d & 0x01 ? ".y" : ".x";
-    return r;
+    return particleDimensionName(d, 2, current_state_.size());
 }
 
 void MultiPendulumSystem::render(const VectorXf& X) const
@@ -283,7 +405,7 @@ void ClothSystem::reset()
 {
     const auto width = 1.5f, height = 1.5f; // width and height of the whole grid
     //const auto width = 2.0f, height = 2.0f; // width and height of the whole grid
-    current_state_.setZero(6 * x_ * y_); // 3+3 floats per point
+    current_state_.setZero(StateLayout::size(x_ * y_, 3)); // 3+3 floats per point
     //current_state_.setZero(6 * 9); // 3+3 floats per point
 
     springs_.clear(); // reset springs when resetting system
@@ -376,8 +498,54 @@ void ClothSystem::reset()
             }
         }
     }
+
+    float shortest = numeric_limits<float>::max();
+    for (const auto& s : springs_)
+        shortest = min(shortest, s.rlen);
+    collision_distance_ = 0.5f * shortest;
+
+    // The particles are numbered row by row, so the springs of a particle already reach at most two rows
+    // away, and need no reordering by reverseCuthillMcKee() (see permuteParticles()).
+    adjacency_.build(n, springs_);
+    colourSprings();
+
+    corners_[0] = 0;
+    corners_[1] = x_ - 1;
+    inv_mass_.assign(n, 1.0f / mass_);
+    inv_mass_[corners_[0]] = inv_mass_[corners_[1]] = 0.0f;
 };
 
+void ClothSystem::permuteParticles(const vector<unsigned>& order)
+{
+    const unsigned n = x_ * y_;
+    assert(order.size() == n);
+    vector<unsigned> new_index(n);
+    for (unsigned k = 0; k < n; ++k)
+        new_index[order[k]] = k;
+
+    VectorXf state(current_state_.size());
+    state.setZero();
+    vector<float> inv_mass(n);
+    for (unsigned k = 0; k < n; ++k)
+    {
+        position(state, k) = position(current_state_, order[k]);
+        velocity(state, k) = velocity(current_state_, order[k]);
+        inv_mass[k] = inv_mass_[order[k]];
+    }
+    current_state_ = state;
+    inv_mass_.swap(inv_mass);
+    for (unsigned& corner : corners_)
+        corner = new_index[corner];
+
+    for (auto& s : springs_)
+    {
+        s.i1 = new_index[s.i1];
+        s.i2 = new_index[s.i2];
+    }
+    adjacency_.permute(order);
+    colourSprings();
+}
+
 void ClothSystem::imgui_interface()
 {
     if (ImGui::TreeNodeEx("System parameters", ImGuiTreeNodeFlags_Leaf))
@@ -387,72 +555,282 @@ void ClothSystem::imgui_interface()
                 s.k = k_;
 
         ImGui::SliderFloat("Drag coefficient", &drag_k_, 0.0f, 5.0f);
+        ImGui::Checkbox("Self collisions", &self_collisions_);
+        ImGui::Checkbox("Sphere collider", &sphere_enabled_);
+        ImGui::Checkbox("Position-based (XPBD)", &position_based_);
+        if (position_based_)
+            ImGui::SliderInt("Solver iterations", &solver_iterations_, 1, 100);
 
         ImGui::TreePop();
     }
 }
 
-VectorXf ClothSystem::evalF(const VectorXf& X) const
+void ClothSystem::resolveCollisions()
+{
+    if (!self_collisions_ && !sphere_enabled_)
+        return;
+    const int n = int(x_ * y_);
+
+    points_.resize(n);
+    velocities_.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        points_[i] = position(current_state_, i);
+        velocities_[i] = velocity(current_state_, i);
+    }
+
+    if (self_collisions_)
+    {
+        // The particles are pushed apart from the positions of the step, all at once, so the order doesn't matter.
+        dp_.assign(n, Vector3f::Zero());
+        dv_.assign(n, Vector3f::Zero());
+        hash_.build(points_, collision_distance_);
+        separatePoints(hash_, points_, velocities_, collision_distance_, [](int, int) { return false; }, dp_, dv_);
+        for (int i = 0; i < n; ++i)
+            if (!fixed(i))
+            {
+                points_[i] += dp_[i];
+                velocities_[i] += dv_[i];
+            }
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (sphere_enabled_ && !fixed(i))
+            sphere_.collide(points_[i], velocities_[i]);
+        position(current_state_, i) = points_[i];
+        velocity(current_state_, i) = velocities_[i];
+    }
+}
+
+void ClothSystem::evalF(const VectorXf& X, VectorXf& dXdt) const
 {
     const auto n = x_ * y_;
-    static const auto mass = 0.025f;
-    auto dXdt = VectorXf(0*X);
+    const auto mass = mass_;
+    dXdt.setZero(X.size());
     // YOUR CODE HERE (R5)
     // This will be much like in R2 and R4.
 
-    // YOUR CODE HERE (R4)
-    // As in R2, return a derivative of the system state specified by the input vector X.
-    position(dXdt, 0) = Vector3f::Zero();
-    velocity(dXdt, 0) = Vector3f::Zero();
-
-    position(dXdt, x_ - 1) = Vector3f::Zero();
-    velocity(dXdt, x_ - 1) = Vector3f::Zero();
+    // The derivative is computed over the arrays of the coordinates (see StateLayout). The forces of the springs
+    // are computed first, in the order of their particles, and then every particle gathers the forces of its own
+    // springs (see SpringAdjacency). Both loops write only to their own entries, so they are split between the
+    // threads and vectorized without conflicting updates.
+    const int stride = int(X.size()) / 6;
+    const float* px = &X(0);
+    const float* py = px + stride;
+    const float* pz = py + stride;
+    const float* vx = pz + stride;
+    const float* vy = vx + stride;
+    const float* vz = vy + stride;
+    float* dx = &dXdt(0);   // positions change with the velocities
+    float* dy = dx + stride;
+    float* dz = dy + stride;
+    float* ax = dz + stride;
+    float* ay = ax + stride;
+    float* az = ay + stride;
+    const float k = k_ / mass;
+    const float drag = drag_k_ / mass;
+    const float gravity = fGravity3(mass).y() / mass;
+    const int m = int(adjacency_.first.size());
+    const unsigned* i1 = adjacency_.first.data();
+    const unsigned* i2 = adjacency_.second.data();
+    const float* rlen = adjacency_.rest_length.data();
+    const unsigned* begin = adjacency_.begin.data();
+    const unsigned* neighbour = adjacency_.neighbour.data();
+    const unsigned* spring = adjacency_.spring.data();
+    spring_forces_.resize(3 * m);
+    float* sfx = &spring_forces_(0);
+    float* sfy = sfx + m;
+    float* sfz = sfy + m;
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel
+#endif
+    {
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp for simd
+#endif
+        for (int s = 0; s < m; ++s)
+        {
+            unsigned a = i1[s], b = i2[s];
+            float sx = px[b] - px[a], sy = py[b] - py[a], sz = pz[b] - pz[a];
+            float length = sqrtf(sx * sx + sy * sy + sz * sz);
+            float scale = k * (length - rlen[s]) / length;     // as in fSpring()
+            sfx[s] = scale * sx; sfy[s] = scale * sy; sfz[s] = scale * sz;
+        }
 
-    for (auto i = 0u; i < x_ * y_; ++i) {
-        if (i != 0 && i != x_ - 1) {
-            position(dXdt, i) = velocity(X, i);
-            velocity(dXdt, i) = (fGravity3(mass) + fDrag(velocity(X, i), drag_k_)) / mass;
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp for
+#endif
+        for (int i = 0; i < int(n); ++i)
+        {
+            // The force on the second particle of a spring is the opposite of that on the first.
+            float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+            for (unsigned e = begin[i]; e < begin[i + 1]; ++e)
+            {
+                unsigned s = spring[e];
+                float sign = neighbour[e] > unsigned(i) ? 1.0f : -1.0f;
+                fx += sign * sfx[s]; fy += sign * sfy[s]; fz += sign * sfz[s];
+            }
+            dx[i] = vx[i];
+            dy[i] = vy[i];
+            dz[i] = vz[i];
+            ax[i] = fx - drag * vx[i];
+            ay[i] = fy + gravity - drag * vy[i];
+            az[i] = fz - drag * vz[i];
         }
     }
-    
-    for (const auto& s : springs_) {
 
-        const auto forceSum1 = fSpring(position(X, s.i1), position(X, s.i2), k_, s.rlen);
-        
-        const auto forceSum2 = fSpring(position(X, s.i2), position(X, s.i1), k_, s.rlen);
+    // The top corners are held in place.
+    for (int i : { int(corners_[0]), int(corners_[1]) })
+    {
+        position(dXdt, i) = Vector3f::Zero();
+        velocity(dXdt, i) = Vector3f::Zero();
+    }
+}
 
-        // dont update top corners fixed particles
-        if(s.i1 != 0 && s.i1 != x_ - 1) { 
-            velocity(dXdt, s.i1) += forceSum1 / mass;
+// Each spring is the constraint |p_b - p_a| = rlen with the compliance 1 / k. The positions are first predicted
+// from the velocities, the drag and gravity, then the constraints are projected by Gauss-Seidel iterations in
+// colour order: the springs of a colour share no particles, so they are split between the threads and vectorized
+// like in evalF, and every colour sees the corrections of the colours before it. The new velocities are the
+// changes of the positions over dt.
+void ClothSystem::stepPositionBased(float dt)
+{
+    const int n = int(x_ * y_);
+    const int stride = int(current_state_.size()) / 6;
+    float* px = &current_state_(0);
+    float* py = px + stride;
+    float* pz = py + stride;
+    float* vx = pz + stride;
+    float* vy = vx + stride;
+    float* vz = vy + stride;
+    previous_.resize(3 * stride);
+    float* qx = &previous_(0);
+    float* qy = qx + stride;
+    float* qz = qy + stride;
+    const float drag = drag_k_ / mass_;
+    const float gravity = fGravity3(mass_).y() / mass_;
+    const float* w = inv_mass_.data();
+    const unsigned* i1 = spring_i1_.data();
+    const unsigned* i2 = spring_i2_.data();
+    const float* rlen = spring_rlen_.data();
+    // The compliance scaled by the step; without stiffness there is nothing to project.
+    const float alpha = 1.0f / (k_ * dt * dt);
+    const int iterations = k_ > 0.0f ? solver_iterations_ : 0;
+    lambda_.assign(spring_rlen_.size(), 0.0f);
+    float* lambda = lambda_.data();
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel if(n >= XPBD_PARALLEL_MIN_PARTICLES)
+#endif
+    {
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp for simd
+#endif
+        for (int i = 0; i < n; ++i)
+        {
+            // The fixed corners have no inverse mass, and do not move.
+            float moves = w[i] > 0.0f ? 1.0f : 0.0f;
+            vx[i] -= moves * dt * drag * vx[i];
+            vy[i] += moves * dt * (gravity - drag * vy[i]);
+            vz[i] -= moves * dt * drag * vz[i];
+            qx[i] = px[i]; qy[i] = py[i]; qz[i] = pz[i];
+            px[i] += dt * vx[i]; py[i] += dt * vy[i]; pz[i] += dt * vz[i];
         }
-        if (s.i2 != 0 && s.i2 != x_ -1) { 
-            velocity(dXdt, s.i2) += forceSum2 / mass;
+
+        for (int it = 0; it < iterations; ++it)
+            for (size_t c = 0; c + 1 < colour_begin_.size(); ++c)
+            {
+#ifdef CS_C3100_USE_OPENMP
+                #pragma omp for simd
+#endif
+                for (int s = int(colour_begin_[c]); s < int(colour_begin_[c + 1]); ++s)
+                {
+                    unsigned a = i1[s], b = i2[s];
+                    float sx = px[b] - px[a], sy = py[b] - py[a], sz = pz[b] - pz[a];
+                    float length = sqrtf(sx * sx + sy * sy + sz * sz);
+                    float dlambda = (rlen[s] - length - alpha * lambda[s]) / (w[a] + w[b] + alpha);
+                    lambda[s] += dlambda;
+                    // Moves a and b apart along the spring, by their inverse masses.
+                    float scale = length > 0.0f ? dlambda / length : 0.0f;
+                    px[a] -= w[a] * scale * sx; py[a] -= w[a] * scale * sy; pz[a] -= w[a] * scale * sz;
+                    px[b] += w[b] * scale * sx; py[b] += w[b] * scale * sy; pz[b] += w[b] * scale * sz;
+                }
+            }
+
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp for simd
+#endif
+        for (int i = 0; i < n; ++i)
+        {
+            vx[i] = (px[i] - qx[i]) / dt;
+            vy[i] = (py[i] - qy[i]) / dt;
+            vz[i] = (pz[i] - qz[i]) / dt;
         }
-       
     }
-    
-
-    return dXdt;
 }
 
-string ClothSystem::dimension_name(unsigned d) const
+// Sorts the springs into colours, so that no two springs of a colour share a particle, for stepPositionBased().
+// Each spring gets the first colour that neither of its particles has yet. A particle of the grid has at most
+// 12 springs, so there are at most 23 colours.
+void ClothSystem::colourSprings()
 {
-    unsigned idx = d / 6;
-    unsigned local = d % 6;
-    string r = d >= 3 ? fmt::format("velocity{}", idx) : fmt::format("position{}", idx);
-    switch (d % 3)
+    const unsigned n = x_ * y_;
+    vector<uint32_t> used(n, 0);        // bit c is set if the particle has a spring of colour c
+    vector<unsigned> colour(springs_.size());
+    unsigned num_colours = 0;
+    for (size_t s = 0; s < springs_.size(); ++s)
+    {
+        uint32_t taken = used[springs_[s].i1] | used[springs_[s].i2];
+        unsigned c = 0;
+        while (taken & (1u << c))
+            ++c;
+        assert(c < 32 && "too many springs at a particle");
+        colour[s] = c;
+        used[springs_[s].i1] |= 1u << c;
+        used[springs_[s].i2] |= 1u << c;
+        num_colours = max(num_colours, c + 1);
+    }
+
+    // Counting sort, which keeps the order of the springs within a colour.
+    colour_begin_.assign(num_colours + 1, 0);
+    for (unsigned c : colour)
+        ++colour_begin_[c + 1];
+    partial_sum(colour_begin_.begin(), colour_begin_.end(), colour_begin_.begin());
+    spring_i1_.resize(springs_.size());
+    spring_i2_.resize(springs_.size());
+    spring_rlen_.resize(springs_.size());
+    vector<unsigned> next(colour_begin_.begin(), colour_begin_.end() - 1);
+    for (size_t s = 0; s < springs_.size(); ++s)
     {
-    case 0:
-        r += ".x";
-        break;
-    case 1:
-        r += ".y";
-        break;
-    case 2:
-        r += ".z";
-        break;
+        unsigned slot = next[colour[s]]++;
+        spring_i1_[slot] = springs_[s].i1;
+        spring_i2_[slot] = springs_[s].i2;
+        spring_rlen_[slot] = springs_[s].rlen;
     }
-    return r;
+}
+
+bool ClothSystem::evalJacobians(const VectorXf& X, Jacobians& J) const
+{
+    // The top corners are held in place, like in evalF.
+    springSystemJacobians<3>(X, x_ * y_, springs_, k_, mass_, drag_k_,
+                             [](const VectorXf& X, int i) { return position(X, i); },
+                             [this](unsigned i) { return fixed(i); }, J);
+    return true;
+}
+
+bool ClothSystem::evalEnergy(const VectorXf& X, double& energy) const
+{
+    energy = springSystemEnergy(X, x_ * y_, springs_, k_, mass_,
+                                [](const VectorXf& X, int i) { return position(X, i); },
+                                [](const VectorXf& X, int i) { return velocity(X, i); },
+                                [this](int i) { return fixed(i); });
+    return true;
+}
+
+string ClothSystem::dimension_name(unsigned d) const
+{
+    return particleDimensionName(d, 3, current_state_.size());
 }
 
 void ClothSystem::render(const VectorXf& X) const
@@ -476,22 +854,22 @@ void ClothSystem::render(const VectorXf& X) const
         Im3d::Vertex(p2(0), p2(1), p2(2));
     }
     Im3d::End();
+
+    if (sphere_enabled_)
+        Im3d::DrawSphere(Im3d::Vec3(sphere_.center(0), sphere_.center(1), sphere_.center(2)), sphere_.radius);
 }
 
 
 // sprinkler
 void SprinklerSystem::reset()
 {
-    current_state_.setZero(6 * n_); // n particles
-    alive_particles_.clear();
+    current_state_.setZero(StateLayout::size(n_, 3)); // n particles
+    drops_.count = 0;
 }
 
 // create new particles in each time step
 void SprinklerSystem::emit()
 {
-    const int emitPerFrame = 2;
-    int iEmissions = 0;
-
     Vector3f emittorPos(0.0f, -0.5f, 0.0f);
 
     float minAngle = 3.14159265f / 3.0f;
@@ -500,17 +878,11 @@ void SprinklerSystem::emit()
     float angle = (static_cast<float>(rand()) / RAND_MAX) * (maxAngle - minAngle) + minAngle;
     float speed = 1.0f + static_cast<float>(rand()) / RAND_MAX;
 
-
-    while (iEmissions < emitPerFrame) {
-        auto p = Particle();
-        p.setPosition(emittorPos);
-        p.setVelocity(Vector3f(speed * cos(angle), speed * sin(angle), speed * (static_cast<float>(rand()) / RAND_MAX - 0.5f)/5));
-
-        p.setColor(Vector3f(0.0f, 0.0f, 0.5f + static_cast<float>(rand()) / RAND_MAX * 0.1f));
-
-        alive_particles_.push_back(p);
-
-        ++iEmissions;
+    for (int i = 0; i < emit_per_step_; ++i) {
+        Vector3f velocity(speed * cos(angle), speed * sin(angle), speed * (static_cast<float>(rand()) / RAND_MAX - 0.5f)/5);
+        float blue = 0.5f + static_cast<float>(rand()) / RAND_MAX * 0.1f;
+        if (!drops_.add(emittorPos, velocity, blue))
+            break;
     }
 }
 
@@ -518,29 +890,87 @@ void SprinklerSystem::emit()
 void SprinklerSystem::update(float dt)
 {
     static const auto mass = 0.1f;
+    const float dv = fGravity3(mass).y() * dt;
+
+    for (int i = 0; i < drops_.count; )
+        if (drops_.age[i] > lifetime_)
+            drops_.remove(i);       // the last drop moved here is checked next
+        else
+            ++i;
+
+    const int n = drops_.count;
+    float* px = drops_.px.data(); float* py = drops_.py.data(); float* pz = drops_.pz.data();
+    float* vx = drops_.vx.data(); float* vy = drops_.vy.data(); float* vz = drops_.vz.data();
+    float* age = drops_.age.data();
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for simd
+#endif
+    for (int i = 0; i < n; ++i) {
+        age[i] += dt;
+        vy[i] += dv;
+        px[i] += vx[i] * dt;
+        py[i] += vy[i] * dt;
+        pz[i] += vz[i] * dt;
+    }
+}
 
-    alive_particles_.erase(
-        remove_if(alive_particles_.begin(), alive_particles_.end(),
-            [](const Particle& p) { return p.getAge() > 2.0; }),
-        alive_particles_.end());
-
-    for (auto& particle : alive_particles_) {
-        const float age = particle.getAge();
-        particle.setAge(age + dt);
+void SprinklerSystem::resolveCollisions()
+{
+    const int n = drops_.count;
+    if (particle_collisions_)
+    {
+        points_.resize(n);
+        velocities_.resize(n);
+        for (int i = 0; i < n; ++i)
+        {
+            points_[i] = drops_.position(i);
+            velocities_[i] = drops_.velocity(i);
+        }
+        dp_.assign(n, Vector3f::Zero());
+        dv_.assign(n, Vector3f::Zero());
+        hash_.build(points_, 2.0f * particle_radius_);
+        separatePoints(hash_, points_, velocities_, 2.0f * particle_radius_, [](int, int) { return false; }, dp_, dv_);
+    }
 
-        particle.setVelocity(particle.getVelocity() + fGravity3(mass) * dt);
-        particle.setPosition(particle.getPosition() + particle.getVelocity() * dt);
-        
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+        Vector3f p = drops_.position(i), v = drops_.velocity(i);
+        if (particle_collisions_)
+        {
+            p += dp_[i];
+            v += dv_[i];
+        }
+        bool hit = ground_.collide(p, v);
+        hit |= sphere_.collide(p, v);
+        if (hit || particle_collisions_)
+        {
+            drops_.px[i] = p.x(); drops_.py[i] = p.y(); drops_.pz[i] = p.z();
+            drops_.vx[i] = v.x(); drops_.vy[i] = v.y(); drops_.vz[i] = v.z();
+        }
     }
 }
 
+void SprinklerSystem::imgui_interface()
+{
+    if (ImGui::TreeNodeEx("System parameters", ImGuiTreeNodeFlags_Leaf))
+    {
+        ImGui::SliderInt("Drops per step", &emit_per_step_, 0, 1000);
+        ImGui::SliderFloat("Lifetime", &lifetime_, 0.1f, 5.0f);
+        ImGui::Text("%d drops", drops_.count);
+        ImGui::Checkbox("Particle collisions", &particle_collisions_);
+        ImGui::SliderFloat("Particle radius", &particle_radius_, 0.001f, 0.05f);
+
+        ImGui::TreePop();
+    }
+}
 
-VectorXf SprinklerSystem::evalF(const VectorXf& X) const
+void SprinklerSystem::evalF(const VectorXf& X, VectorXf& dXdt) const
 {
     static const auto mass = 0.025f;
-    VectorXf dXdt(6 * alive_particles_.size());
-
-    return dXdt;
+    dXdt.setZero(X.size());
 }
 
 
@@ -548,16 +978,15 @@ void SprinklerSystem::render(const VectorXf& X) const
 {
     Im3d::BeginPoints();
     Im3d::SetSize(POINT_SIZE / 2.5);
-    for (auto i = 0u; i < alive_particles_.size(); ++i)
+    for (int i = 0; i < drops_.count; ++i)
     {   
-        Vector3f p = alive_particles_[i].getPosition();
-
-        Vector3f color = alive_particles_[i].getColor();
-        Im3d::SetColor(Im3d::Color(color(0), color(1), color(2)));
-
-        Im3d::Vertex(p(0), p(1), p(2));
+        Im3d::SetColor(Im3d::Color(0.0f, 0.0f, drops_.blue[i]));
+        Im3d::Vertex(drops_.px[i], drops_.py[i], drops_.pz[i]);
     }
     Im3d::End();
+
+    Im3d::SetColor(Im3d::Color(1.0f, 1.0f, 1.0f));
+    Im3d::DrawSphere(Im3d::Vec3(sphere_.center(0), sphere_.center(1), sphere_.center(2)), sphere_.radius);
 }
 
 string SprinklerSystem::dimension_name(unsigned d) const
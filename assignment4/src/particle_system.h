@@ -1,5 +1,8 @@
 #pragma once
 
+#include "collisions.h"
+#include "spring_adjacency.h"
+
 // Structure that represents a spring between points i1 and i2
 // k is spring constant
 // rlen is rest length
@@ -12,12 +15,48 @@ struct Spring
     float k, rlen;
 };
 
+// The states of the systems of particles are structures of arrays: the x coordinates of the positions of all the
+// particles, then their y (and z) coordinates, and then the velocities in the same way. Every array is padded to
+// a multiple of StateLayout::padding floats, which keeps the arrays as aligned as the vector, so that passes over
+// one coordinate of all the particles vectorize. The padding stays zero.
+// The position() and velocity() accessors of the systems read the coordinates of a particle with a stride.
+struct StateLayout
+{
+    static const int	padding = 8;
+    // The length of each array for n particles, and the size of their state in D dimensions.
+    static int			stride(int n)               { return (n + padding - 1) / padding * padding; }
+    static int			size(int n, int D)          { return 2 * D * stride(n); }
+};
+
+template <int D> using StateVector = Map<Matrix<float, D, 1>, 0, InnerStride<>>;
+template <int D> using ConstStateVector = Map<const Matrix<float, D, 1>, 0, InnerStride<>>;
+
+template <int D> StateVector<D> statePosition(VectorXf& X, int idx)
+{
+    return StateVector<D>(&X(idx), InnerStride<>(X.size() / (2 * D)));
+}
+template <int D> ConstStateVector<D> statePosition(const VectorXf& X, int idx)
+{
+    return ConstStateVector<D>(&X(idx), InnerStride<>(X.size() / (2 * D)));
+}
+template <int D> StateVector<D> stateVelocity(VectorXf& X, int idx)
+{
+    return StateVector<D>(&X(X.size() / 2 + idx), InnerStride<>(X.size() / (2 * D)));
+}
+template <int D> ConstStateVector<D> stateVelocity(const VectorXf& X, int idx)
+{
+    return ConstStateVector<D>(&X(X.size() / 2 + idx), InnerStride<>(X.size() / (2 * D)));
+}
+
 // Base class for all particle systems
 class ParticleSystem
 {
 public:
     virtual					~ParticleSystem() {};
-    virtual VectorXf		evalF(const VectorXf& X) const = 0;
+    // Computes the derivative of state X into dXdt, resizing it if it isn't the size of X. The integrators pass
+    // in the same vectors at every step, so that evaluating the derivative allocates no memory.
+    virtual void			evalF(const VectorXf& X, VectorXf& dXdt) const = 0;
+    VectorXf				evalF(const VectorXf& X) const { VectorXf dXdt; evalF(X, dXdt); return dXdt; }
 
     // Construct the system anew in an initial state. Always overloaded by the subclasses.
     virtual void			reset() = 0;
@@ -26,6 +65,26 @@ public:
     const VectorXf&			state() const { return current_state_; }
     const vector<Spring>&   springs() const { return springs_; }
     void					set_state(const VectorXf& s) { current_state_ = s; }
+    void					swap_state(VectorXf& s) { current_state_.swap(s); }     // exchanges the buffers, copies nothing
+
+    // The accelerations (the velocity half of evalF) linearized around state X, for implicit integrators:
+    // their derivatives with respect to the positions and to the velocities, in the order of the coordinates
+    // in the halves of the state (see StateLayout). The rows and columns of particles that are held in place,
+    // and of the padding, are zero.
+    struct Jacobians
+    {
+        SparseMatrix<float> dadx, dadv;
+    };
+    // Returns false if the system can't be linearized; by default it can't.
+    virtual bool			evalJacobians(const VectorXf& X, Jacobians& J) const { return false; }
+
+    // The total energy of state X, for checking how well the integrators conserve it. Drag takes energy away,
+    // so it only stays constant without drag. Returns false if the system doesn't define it; by default it doesn't.
+    virtual bool			evalEnergy(const VectorXf& X, double& energy) const { return false; }
+
+    // Moves the particles out of the colliders and out of each other after every step.
+    // Does not have to be overloaded; by default nothing collides.
+    virtual void			resolveCollisions() {}
 
     // Render system as points and lines using Im3d.
     virtual void			render(const VectorXf& X) const = 0;
@@ -52,7 +111,9 @@ class SimpleSystem : public ParticleSystem
 public:
     SimpleSystem()          { reset(); }
 
-    VectorXf				evalF(const VectorXf& X) const override;
+    using ParticleSystem::evalF;
+    void					evalF(const VectorXf& X, VectorXf& dXdt) const override;
+    bool					evalEnergy(const VectorXf& X, double& energy) const override;
 
     void					reset() override;
     void					render(const VectorXf& X) const override;
@@ -68,15 +129,18 @@ class SpringSystem : public ParticleSystem
 public:
     SpringSystem()          { reset(); }
 
-    VectorXf				evalF(const VectorXf&) const override;
+    using ParticleSystem::evalF;
+    void					evalF(const VectorXf& X, VectorXf& dXdt) const override;
+    bool					evalJacobians(const VectorXf& X, Jacobians& J) const override;
+    bool					evalEnergy(const VectorXf& X, double& energy) const override;
 
     // Helper functions to read and write the 2D positions and velocities in state vectors.
     // The Map that is returned acts pretty much like a Vector2f, but its contents are stored in a particular
     // location in the longer state vector. See Eigen's documentation for details.
-    static auto				position(VectorXf& X, int idx)				{ return Map<Vector2f>(&X(idx * 4)); }          // write pos
-    static auto				position(const VectorXf& X, int idx)		{ return Map<const Vector2f>(&X(idx * 4)); }    // read pos
-    static auto				velocity(VectorXf& X, int idx)				{ return Map<Vector2f>(&X(idx * 4 + 2)); }      // write
-    static auto				velocity(const VectorXf& X, int idx)		{ return Map<const Vector2f>(&X(idx * 4 + 2)); }// read
+    static auto				position(VectorXf& X, int idx)				{ return statePosition<2>(X, idx); }    // write pos
+    static auto				position(const VectorXf& X, int idx)		{ return statePosition<2>(X, idx); }    // read pos
+    static auto				velocity(VectorXf& X, int idx)				{ return stateVelocity<2>(X, idx); }    // write
+    static auto				velocity(const VectorXf& X, int idx)		{ return stateVelocity<2>(X, idx); }    // read
 
     void					reset() override;
     void					render(const VectorXf& X) const override;
@@ -87,6 +151,8 @@ public:
 private:
     Spring					spring_;
     float					k_ = 30.0f;
+    float					mass_ = 1.0f;
+    float					drag_k_ = 0.5f;
 };
 
 // ----------------------------------------------------------------------------
@@ -95,13 +161,16 @@ class MultiPendulumSystem : public ParticleSystem
 public:
     MultiPendulumSystem(unsigned n)                                 { n_ = n;  reset(); }
 
-    VectorXf				evalF(const VectorXf&) const override;
+    using ParticleSystem::evalF;
+    void					evalF(const VectorXf& X, VectorXf& dXdt) const override;
+    bool					evalJacobians(const VectorXf& X, Jacobians& J) const override;
+    bool					evalEnergy(const VectorXf& X, double& energy) const override;
 
     // Helper functions to access the 2D positions and velocities in state vectors.
-    static auto				position(VectorXf& X, int idx)          { return Map<Vector2f>(&X(idx * 4)); }
-    static auto				position(const VectorXf& X, int idx)    { return Map<const Vector2f>(&X(idx * 4)); }
-    static auto				velocity(VectorXf& X, int idx)          { return Map<Vector2f>(&X(idx * 4 + 2)); }
-    static auto				velocity(const VectorXf& X, int idx)    { return Map<const Vector2f>(&X(idx * 4 + 2)); }
+    static auto				position(VectorXf& X, int idx)          { return statePosition<2>(X, idx); }
+    static auto				position(const VectorXf& X, int idx)    { return statePosition<2>(X, idx); }
+    static auto				velocity(VectorXf& X, int idx)          { return stateVelocity<2>(X, idx); }
+    static auto				velocity(const VectorXf& X, int idx)    { return stateVelocity<2>(X, idx); }
 
     void					reset() override;
     void					render(const VectorXf& X) const override;
@@ -112,6 +181,7 @@ private:
     unsigned				n_;
     vector<Spring>			springs_;
     float					k_ = 1000.0f;
+    float					mass_ = 0.5f;
     float					drag_k_ = 0.5f;
 };
 
@@ -121,13 +191,24 @@ class ClothSystem : public ParticleSystem
 public:
     ClothSystem(unsigned x, unsigned y)                             { x_ = x; y_ = y; reset(); }
 
-    VectorXf                evalF(const VectorXf&) const override;
+    using ParticleSystem::evalF;
+    // Not reentrant despite the const: the spring forces go through spring_forces_, so two calls on the same
+    // cloth must not run at the same time.
+    void                    evalF(const VectorXf& X, VectorXf& dXdt) const override;
+    bool                    evalJacobians(const VectorXf& X, Jacobians& J) const override;
+    bool                    evalEnergy(const VectorXf& X, double& energy) const override;
+    void                    resolveCollisions() override;
+
+    // Renumbers the particles: the new particle k is the old particle order[k], in the state and in all the
+    // springs (see SpringAdjacency::permute()). The cloth moves the same; reset() numbers it row by row again.
+    void                    permuteParticles(const vector<unsigned>& order);
+    const SpringAdjacency&  adjacency() const                       { return adjacency_; }
 
     // Helper functions to access the 3D positions and velocities in state vectors.
-    static auto             position(VectorXf& X, int idx)          { return Map<Vector3f>(&X(idx * 6)); }
-    static auto             position(const VectorXf& X, int idx)    { return Map<const Vector3f>(&X(idx * 6)); }
-    static auto             velocity(VectorXf& X, int idx)          { return Map<Vector3f>(&X(idx * 6 + 3)); }
-    static auto             velocity(const VectorXf& X, int idx)    { return Map<const Vector3f>(&X(idx * 6 + 3)); }
+    static auto             position(VectorXf& X, int idx)          { return statePosition<3>(X, idx); }
+    static auto             position(const VectorXf& X, int idx)    { return statePosition<3>(X, idx); }
+    static auto             velocity(VectorXf& X, int idx)          { return stateVelocity<3>(X, idx); }
+    static auto             velocity(const VectorXf& X, int idx)    { return stateVelocity<3>(X, idx); }
     //const  vector<Spring>& getSprings() const { return springs_; }
 
     void					reset() override;
@@ -137,35 +218,95 @@ public:
 
     Vector2i				getSize() { return Vector2i(x_, y_); }
 
+    // Advances the cloth by dt with position-based dynamics (XPBD) instead of an integrator: the springs become
+    // distance constraints whose compliance is 1 / k, so the cloth is as stiff as the springs of evalF, but stays
+    // stable at long steps. The constraints are projected solver_iterations_ times, a colour at a time.
+    void					stepPositionBased(float dt);
+    bool					position_based() const			{ return position_based_; }
+    void					set_position_based(bool b)		{ position_based_ = b; }
+    void					set_solver_iterations(int n)	{ solver_iterations_ = n; }
+    bool					self_collisions() const			{ return self_collisions_; }
+    void					set_self_collisions(bool b)		{ self_collisions_ = b; }
+
 private:
+    void					colourSprings();
+    bool					fixed(unsigned i) const			{ return i == corners_[0] || i == corners_[1]; }
+
     unsigned				x_, y_;
+    unsigned				corners_[2];		// the particles held in place, the top corners
     vector<Spring>			springs_;
     float					k_ = 300.0f;		// spring constant
+    float					mass_ = 0.025f;		// of every particle
     float					drag_k_ = 0.08f;	// dragf coefficient
-};
 
+    // The springs of every particle, for evalF, and the force of every spring on its first particle, which
+    // evalF computes before the particles gather them.
+    SpringAdjacency			adjacency_;
+    mutable VectorXf		spring_forces_;
+
+    // The springs again for stepPositionBased(), as arrays sorted by colour: colour c holds the springs
+    // [colour_begin_[c], colour_begin_[c + 1]), and no two of them share a particle.
+    vector<unsigned>		spring_i1_, spring_i2_;
+    vector<float>			spring_rlen_;
+    vector<unsigned>		colour_begin_;
+
+    // Of stepPositionBased(), which the app calls instead of an integrator when position_based_ is set.
+    bool					position_based_ = false;
+    int						solver_iterations_ = 20;
+    vector<float>			inv_mass_;				// of every particle, 0 for the fixed corners
+    vector<float>			lambda_;				// the multiplier of every constraint over a step
+    VectorXf				previous_;				// the positions at the start of the step, laid out like the state
+
+    // Self collisions keep the particles collision_distance_ apart, which is less than any spring is long at rest.
+    // They are off by default: resolving them costs several times as much as evalF.
+    bool					self_collisions_ = false;
+    bool					sphere_enabled_ = false;
+    float					collision_distance_ = 0.0f;
+    SphereCollider			sphere_ = { Vector3f(0.0f, 0.3f, -0.3f), 0.3f };
+    SpatialHash				hash_;
+    vector<Vector3f>		points_, velocities_, dp_, dv_;     // of resolveCollisions(), kept from step to step
+};
 
 
-class Particle {
-public:
-    Particle() { age = 0; };
-    void setAge(float a) { age = a; }
-    float getAge() const { return age; }
-
-    void setPosition(Vector3f pos) { position = pos; }
-    Vector3f getPosition() const { return position; }
-
-    void setVelocity(Vector3f v) { velocity = v; }
-    Vector3f getVelocity() const { return velocity; }
-
-    Vector3f getColor() const { return color_; }
-    void setColor(const Vector3f& c) { color_ = c; }
 
-private:
-    float age;
-    Vector3f color_;
-    Vector3f position;
-    Vector3f velocity;
+// The drops of the sprinkler, in a pool of fixed capacity with an array for every attribute. The live drops are
+// the first count entries: emitting a drop appends it, and a drop that dies is replaced by the last live one,
+// so the pool never allocates or shifts its contents after it has been created.
+struct DropPool
+{
+    static const int		capacity = 1 << 20;
+
+    DropPool()              { for (auto* a : { &px, &py, &pz, &vx, &vy, &vz, &age, &blue }) a->resize(capacity); }
+
+    vector<float>			px, py, pz;
+    vector<float>			vx, vy, vz;
+    vector<float>			age;
+    vector<float>			blue;			// the colour is (0, 0, blue)
+    int						count = 0;
+
+    // Adds a drop if there is room; returns false if the pool is full.
+    bool					add(const Vector3f& p, const Vector3f& v, float b)
+    {
+        if (count == capacity)
+            return false;
+        px[count] = p.x(); py[count] = p.y(); pz[count] = p.z();
+        vx[count] = v.x(); vy[count] = v.y(); vz[count] = v.z();
+        age[count] = 0.0f;
+        blue[count] = b;
+        ++count;
+        return true;
+    }
+    // Kills drop i and moves the last live drop into its place.
+    void					remove(int i)
+    {
+        --count;
+        px[i] = px[count]; py[i] = py[count]; pz[i] = pz[count];
+        vx[i] = vx[count]; vy[i] = vy[count]; vz[i] = vz[count];
+        age[i] = age[count];
+        blue[i] = blue[count];
+    }
+    Vector3f				position(int i) const   { return Vector3f(px[i], py[i], pz[i]); }
+    Vector3f				velocity(int i) const   { return Vector3f(vx[i], vy[i], vz[i]); }
 };
 
 class SprinklerSystem : public ParticleSystem
@@ -173,18 +314,24 @@ class SprinklerSystem : public ParticleSystem
 public:
     SprinklerSystem(unsigned n) { n_ = n;  reset(); }
 
-    VectorXf				evalF(const VectorXf& X) const override;
+    using ParticleSystem::evalF;
+    void					evalF(const VectorXf& X, VectorXf& dXdt) const override;
     
-    static auto             position(VectorXf& X, int idx) { return Map<Vector3f>(&X(idx * 6)); }
-    static auto             position(const VectorXf& X, int idx) { return Map<const Vector3f>(&X(idx * 6)); }
-    static auto             velocity(VectorXf& X, int idx) { return Map<Vector3f>(&X(idx * 6 + 3)); }
-    static auto             velocity(const VectorXf& X, int idx) { return Map<const Vector3f>(&X(idx * 6 + 3)); }
+    static auto             position(VectorXf& X, int idx) { return statePosition<3>(X, idx); }
+    static auto             position(const VectorXf& X, int idx) { return statePosition<3>(X, idx); }
+    static auto             velocity(VectorXf& X, int idx) { return stateVelocity<3>(X, idx); }
+    static auto             velocity(const VectorXf& X, int idx) { return stateVelocity<3>(X, idx); }
 
     void					reset() override;
     void					render(const VectorXf& X) const override;
     string					dimension_name(unsigned d) const override;
     void                    emit();
     void                    update(float dt);
+    void                    set_drops_per_step(int n)   { emit_per_step_ = n; }
+    void                    set_drop_collisions(bool b) { particle_collisions_ = b; }
+    int                     num_drops() const           { return drops_.count; }
+    void                    resolveCollisions() override;
+    void					imgui_interface() override;
 
 private:
     unsigned				n_;
@@ -193,5 +340,16 @@ private:
     float                   colorSpread_ = 0.1f;
     float					drag_k_ = 0.08f;	// dragf coefficient
 
-    vector<Particle>				alive_particles_;
+    DropPool				drops_;
+    int						emit_per_step_ = 2;
+    float					lifetime_ = 2.0f;
+
+    // The drops bounce off the ground and a ball, and off each other if particle_collisions_ is set. That is off
+    // by default: the drops of a step leave the nozzle together, so they crowd a few cells of the hash.
+    bool                    particle_collisions_ = false;
+    float                   particle_radius_ = 0.01f;
+    PlaneCollider           ground_ = { Vector3f(0.0f, 1.0f, 0.0f), -0.75f, 0.3f };
+    SphereCollider          sphere_ = { Vector3f(0.4f, -0.75f, 0.0f), 0.2f, 0.3f };
+    SpatialHash             hash_;
+    vector<Vector3f>        points_, velocities_, dp_, dv_;
 };
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+using namespace std;
+
+#include "spring_adjacency.h"
+
+void SpringAdjacency::buildRows(unsigned n)
+{
+    // Sorts the springs by their particles.
+    const unsigned m = unsigned(first.size());
+    vector<unsigned> sorted(m);
+    iota(sorted.begin(), sorted.end(), 0u);
+    sort(sorted.begin(), sorted.end(), [&](unsigned a, unsigned b)
+    {
+        return first[a] < first[b] || (first[a] == first[b] && second[a] < second[b]);
+    });
+    vector<unsigned> old_first(first), old_second(second);
+    vector<float> old_rest_length(rest_length);
+    for (unsigned s = 0; s < m; ++s)
+    {
+        first[s] = old_first[sorted[s]];
+        second[s] = old_second[sorted[s]];
+        rest_length[s] = old_rest_length[sorted[s]];
+    }
+
+    begin.assign(n + 1, 0);
+    for (unsigned s = 0; s < m; ++s)
+    {
+        ++begin[first[s] + 1];
+        ++begin[second[s] + 1];
+    }
+    partial_sum(begin.begin(), begin.end(), begin.begin());
+    neighbour.resize(begin[n]);
+    spring.resize(begin[n]);
+    // In the order of the springs, a row gets the springs to the particles before it in order, and then the
+    // springs to the particles after it in order, so the rows come out sorted.
+    vector<unsigned> next(begin.begin(), begin.end() - 1);
+    for (unsigned s = 0; s < m; ++s)
+    {
+        neighbour[next[first[s]]] = second[s];
+        spring[next[first[s]]++] = s;
+        neighbour[next[second[s]]] = first[s];
+        spring[next[second[s]]++] = s;
+    }
+}
+
+unsigned SpringAdjacency::bandwidth() const
+{
+    unsigned width = 0;
+    for (size_t s = 0; s < first.size(); ++s)
+        width = max(width, second[s] - first[s]);
+    return width;
+}
+
+void SpringAdjacency::permute(const vector<unsigned>& order)
+{
+    const unsigned n = size();
+    vector<unsigned> new_index(n);
+    for (unsigned k = 0; k < n; ++k)
+        new_index[order[k]] = k;
+    for (size_t s = 0; s < first.size(); ++s)
+    {
+        unsigned a = new_index[first[s]], b = new_index[second[s]];
+        first[s] = min(a, b);
+        second[s] = max(a, b);
+    }
+    buildRows(n);
+}
+
+vector<unsigned> reverseCuthillMcKee(const SpringAdjacency& adjacency)
+{
+    const unsigned n = adjacency.size();
+    auto by_degree = [&](unsigned a, unsigned b) { return adjacency.degree(a) < adjacency.degree(b); };
+    vector<unsigned> starts(n);
+    iota(starts.begin(), starts.end(), 0u);
+    stable_sort(starts.begin(), starts.end(), by_degree);
+
+    vector<unsigned> order;
+    order.reserve(n);
+    vector<bool> visited(n, false);
+    for (unsigned start : starts)
+    {
+        if (visited[start])
+            continue;
+        // The order itself is the queue of the search.
+        visited[start] = true;
+        order.push_back(start);
+        for (size_t head = order.size() - 1; head < order.size(); ++head)
+        {
+            unsigned i = order[head];
+            size_t added = order.size();
+            for (unsigned e = adjacency.begin[i]; e < adjacency.begin[i + 1]; ++e)
+                if (!visited[adjacency.neighbour[e]])
+                {
+                    visited[adjacency.neighbour[e]] = true;
+                    order.push_back(adjacency.neighbour[e]);
+                }
+            stable_sort(order.begin() + added, order.end(), by_degree);
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// The springs of a system, and for every particle the springs it has, as compressed sparse rows. The springs
+// are sorted by their first particle and then by their second, which is always the larger index, and the springs
+// of particle i are the entries [begin[i], begin[i + 1]) of neighbour and spring, sorted by the other particle.
+//
+// The forces are computed in two passes without conflicting writes: first every spring computes its force from
+// the positions of its ends, going through the particles in order, and then every particle gathers the forces of
+// the springs in its row. Each of the passes can be split between threads however is convenient.
+struct SpringAdjacency
+{
+    vector<unsigned>        first, second;          // of every spring, first < second
+    vector<float>           rest_length;
+
+    vector<unsigned>        begin;                  // of the row of every particle, and the end of the last one
+    vector<unsigned>        neighbour;              // the other particle of the spring
+    vector<unsigned>        spring;
+
+    unsigned                size() const                        { return unsigned(begin.size()) - 1; }
+    unsigned                degree(unsigned i) const            { return begin[i + 1] - begin[i]; }
+
+    // Builds the springs and the rows of n particles from springs with the fields i1, i2 and rlen, like Spring.
+    template <typename Springs>
+    void                    build(unsigned n, const Springs& springs)
+    {
+        first.clear();
+        second.clear();
+        rest_length.clear();
+        for (const auto& s : springs)
+        {
+            first.push_back(min(s.i1, s.i2));
+            second.push_back(max(s.i1, s.i2));
+            rest_length.push_back(s.rlen);
+        }
+        buildRows(n);
+    }
+
+    // The largest difference between the indices of two particles joined by a spring. The smaller it is, the
+    // closer together in memory the neighbours of a particle are.
+    unsigned                bandwidth() const;
+
+    // Renumbers the particles: the new particle k is the old particle order[k]. The state of the system must
+    // be reordered the same way.
+    void                    permute(const vector<unsigned>& order);
+
+private:
+    void                    buildRows(unsigned n);
+};
+
+// An order of the particles of a spring network that keeps the particles joined by springs close together, for
+// meshes whose numbering does not (see SpringAdjacency::permute()). The breadth-first search of Cuthill-McKee
+// visits the neighbours of a particle by increasing degree, starting from a particle of the lowest degree in each
+// connected part, and the order is reversed, which gives the same bandwidth with fewer entries inside the band.
+vector<unsigned> reverseCuthillMcKee(const SpringAdjacency& adjacency);
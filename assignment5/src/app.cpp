@@ -26,7 +26,10 @@ using namespace Eigen;      // enables writing "Vector3f" instead of "Eigen::Vec
 #include "object.h"
 #include "camera.h"
 #include "film.h"
+#include "light.h"
+#include "material.h"
 #include "ray_tracer.h"
+#include "ray_recorder.h"
 #include "app.h"
 
 #include <cassert>
@@ -56,7 +59,7 @@ GLFWscrollfun       App::default_scroll_callback_       = nullptr;
 //------------------------------------------------------------------------
 // Defined in main.cpp
 
-shared_ptr<Image4f> render(RayTracer& rt, SceneParser& scene, const Args& args, bool parallelize);
+shared_ptr<Image4f> render(RayTracer& rt, SceneParser& scene, const Args& args, bool parallelize, GBuffer* gbuffer);
 
 //------------------------------------------------------------------------
 
@@ -177,6 +180,8 @@ void App::run()
     pattern2index[Args::Pattern_UniformRandom] = Args::Pattern_UniformRandom;
     pattern2index[Args::Pattern_JitteredRandom] = Args::Pattern_JitteredRandom;
 
+    static array<const char*, 3> bvh_list = { "None", "LBVH", "Binned SAH" };
+
     // MAIN LOOP
     while (!glfwWindowShouldClose(window_))
     {
@@ -266,6 +271,14 @@ void App::run()
                 ImGui::SetNextItemWidth(width);
                 ImGui::SliderInt("Bounces", &args_.bounces, 0, 10);
 
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::SliderFloat("Ray weight cutoff", &args_.weight, 0.0f, 0.1f);
+
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::Checkbox("Russian roulette", &args_.russian_roulette);
+
                 // Samples per pixel. Only allow perfect squares (1, 4, 9, 16, 25, ...) etc.
                 // in order not to break the uniform and jittered samplers.
                 int sqrt_samples_per_pixel = int(sqrtf(args_.samples_per_pixel));
@@ -312,6 +325,10 @@ void App::run()
                 ImGui::SetNextItemWidth(width);
                 ImGui::SliderInt("Random seed", &args_.random_seed, 0, 256);
 
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::Checkbox("Deterministic sampling", &args_.deterministic);
+
                 ImGui::SetCursorPosX(start_x);
                 ImGui::SetNextItemWidth(width);
                 ImGui::Checkbox("Shadows", &args_.shadows);
@@ -324,10 +341,114 @@ void App::run()
                 ImGui::SetNextItemWidth(width);
                 ImGui::Checkbox("Shade backfaces", &args_.shade_back);
 
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::SliderInt("Denoiser passes", &args_.denoise, 0, 5);
+
                 ImGui::SetCursorPosX(start_x);
                 ImGui::SetNextItemWidth(width);
                 ImGui::Checkbox("Show UV", &args_.display_uv);
 
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::Checkbox("Cache primary hits", &cache_primary_hits_);
+
+                // the rays of a region of pixels, recorded during the next render and drawn like the debug ray (E)
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::Checkbox("Record rays", &record_rays_);
+                if (record_rays_)
+                {
+                    ImGui::SetCursorPosX(start_x);
+                    ImGui::SetNextItemWidth(width);
+                    ImGui::InputInt4("Region (x, y, w, h)", record_region_);
+                }
+
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                ImGui::Checkbox("Retained preview", &retained_preview_);
+
+                // acceleration structure; changing it rebuilds the hierarchies right away
+                int selected_bvh = int(args_.bvh);
+                ImGui::SetCursorPosX(start_x);
+                ImGui::SetNextItemWidth(width);
+                if (ImGui::Combo("BVH", &selected_bvh, bvh_list.data(), bvh_list.size()))
+                {
+                    args_.bvh = Args::BVHType(selected_bvh);
+                    scene_->buildArena(args_.bvh);
+                }
+
+                ImGui::TreePop();
+            }
+
+            // Editing the lights and materials doesn't move the primary hits,
+            // so with the cache on the displayed image is just re-shaded.
+            if (scene_ && ImGui::TreeNodeEx("Lights and materials"))
+            {
+                bool edited = false;
+
+                Vector3f color = scene_->getBackgroundColor();
+                if (ImGui::ColorEdit3("Background", color.data()))
+                {
+                    scene_->setBackgroundColor(color);
+                    edited = true;
+                }
+
+                color = scene_->getAmbientLight();
+                if (ImGui::ColorEdit3("Ambient light", color.data()))
+                {
+                    scene_->setAmbientLight(color);
+                    edited = true;
+                }
+
+                for (int i = 0; i < scene_->getNumLights(); ++i)
+                {
+                    auto light = scene_->getLight(i);
+                    // Point light intensities are often well above one.
+                    color = light->getIntensity();
+                    if (ImGui::ColorEdit3(fmt::format("Light {}", i).c_str(), color.data(), ImGuiColorEditFlags_HDR | ImGuiColorEditFlags_Float))
+                    {
+                        light->setIntensity(color);
+                        edited = true;
+                    }
+                }
+
+                for (int i = 0; i < scene_->getNumMaterials(); ++i)
+                {
+                    // Procedural materials get their colors from the materials they mix.
+                    auto m = dynamic_cast<PhongMaterial*>(scene_->getMaterial(i).get());
+                    if (m == nullptr)
+                        continue;
+
+                    ImGui::PushID(i);
+                    ImGui::Text("Material %d", i);
+                    color = m->diffuse_color(Vector3f::Zero());
+                    if (ImGui::ColorEdit3("Diffuse", color.data()))
+                    {
+                        m->set_diffuse_color(color);
+                        edited = true;
+                    }
+                    color = m->specular_color();
+                    if (ImGui::ColorEdit3("Specular", color.data()))
+                    {
+                        m->set_specular_color(color);
+                        edited = true;
+                    }
+                    color = m->reflective_color(Vector3f::Zero());
+                    if (ImGui::ColorEdit3("Reflective", color.data()))
+                    {
+                        m->set_reflective_color(color);
+                        edited = true;
+                    }
+                    ImGui::PopID();
+                }
+
+                // The preview has the diffuse colors baked in.
+                if (edited)
+                    preview_dirty_ = true;
+                if (edited && display_results_)
+                    rayTrace(false);
+
                 ImGui::TreePop();
             }
 
@@ -353,6 +474,7 @@ void App::run()
     }
 
     // Cleanup
+    preview_.release();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImPlot::DestroyContext();
@@ -370,6 +492,9 @@ void App::loadSceneDialog()
     if (!filename.empty())
     {
         scene_.reset(new SceneParser(filename));
+        scene_->buildArena(args_.bvh);
+        gbuffer_.invalidate();
+        preview_dirty_ = true;
         scene_camera_rotation_ = scene_->getCamera()->getOrientation();
 
         Vector3f direction = scene_camera_rotation_.col(2).head(3);
@@ -412,9 +537,10 @@ Matrix4f App::getCamera()
     return C;
 }
 
-void App::copyCamera()
+bool App::copyCamera()
 {
     Matrix4f C = getCamera();
+    bool changed = false;
 
     auto c = scene_->getCamera();
     if (c == nullptr || c->isOrtho() != (camera_type_ == SceneParser::Camera_Orthographic))
@@ -423,15 +549,27 @@ void App::copyCamera()
             scene_->setCamera(make_shared<OrthographicCamera>(Vector3f::Zero(), Vector3f::Zero(), Vector3f::Zero(), .0f));
         else
             scene_->setCamera(make_shared<PerspectiveCamera>(Vector3f::Zero(), Vector3f::Zero(), Vector3f::Zero(), .0f));
+        changed = true;
     }
 
-    scene_->getCamera()->setOrientation(C.block(0, 0, 3, 3).transpose());
+    Matrix3f orientation = C.block(0, 0, 3, 3).transpose();
+    changed |= scene_->getCamera()->getOrientation() != orientation || scene_->getCamera()->getCenter() != camera_position_;
+    scene_->getCamera()->setOrientation(orientation);
     scene_->getCamera()->setCenter(camera_position_);
 
     if (scene_->getCamera()->isOrtho())
-        ((OrthographicCamera*)scene_->getCamera().get())->setSize(ortho_size_);
+    {
+        auto ortho = (OrthographicCamera*)scene_->getCamera().get();
+        changed |= ortho->getSize() != ortho_size_;
+        ortho->setSize(ortho_size_);
+    }
     else
-        ((PerspectiveCamera*)scene_->getCamera().get())->setFov(fov_);
+    {
+        auto perspective = (PerspectiveCamera*)scene_->getCamera().get();
+        changed |= perspective->getFov() != fov_;
+        perspective->setFov(fov_);
+    }
+    return changed;
 }
 
 Args App::get_args()
@@ -460,7 +598,9 @@ void App::initRendering()
 
 void App::rayTrace(bool debug_current_pixel)
 {
-    copyCamera();
+    // Moving the camera moves the primary hits, so the cached ones can't be used anymore.
+    if (copyCamera())
+        gbuffer_.invalidate();
 
     SceneParser& local_scene(*scene_.get());
     auto args = get_args();
@@ -485,7 +625,15 @@ void App::rayTrace(bool debug_current_pixel)
     }
     else
     {
-        result_image_ = ::render(tr, local_scene, args, parallelize_);
+        // Re-shading from the cached primary hits would leave the primary rays out of the recording.
+        RayRecorder& recorder = RayRecorder::instance();
+        if (record_rays_)
+            recorder.start(record_region_[0], record_region_[1], record_region_[0] + record_region_[2], record_region_[1] + record_region_[3], RecordedSegmentsPerThread);
+        else
+            recorder.stop();
+        result_image_ = ::render(tr, local_scene, args, parallelize_, cache_primary_hits_ && !record_rays_ ? &gbuffer_ : nullptr);
+        if (record_rays_)
+            debug_rays_ = recorder.segments();
         shared_ptr<Image4u8> u8img = result_image_->to_uint8();
 
         Vector2i wh = u8img->getSize();
@@ -534,9 +682,21 @@ void App::render(int width, int height, vector<string>& vecStatusMessages)
     if (scene_ != nullptr)
     {
         shared_ptr<GroupObject> group = scene_->getGroup();
-        if(group != nullptr)
+        if (group != nullptr && retained_preview_)
+        {
+            if (preview_dirty_)
+            {
+                preview_.build(*group);
+                preview_dirty_ = false;
+            }
+            preview_.draw(P * C);
+            vecStatusMessages.push_back(fmt::format("Preview: {} triangles, {} instances", preview_.numTriangles(), preview_.numInstances()));
+        }
+        else if (group != nullptr)
             group->preview_render(Matrix4f::Identity());
     }
+    if (record_rays_)
+        vecStatusMessages.push_back(fmt::format("Recorded rays: {} segments, {} overwritten", debug_rays_.size(), RayRecorder::instance().numOverwritten()));
 
     glUseProgram(0);
 
@@ -5,6 +5,8 @@
 #include <memory>
 
 #include "ray_tracer.h"
+#include "gbuffer.h"
+#include "preview_scene.h"
 
 #include "args.h"
 
@@ -18,7 +20,7 @@ public:
 private:
 
     Matrix4f        getCamera();
-    void			copyCamera();
+    bool			copyCamera();	// returns true if the camera changed
 
 private:
                     App             (const App&); // forbid copy
@@ -60,7 +62,17 @@ private:
     shared_ptr<Image4f> result_image_       = nullptr;
     GLuint              gl_texture_         = 0;
 
+    GBuffer             gbuffer_;                       // primary hits of result_image_, for re-shading it when only lights or materials change
+    bool                cache_primary_hits_ = true;
+
     vector<RaySegment> debug_rays_;
+    bool                record_rays_        = false;    // record the rays of record_region_ into debug_rays_ when rendering
+    int                 record_region_[4]   = { 0, 0, 8, 8 };   // x, y, width and height in pixels of the render
+    static const size_t RecordedSegmentsPerThread = 100000;
+
+    PreviewScene        preview_;                       // GPU copy of the scene for the preview, rebuilt when preview_dirty_
+    bool                preview_dirty_      = true;
+    bool                retained_preview_   = true;     // draw preview_ instead of going through Im3d every frame
 
     // ------------------------------------------
     static GLFWkeyfun           default_key_callback_;
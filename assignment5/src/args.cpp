@@ -32,6 +32,45 @@ void Args::parse(const vector<string>& args)
 			height = stoi(*++it);
 		} else if (*it == "-stats") {
 			stats = true;
+		} else if (*it == "-srgb") {
+			srgb = true;
+		} else if (*it == "-cost") {
+			cost_file = *++it;
+		} else if (*it == "-crop") {
+			crop_x = stoi(*++it);
+			crop_y = stoi(*++it);
+			crop_width = stoi(*++it);
+			crop_height = stoi(*++it);
+		}
+		// Image storage
+		else if (*it == "-tile_size") {
+			tile_size = stoi(*++it);
+			if (tile_size < 0 || (tile_size & (tile_size - 1)) != 0) {
+				cerr << "Warning: -tile_size " << tile_size << " is not a power of two, using row-major storage" << endl;
+				tile_size = 0;
+			}
+		} else if (*it == "-aov_storage") {
+			string storage = *++it;
+			if (storage == "float")
+				aov_storage = Aov_Float;
+			else if (storage == "half")
+				aov_storage = Aov_Half;
+			else if (storage == "rgbe")
+				aov_storage = Aov_SharedExponent;
+			else
+				cerr << "Warning: unknown -aov_storage " << storage << ", using float" << endl;
+		}
+		// Acceleration structure
+		else if (*it == "-bvh") {
+			string type = *++it;
+			if (type == "none")
+				bvh = BVH_None;
+			else if (type == "lbvh")
+				bvh = BVH_Linear;
+			else if (type == "sah")
+				bvh = BVH_SAH;
+			else
+				cerr << "Warning: unknown -bvh " << type << ", using none" << endl;
 		}
 		// Rendering options
 		else if (*it == "-depth") {
@@ -40,6 +79,10 @@ void Args::parse(const vector<string>& args)
 			depth_file = *++it;
 		} else if (*it == "-bounces") {
 			bounces = stoi(*++it);
+		} else if (*it == "-weight") {
+			weight = stof(*++it);
+		} else if (*it == "-russian_roulette") {
+			russian_roulette = true;
 		} else if (*it == "-transparent_shadows") {
 			shadows = true;
 			transparent_shadows = true;
@@ -49,6 +92,10 @@ void Args::parse(const vector<string>& args)
 			shade_back = true;
 		} else if (*it == "-uv") {
 			display_uv = true;
+		} else if (*it == "-denoise") {
+			denoise = stoi(*++it);
+		} else if (*it == "-texture_cache") {
+			texture_cache_mb = stoi(*++it);
 		}
 		// Supersampling
 		else if (*it == "-uniform_samples") {
@@ -69,6 +116,10 @@ void Args::parse(const vector<string>& args)
             sampling_pattern = Pattern_JitteredRandom;
             samples_per_pixel = stoi(*++it);
             samples_set = true;
+        } else if (*it == "-deterministic") {
+            deterministic = true;
+        } else if (*it == "-time_budget") {
+            time_budget_ms = stoi(*++it);
         } else if (*it == "-box_filter") {
             if (filter_set)
                 cerr << "Warning: -box_filter specified though filter already set" << endl;
@@ -107,4 +158,4 @@ void Args::parse(const vector<string>& args)
 		else { assert(false && "Unknown argument!"); }
 		++it;
 	}
-}
\ No newline at end of file
+}
\ No newline at end of file
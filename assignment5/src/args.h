@@ -17,24 +17,58 @@ struct Args
 	string  output_file;
 	string  depth_file;
 	string  normals_file;
+	string  cost_file;						// prefix of the per-pixel cost images: time, rays and primitive tests
 	int		width                   = 100;
 	int		height                  = 100;
 	bool	stats                   = false;
+	bool	srgb                    = false;	// encode the color output with the sRGB curve
+	int		crop_x                  = 0;		// render only the pixels in this rectangle; the rest stay transparent black
+	int		crop_y                  = 0;
+	int		crop_width              = 0;		// 0: to the right edge of the image
+	int		crop_height             = 0;		// 0: to the bottom edge
+
+	// Image storage
+
+	int		tile_size               = 0;		// 0: row-major, otherwise tiled with this power-of-two tile size
+
+	enum AovStorageType				// must match AovImage::Storage
+	{
+		Aov_Float,
+		Aov_Half,
+		Aov_SharedExponent
+	};
+	AovStorageType aov_storage      = Aov_Float;
+
+	// Acceleration structure
+
+	enum BVHType
+	{
+		BVH_None,					// intersect every object of a group in turn
+		BVH_Linear,					// LBVH: primitives sorted along a Morton curve
+		BVH_SAH						// binned surface area heuristic
+	};
+	BVHType	bvh                     = BVH_None;
 
 	// Rendering options
 
 	float	depth_min               = 0.0f;
 	float	depth_max               = 1.0f;
 	int		bounces                 = 0;
+	float	weight                  = 0.0f;		// rays that would contribute less than this are not traced (0: trace all)
+	bool	russian_roulette        = false;	// ...but continued at random, with their contribution scaled up to stay unbiased
     bool	transparent_shadows     = false;
 	bool	shadows                 = false;
 	bool	shade_back              = false;
 	bool	display_uv              = false;
+	int		denoise                 = 0;		// passes of the denoiser over the finished image (0: off)
+	int		texture_cache_mb        = 256;		// memory for the tiles of the textures, shared by all of them
 
 	// Supersampling
 
 	int	samples_per_pixel           = 1;
     int random_seed                 = 0;
+	bool deterministic              = false;	// key the random numbers to (pixel, sample, dimension), not to the order of the work
+	int time_budget_ms               = 0;		// average passes of samples_per_pixel samples for as long as they fit in this (0: one pass)
 
     // Parallelism
 
@@ -0,0 +1,607 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "bvh.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#ifdef CS_C3100_USE_OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+// Spreads the low 10 bits of v so that there are two zero bits between each.
+uint32_t expandBits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30-bit Morton code of a point in the unit cube.
+uint32_t mortonCode(const Vector3f& p)
+{
+    Vector3f q = (p * 1024.0f).cwiseMax(0.0f).cwiseMin(1023.0f);
+    return (expandBits(uint32_t(q(0))) << 2) | (expandBits(uint32_t(q(1))) << 1) | expandBits(uint32_t(q(2)));
+}
+
+int countLeadingZeros(uint32_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return v == 0 ? 32 : __builtin_clz(v);
+#else
+    int n = 0;
+    for (uint32_t bit = 0x80000000u; bit != 0 && (v & bit) == 0; bit >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+// Parallel least-significant-digit radix sort of (key, value) pairs, 8 bits at a time.
+// Every thread histograms and scatters its own contiguous chunk, which keeps the sort stable.
+void radixSort(vector<uint32_t>& keys, vector<int>& values, int key_bits)
+{
+    const int n = int(keys.size());
+    vector<uint32_t> keys_tmp(n);
+    vector<int> values_tmp(n);
+
+#ifdef CS_C3100_USE_OPENMP
+    const int max_threads = omp_get_max_threads();
+#else
+    const int max_threads = 1;
+#endif
+    vector<int> offsets(max_threads * 256);
+
+    for (int shift = 0; shift < key_bits; shift += 8)
+    {
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp parallel
+#endif
+        {
+#ifdef CS_C3100_USE_OPENMP
+            const int thread = omp_get_thread_num();
+            const int num_threads = omp_get_num_threads();
+#else
+            const int thread = 0;
+            const int num_threads = 1;
+#endif
+            const int begin = int(int64_t(n) * thread / num_threads);
+            const int end = int(int64_t(n) * (thread + 1) / num_threads);
+
+            int* histogram = &offsets[thread * 256];
+            fill(histogram, histogram + 256, 0);
+            for (int i = begin; i < end; ++i)
+                ++histogram[(keys[i] >> shift) & 0xFF];
+
+#ifdef CS_C3100_USE_OPENMP
+            #pragma omp barrier
+            #pragma omp single
+#endif
+            {
+                // Exclusive prefix sum, digit-major so that earlier chunks go first within each digit.
+                int sum = 0;
+                for (int digit = 0; digit < 256; ++digit)
+                    for (int t = 0; t < num_threads; ++t)
+                    {
+                        int c = offsets[t * 256 + digit];
+                        offsets[t * 256 + digit] = sum;
+                        sum += c;
+                    }
+            }
+
+            for (int i = begin; i < end; ++i)
+            {
+                int dst = histogram[(keys[i] >> shift) & 0xFF]++;
+                keys_tmp[dst] = keys[i];
+                values_tmp[dst] = values[i];
+            }
+        }
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+// Quantizes the child boxes to 8 bits relative to the parent box, rounding outwards so that
+// the decoded boxes always contain the originals.
+void quantizeNode(WideBVH::Node& node, const AABB& box, const AABB* child_boxes)
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float origin = box.min(axis);
+        float extent = box.max(axis) - origin;
+
+        // The smallest power of two step for which 255 steps from the origin reach the end of the box.
+        int e = -126;
+        if (extent > 0.0f)
+            e = std::max(-126, std::min(127, int(ceil(log2(extent / 255.0f)))));
+        while (e < 127 && 255.0f * WideBVH::exponentScale(e) + origin < box.max(axis))
+            ++e;
+        float scale = WideBVH::exponentScale(e);
+
+        node.origin[axis] = origin;
+        node.exponent[axis] = int8_t(e);
+        for (int i = 0; i < WideBVH::Width; ++i)
+        {
+            if (i >= node.num_children)
+            {
+                node.lo[axis][i] = node.hi[axis][i] = 0;
+                continue;
+            }
+            const AABB& b = child_boxes[i];
+            int lo = std::max(0, std::min(255, int(floor((b.min(axis) - origin) / scale))));
+            while (lo > 0 && float(lo) * scale + origin > b.min(axis))
+                --lo;
+            int hi = std::max(0, std::min(255, int(ceil((b.max(axis) - origin) / scale))));
+            while (hi < 255 && float(hi) * scale + origin < b.max(axis))
+                ++hi;
+            node.lo[axis][i] = uint8_t(lo);
+            node.hi[axis][i] = uint8_t(hi);
+        }
+    }
+}
+
+} // namespace
+
+void BVH::build(const vector<AABB>& prim_bounds, Args::BVHType type)
+{
+    clear();
+    if (prim_bounds.empty() || type == Args::BVH_None)
+        return;
+
+    if (prim_bounds.size() == 1)
+    {
+        nodes_.resize(1);
+        nodes_[0].box = prim_bounds[0];
+        nodes_[0].count = 1;
+        indices_.assign(1, 0);
+        return;
+    }
+
+    if (type == Args::BVH_Linear)
+        buildLinear(prim_bounds);
+    else if (type == Args::BVH_SAH)
+        buildSAH(prim_bounds);
+    else
+        assert(false && "Bad BVH type");
+}
+
+void BVH::buildLinear(const vector<AABB>& prim_bounds)
+{
+    const int n = int(prim_bounds.size());
+
+    // Bounds of the primitive centers, for normalizing them into the unit cube.
+    AABB centroid_bounds;
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel
+#endif
+    {
+        AABB local;
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp for nowait
+#endif
+        for (int i = 0; i < n; ++i)
+            local.grow(prim_bounds[i].center());
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp critical
+#endif
+        centroid_bounds.grow(local);
+    }
+    Vector3f extent = (centroid_bounds.max - centroid_bounds.min).cwiseMax(FLT_MIN);
+
+    vector<uint32_t> codes(n);
+    indices_.resize(n);
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+        codes[i] = mortonCode((prim_bounds[i].center() - centroid_bounds.min).cwiseQuotient(extent));
+        indices_[i] = i;
+    }
+
+    radixSort(codes, indices_, 30);
+
+    // Inner nodes are [0, n-1) and leaf k, holding the k'th primitive in Morton order, is n-1+k.
+    // Inner node i covers a range of leaves that starts or ends at leaf i, and the ranges can be
+    // found independently from the longest common prefixes of the sorted codes.
+    // Equal codes are told apart by their position, as if it were appended to the code.
+    nodes_.assign(2 * n - 1, Node());
+    auto common_prefix = [&](int i, int j) {
+        if (j < 0 || j >= n)
+            return -1;
+        if (codes[i] == codes[j])
+            return 32 + countLeadingZeros(uint32_t(i ^ j));
+        return countLeadingZeros(codes[i] ^ codes[j]);
+    };
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+        Node& leaf = nodes_[n - 1 + i];
+        leaf.first = i;
+        leaf.count = 1;
+        leaf.box = prim_bounds[indices_[i]];
+    }
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n - 1; ++i)
+    {
+        // Direction of the range, and its other end by exponential then binary search.
+        int d = common_prefix(i, i + 1) > common_prefix(i, i - 1) ? 1 : -1;
+        int min_prefix = common_prefix(i, i - d);
+        int max_length = 2;
+        while (common_prefix(i, i + max_length * d) > min_prefix)
+            max_length *= 2;
+        int length = 0;
+        for (int step = max_length / 2; step >= 1; step /= 2)
+            if (common_prefix(i, i + (length + step) * d) > min_prefix)
+                length += step;
+        int j = i + length * d;
+
+        // Split where the common prefix with the first leaf of the range becomes shorter.
+        int node_prefix = common_prefix(i, j);
+        int split = 0;
+        for (int step = (length + 1) / 2; ; step = (step + 1) / 2)
+        {
+            if (common_prefix(i, i + (split + step) * d) > node_prefix)
+                split += step;
+            if (step == 1)
+                break;
+        }
+        int gamma = i + split * d + min(d, 0);
+
+        Node& node = nodes_[i];
+        node.left = (min(i, j) == gamma) ? n - 1 + gamma : gamma;
+        node.right = (max(i, j) == gamma + 1) ? n - 1 + gamma + 1 : gamma + 1;
+        nodes_[node.left].parent = i;
+        nodes_[node.right].parent = i;
+    }
+
+    // The leaves already have their boxes.
+    propagateBounds();
+}
+
+void BVH::buildSAH(const vector<AABB>& prim_bounds)
+{
+    const int n = int(prim_bounds.size());
+
+    vector<Vector3f> centroids(n);
+    indices_.resize(n);
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i)
+    {
+        centroids[i] = prim_bounds[i].center();
+        indices_[i] = i;
+    }
+
+    // A binary tree with at least one primitive per leaf has at most 2n-1 nodes.
+    nodes_.assign(2 * n - 1, Node());
+    node_count_ = 1;
+
+    // The top of the tree is built serially until the subtrees are small enough to keep all the threads
+    // busy, and then the subtrees are built in parallel. (This sticks to OpenMP 2.0, which has no tasks.)
+#ifdef CS_C3100_USE_OPENMP
+    const int num_threads = omp_get_max_threads();
+#else
+    const int num_threads = 1;
+#endif
+    vector<SAHJob> jobs;
+    int job_threshold = max(1024, n / (8 * num_threads));
+    buildSAHNode(prim_bounds, centroids, SAHJob{ 0, -1, 0, n, 1 }, &jobs, job_threshold);
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int i = 0; i < int(jobs.size()); ++i)
+        buildSAHNode(prim_bounds, centroids, jobs[i], nullptr, 0);
+
+    nodes_.resize(node_count_);
+}
+
+void BVH::buildSAHNode(const vector<AABB>& prim_bounds, const vector<Vector3f>& centroids, const SAHJob& job, vector<SAHJob>* deferred, int job_threshold)
+{
+    const int first = job.first, count = job.count;
+
+    AABB box, centroid_box;
+    for (int i = first; i < first + count; ++i)
+    {
+        box.grow(prim_bounds[indices_[i]]);
+        centroid_box.grow(centroids[indices_[i]]);
+    }
+
+    Node& node = nodes_[job.node];
+    node.box = box;
+    node.parent = job.parent;
+    node.first = first;
+    node.count = count;
+
+    const int max_leaf_size = 4;
+    if (count <= max_leaf_size)
+        return;
+
+    // Skewed inputs can make the SAH peel off a few primitives per level. Once the remaining depth
+    // could run out, the node is split at the median instead, which needs ceil(log2(count)) more levels.
+    int median_levels = 0;
+    while ((max_leaf_size << median_levels) < count)
+        ++median_levels;
+    if (job.depth + median_levels >= MaxDepth)
+    {
+        int axis;
+        (centroid_box.max - centroid_box.min).maxCoeff(&axis);
+        int mid = first + count / 2;
+        nth_element(indices_.begin() + first, indices_.begin() + mid, indices_.begin() + first + count, [&](int a, int b) {
+            return centroids[a](axis) < centroids[b](axis);
+        });
+        splitSAHNode(prim_bounds, centroids, job, mid, deferred, job_threshold);
+        return;
+    }
+
+    // Bin the primitive centers along each axis and evaluate the SAH cost of splitting between the bins.
+    const int num_bins = 16;
+    float best_cost = FLT_MAX;
+    int best_axis = -1, best_split = 0;
+    Vector3f extent = centroid_box.max - centroid_box.min;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (extent(axis) <= 0.0f)
+            continue;
+
+        AABB bin_boxes[num_bins];
+        int bin_counts[num_bins] = {};
+        float scale = num_bins / extent(axis);
+        for (int i = first; i < first + count; ++i)
+        {
+            int b = min(num_bins - 1, int((centroids[indices_[i]](axis) - centroid_box.min(axis)) * scale));
+            bin_boxes[b].grow(prim_bounds[indices_[i]]);
+            ++bin_counts[b];
+        }
+
+        // Sweep from the right to get the area and count of everything right of each split,
+        // then from the left to combine it with the left side.
+        float right_area[num_bins];
+        int right_count[num_bins];
+        AABB right_box;
+        int right_sum = 0;
+        for (int b = num_bins - 1; b > 0; --b)
+        {
+            right_box.grow(bin_boxes[b]);
+            right_sum += bin_counts[b];
+            right_area[b] = right_box.area();
+            right_count[b] = right_sum;
+        }
+        AABB left_box;
+        int left_sum = 0;
+        for (int b = 1; b < num_bins; ++b)
+        {
+            left_box.grow(bin_boxes[b - 1]);
+            left_sum += bin_counts[b - 1];
+            if (left_sum == 0 || right_count[b] == 0)
+                continue;
+            float cost = left_box.area() * left_sum + right_area[b] * right_count[b];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis < 0)
+    {
+        // All the centers coincide; any split is as good as another.
+        mid = first + count / 2;
+    }
+    else
+    {
+        // Splitting costs one more box test than a leaf, relative to one primitive test.
+        float leaf_cost = float(count);
+        float split_cost = 1.0f + best_cost / max(box.area(), FLT_MIN);
+        if (split_cost >= leaf_cost && count <= 4 * max_leaf_size)
+            return;
+
+        float scale = num_bins / extent(best_axis);
+        float lo = centroid_box.min(best_axis);
+        mid = int(partition(indices_.begin() + first, indices_.begin() + first + count, [&](int p) {
+            return min(num_bins - 1, int((centroids[p](best_axis) - lo) * scale)) < best_split;
+        }) - indices_.begin());
+    }
+
+    splitSAHNode(prim_bounds, centroids, job, mid, deferred, job_threshold);
+}
+
+void BVH::splitSAHNode(const vector<AABB>& prim_bounds, const vector<Vector3f>& centroids, const SAHJob& job, int mid, vector<SAHJob>* deferred, int job_threshold)
+{
+    const int first = job.first, count = job.count;
+
+    // The two children are allocated next to each other.
+    int left = node_count_.fetch_add(2);
+    Node& node = nodes_[job.node];
+    node.left = left;
+    node.right = left + 1;
+    node.count = 0;
+
+    SAHJob children[2] = { SAHJob{ left, job.node, first, mid - first, job.depth + 1 }, SAHJob{ left + 1, job.node, mid, first + count - mid, job.depth + 1 } };
+    for (const SAHJob& child : children)
+    {
+        if (deferred && child.count <= job_threshold)
+            deferred->push_back(child);
+        else
+            buildSAHNode(prim_bounds, centroids, child, deferred, job_threshold);
+    }
+}
+
+void BVH::refit(const vector<AABB>& prim_bounds)
+{
+    assert(indices_.size() == prim_bounds.size());
+    const int num_nodes = int(nodes_.size());
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < num_nodes; ++i)
+    {
+        Node& node = nodes_[i];
+        if (!node.isLeaf())
+            continue;
+        node.box = AABB();
+        for (int k = node.first; k < node.first + node.count; ++k)
+            node.box.grow(prim_bounds[indices_[k]]);
+    }
+
+    propagateBounds();
+}
+
+void BVH::propagateBounds()
+{
+    // Every leaf walks up towards the root. The first of the two children to reach an inner node
+    // stops there; the second one knows that both boxes are ready, so it computes the union and continues.
+    const int num_nodes = int(nodes_.size());
+    unique_ptr<atomic<int>[]> arrivals(new atomic<int>[num_nodes]);
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < num_nodes; ++i)
+        arrivals[i].store(0, memory_order_relaxed);
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < num_nodes; ++i)
+    {
+        if (!nodes_[i].isLeaf())
+            continue;
+        int parent = nodes_[i].parent;
+        while (parent >= 0 && arrivals[parent].fetch_add(1, memory_order_acq_rel) == 1)
+        {
+            Node& node = nodes_[parent];
+            node.box = nodes_[node.left].box;
+            node.box.grow(nodes_[node.right].box);
+            parent = node.parent;
+        }
+    }
+}
+
+void WideBVH::build(const BVH& bvh)
+{
+    clear();
+    if (bvh.empty())
+        return;
+
+    indices_ = bvh.indices();
+    collapse(bvh, 0);
+    refit(bvh);
+}
+
+int WideBVH::collapse(const BVH& bvh, int node)
+{
+    const vector<BVH::Node>& nodes = bvh.nodes();
+
+    // Open up the binary subtree, always expanding the inner child with the largest box, until there are Width children.
+    // The binary leaves are kept as they are: merging small subtrees into one leaf trades cheap box tests
+    // for virtual calls to the primitives. Subtrees with empty boxes are dropped.
+    int children[Width];
+    int num_children = 0;
+    if (nodes[node].isLeaf())
+        children[num_children++] = node;
+    else
+    {
+        children[num_children++] = nodes[node].left;
+        children[num_children++] = nodes[node].right;
+    }
+    while (num_children < Width)
+    {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < num_children; ++i)
+        {
+            const BVH::Node& c = nodes[children[i]];
+            if (!c.isLeaf() && c.box.area() > best_area)
+            {
+                best = i;
+                best_area = c.box.area();
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = nodes[opened].left;
+        children[num_children++] = nodes[opened].right;
+    }
+
+    const int index = int(nodes_.size());
+    nodes_.emplace_back();
+    sources_.emplace_back();
+    sources_[index].node = node;
+
+    int n = 0;
+    for (int i = 0; i < num_children; ++i)
+    {
+        int c = children[i];
+        if (nodes[c].box.isEmpty())
+            continue;
+        sources_[index].children[n] = c;
+        if (nodes[c].isLeaf())
+        {
+            assert(nodes[c].count > 0 && nodes[c].count <= 255);
+            nodes_[index].child[n] = ~nodes[c].first;
+            nodes_[index].count[n] = uint8_t(nodes[c].count);
+        }
+        else
+        {
+            // Children follow their parent depth-first. nodes_ may grow in the call, so the reference is taken after it.
+            int child = collapse(bvh, c);
+            nodes_[index].child[n] = child;
+            nodes_[index].count[n] = 0;
+        }
+        ++n;
+    }
+    nodes_[index].num_children = uint8_t(n);
+    for (int i = n; i < Width; ++i)
+    {
+        sources_[index].children[i] = -1;
+        nodes_[index].child[i] = 0;
+        nodes_[index].count[i] = 0;
+    }
+    return index;
+}
+
+void WideBVH::refit(const BVH& bvh)
+{
+    const vector<BVH::Node>& nodes = bvh.nodes();
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < int(nodes_.size()); ++i)
+    {
+        const Source& source = sources_[i];
+        AABB child_boxes[Width];
+        for (int k = 0; k < nodes_[i].num_children; ++k)
+            child_boxes[k] = nodes[source.children[k]].box;
+        quantizeNode(nodes_[i], nodes[source.node].box, child_boxes);
+    }
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "args.h"
+#include "hit.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+// Axis-aligned bounding box. The default box is empty; unbounded objects (planes) have an infinite box.
+struct AABB
+{
+    AABB() :
+        min(Vector3f::Constant(numeric_limits<float>::infinity())),
+        max(Vector3f::Constant(-numeric_limits<float>::infinity()))
+    {}
+    AABB(const Vector3f& min, const Vector3f& max) : min(min), max(max) {}
+
+    static AABB infinite() { return AABB(Vector3f::Constant(-numeric_limits<float>::infinity()), Vector3f::Constant(numeric_limits<float>::infinity())); }
+
+    bool        isEmpty() const     { return (min.array() > max.array()).any(); }
+    bool        isBounded() const   { return isEmpty() || (min.allFinite() && max.allFinite()); }
+    Vector3f    center() const      { return 0.5f * (min + max); }
+
+    void grow(const Vector3f& p)    { min = min.cwiseMin(p); max = max.cwiseMax(p); }
+    void grow(const AABB& b)        { min = min.cwiseMin(b.min); max = max.cwiseMax(b.max); }
+
+    float area() const
+    {
+        if (isEmpty())
+            return 0.0f;
+        Vector3f d = max - min;
+        return 2.0f * (d(0) * d(1) + d(1) * d(2) + d(2) * d(0));
+    }
+
+    // Box of the eight corners of this box under an affine transformation.
+    AABB transformed(const Matrix4f& m) const
+    {
+        if (isEmpty() || !isBounded())
+            return isEmpty() ? AABB() : AABB::infinite();
+        AABB result;
+        for (int i = 0; i < 8; ++i)
+        {
+            Vector4f corner(i & 1 ? max(0) : min(0), i & 2 ? max(1) : min(1), i & 4 ? max(2) : min(2), 1.0f);
+            result.grow(Vector3f((m * corner).head<3>()));
+        }
+        return result;
+    }
+
+    // Slab test of the ray segment [tmin, tmax] against the box. inv_dir is the componentwise
+    // inverse of the ray direction. On a hit, t_entry is where the segment enters the box.
+    bool intersect(const Vector3f& origin, const Vector3f& inv_dir, float tmin, float tmax, float& t_entry) const
+    {
+        Array3f t0 = (min - origin).array() * inv_dir.array();
+        Array3f t1 = (max - origin).array() * inv_dir.array();
+        float t_near = std::max(t0.min(t1).maxCoeff(), tmin);
+        float t_far = std::min(t0.max(t1).minCoeff(), tmax);
+        t_entry = t_near;
+        return t_near <= t_far;
+    }
+
+    Vector3f min;
+    Vector3f max;
+};
+
+// Binary bounding volume hierarchy over a set of primitives given by their bounding boxes.
+// The hierarchy only stores primitive indices; rays traverse the WideBVH collapsed from it.
+// Both builders run in parallel when OpenMP is enabled:
+//  - Args::BVH_Linear sorts the primitives along a Morton curve and emits the whole hierarchy at once
+//    (Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees").
+//  - Args::BVH_SAH splits top-down with the binned surface area heuristic, building the subtrees in parallel.
+class BVH
+{
+public:
+    struct Node
+    {
+        AABB    box;
+        int     left    = -1;   // child nodes, -1 in leaves; inner nodes always have both
+        int     right   = -1;
+        int     parent  = -1;   // -1 in the root
+        int     first   = 0;    // leaves: the primitives are indices()[first, first + count)
+        int     count   = 0;
+
+        bool isLeaf() const { return left < 0; }
+    };
+
+    // Bound on the number of nodes from the root to any leaf, which lets traversal use a fixed-size stack.
+    // The linear builder stays within it because every level lengthens the common prefix of the 30-bit
+    // Morton codes extended by the position. The SAH builder switches to median splits where it could exceed it.
+    static const int MaxDepth = 64;
+
+    // Builds the hierarchy. The root is node 0.
+    void build(const vector<AABB>& prim_bounds, Args::BVHType type);
+
+    // Recomputes all the boxes for moved primitives, keeping the tree structure.
+    // The number and order of primitives must be the same as in build().
+    void refit(const vector<AABB>& prim_bounds);
+
+    void clear() { nodes_.clear(); indices_.clear(); }
+
+    bool                    empty() const   { return nodes_.empty(); }
+    const vector<Node>&     nodes() const   { return nodes_; }
+    const vector<int>&      indices() const { return indices_; }
+    AABB                    bounds() const  { return empty() ? AABB() : nodes_[0].box; }
+
+private:
+    void buildLinear(const vector<AABB>& prim_bounds);
+    void buildSAH(const vector<AABB>& prim_bounds);
+    void propagateBounds();
+
+    // A node for the SAH builder to fill in from the primitives indices()[first, first + count).
+    struct SAHJob
+    {
+        int node, parent, first, count, depth;
+    };
+    // Builds the subtree of the job. If deferred is given, subtrees of at most job_threshold primitives are left there to build later.
+    void buildSAHNode(const vector<AABB>& prim_bounds, const vector<Vector3f>& centroids, const SAHJob& job, vector<SAHJob>* deferred, int job_threshold);
+    // Makes the job's node an inner node whose children hold indices()[first, mid) and [mid, first + count), and builds or defers them.
+    void splitSAHNode(const vector<AABB>& prim_bounds, const vector<Vector3f>& centroids, const SAHJob& job, int mid, vector<SAHJob>* deferred, int job_threshold);
+
+    vector<Node>    nodes_;
+    vector<int>     indices_;
+    atomic<int>     node_count_{ 0 };   // nodes allocated so far by the SAH builder
+};
+
+
+// Four-wide hierarchy collapsed from a BVH, used for traversal. Each node fills one 64-byte cache line and holds
+// the boxes of its children quantized to 8 bits per coordinate relative to the node's own box, so one node
+// replaces about three binary nodes in half their memory, and the four boxes are tested at once with 4-wide
+// array operations. The nodes are laid out depth-first in a single cache-line-aligned array.
+// (Ylitie et al. 2017, "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs")
+class WideBVH
+{
+public:
+    static const int Width = 4;
+
+    struct alignas(64) Node
+    {
+        float       origin[3];          // minimum corner of the node's box
+        int8_t      exponent[3];        // the child boxes are quantized in steps of 2^exponent along each axis
+        uint8_t     num_children = 0;
+        uint8_t     lo[3][Width];       // per axis and child: the box is origin + [lo, hi] * 2^exponent, rounded outwards
+        uint8_t     hi[3][Width];
+        int32_t     child[Width];       // index of an inner child node, or ~first for a leaf child
+        uint8_t     count[Width];       // leaf children: the primitives are indices()[first, first + count); 0 for inner children
+    };
+
+    // Collapses the hierarchy. The root is node 0.
+    void build(const BVH& bvh);
+
+    // Re-quantizes the boxes after bvh.refit(), keeping the tree structure.
+    void refit(const BVH& bvh);
+
+    void clear() { nodes_.clear(); indices_.clear(); sources_.clear(); }
+
+    bool                    empty() const   { return nodes_.empty(); }
+    const vector<Node>&     nodes() const   { return nodes_; }
+    const vector<int>&      indices() const { return indices_; }
+
+    // Finds the closest hit among the primitives. intersect_prim(i) must intersect the ray with primitive i,
+    // update h on a closer hit and return whether it found one. Subtrees behind h.t are skipped.
+    template<typename IntersectFunc>
+    bool intersect(const Ray& r, Hit& h, float tmin, IntersectFunc&& intersect_prim) const;
+
+    // 2^e for -126 <= e <= 127, built directly from the bits of the float.
+    static float exponentScale(int e)
+    {
+        uint32_t bits = uint32_t(e + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+
+private:
+    // The binary nodes a wide node was collapsed from: its own box and the boxes of its children.
+    struct Source
+    {
+        int node;
+        int children[Width];
+    };
+    int collapse(const BVH& bvh, int node);
+
+    vector<Node>    nodes_;
+    vector<int>     indices_;
+    vector<Source>  sources_;
+};
+
+template<typename IntersectFunc>
+bool WideBVH::intersect(const Ray& r, Hit& h, float tmin, IntersectFunc&& intersect_prim) const
+{
+    if (nodes_.empty())
+        return false;
+
+    Vector3f inv_dir = r.direction.cwiseInverse();
+    bool intersected = false;
+
+    // Depth-first, visiting the nearer children first so that h.t shrinks as early as possible.
+    // Each level adds at most Width - 1 entries, and there are at most BVH::MaxDepth levels,
+    // since every wide node replaces at least one level of the binary tree.
+    struct Entry
+    {
+        int     child;
+        int     count;
+        float   t_entry;
+    };
+    const int max_stack_size = 1 + (Width - 1) * BVH::MaxDepth;
+    Entry stack[max_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = Entry{ 0, 0, tmin };
+
+    while (stack_size > 0)
+    {
+        const Entry entry = stack[--stack_size];
+        if (entry.t_entry > h.t)
+            continue;
+        if (entry.count > 0)
+        {
+            for (int i = ~entry.child; i < ~entry.child + entry.count; ++i)
+                if (intersect_prim(indices_[i]))
+                    intersected = true;
+            continue;
+        }
+
+        // Decode the child boxes and slab test all of them against the ray.
+        const Node& node = nodes_[entry.child];
+        Array4f t_near = Array4f::Constant(tmin);
+        Array4f t_far = Array4f::Constant(h.t);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float scale = exponentScale(node.exponent[axis]);
+            Array4f lo = Map<const Array<uint8_t, Width, 1>>(node.lo[axis]).cast<float>() * scale + node.origin[axis];
+            Array4f hi = Map<const Array<uint8_t, Width, 1>>(node.hi[axis]).cast<float>() * scale + node.origin[axis];
+            Array4f t0 = (lo - r.origin(axis)) * inv_dir(axis);
+            Array4f t1 = (hi - r.origin(axis)) * inv_dir(axis);
+            t_near = t_near.max(t0.min(t1));
+            t_far = t_far.min(t0.max(t1));
+        }
+
+        // Push the children that were hit, farthest first.
+        int base = stack_size;
+        for (int i = 0; i < node.num_children; ++i)
+        {
+            if (!(t_near(i) <= t_far(i)))
+                continue;
+            int k = stack_size++;
+            while (k > base && stack[k - 1].t_entry < t_near(i))
+            {
+                stack[k] = stack[k - 1];
+                --k;
+            }
+            stack[k] = Entry{ node.child[i], node.count[i], t_near(i) };
+        }
+        assert(stack_size <= max_stack_size);
+    }
+    return intersected;
+}
@@ -13,6 +13,24 @@ public:
 	// generate rays for each screen-space coordinate
     virtual Ray generateRay(const Vector2f& point, float fAspect) = 0;
 
+	// Same, but for cameras that sample a lens and/or a shutter interval.
+	// lens_sample is uniform in [0,1]^2 and time is uniform in [0,1) over the exposure.
+	// The default implementation ignores both, which is correct for pinhole cameras that don't move.
+	virtual Ray generateRay(const Vector2f& point, float fAspect, const Vector2f& lens_sample, float time)
+	{
+		Ray r = generateRay(point, fAspect);
+		r.origin += time * motion;
+		return r;
+	}
+
+	// Generates the rays for a whole batch of screen-space coordinates (e.g., a scanline or a tile) at once.
+	// The points are stored as columns; lens_samples and times may be null when needsSamples() is false.
+	// The batch is processed one coordinate at a time as arrays so that the compiler can vectorize it.
+	virtual void generateRays(const Array2Xf& points, float fAspect, const Array2Xf* lens_samples, const ArrayXf* times, RayBatch& rays) const = 0;
+
+	// Does this camera need lens samples or shutter times to generate its rays?
+	virtual bool needsSamples() const { return !motion.isZero(); }
+
 	static inline Vector2f normalizedImageCoordinateFromPixelCoordinate(const Vector2f& pixel, const Vector2i& imageSize) {
 		// YOUR CODE HERE (R1)
 		// Given floating-point pixel coordinates (px,py), you should return the corresponding normalized screen coordinates in [-1,1]^2
@@ -26,9 +44,12 @@ public:
 
 		return Vector2f(imageX, imageY);
 	}
-	
+
     virtual float getTMin() const = 0;
 
+	// Footprint of one pixel for rays through an image of this height, as (Ray::width, Ray::spread).
+	virtual Vector2f pixelFootprint(int image_height) const = 0;
+
 	Matrix3f getOrientation()
     {
 		Matrix3f result;
@@ -48,13 +69,27 @@ public:
     Vector3f    getCenter()                     { return center; }
     void        setCenter(Vector3f position)    { center = position; }
 
+	// Shutter-time model: the camera center moves linearly by this much while the shutter is open.
+	Vector3f	getMotion() const				{ return motion; }
+	void		setMotion(const Vector3f& m)	{ motion = m; }
+
 	virtual bool isOrtho() const = 0;
 
 protected:
-	Vector3f center; 
+	// Adds the camera motion at the sampled shutter times to the ray origins of a batch.
+	void applyMotion(const ArrayXf* times, RayBatch& rays) const
+	{
+		if (times == nullptr || motion.isZero())
+			return;
+		for (int c = 0; c < 3; ++c)
+			rays.origin.row(c) += times->transpose() * motion(c);
+	}
+
+	Vector3f center;
 	Vector3f direction;
 	Vector3f up;
 	Vector3f horizontal;
+	Vector3f motion = Vector3f::Zero();
 };
 
 
@@ -63,7 +98,7 @@ class OrthographicCamera: public Camera
 public:
 	OrthographicCamera(const Vector3f& center, const Vector3f& direction, const Vector3f& up, float size) {
 		this->center = center;
-		this->direction = direction.normalized();	
+		this->direction = direction.normalized();
 		this->horizontal = direction.cross(up).normalized();
 		// need to make an orthonormal vector to the projection
 		this->up = horizontal.cross(direction).normalized();
@@ -76,6 +111,20 @@ public:
 		// Generate a ray with the given screen coordinates, which you should assume lie in [-1,1]^2
 		return Ray(center + (size * fAspect * horizontal * point.x())/2 + (size * up * point.y())/2, direction);
 	}
+	using Camera::generateRay;
+
+	void generateRays(const Array2Xf& points, float fAspect, const Array2Xf* lens_samples, const ArrayXf* times, RayBatch& rays) const override
+	{
+		rays.resize(int(points.cols()));
+		for (int c = 0; c < 3; ++c)
+		{
+			rays.origin.row(c) = center(c) + (points.row(0) * (size * fAspect * horizontal(c))) / 2.0f + (points.row(1) * (size * up(c))) / 2.0f;
+			rays.direction.row(c).setConstant(direction(c));
+		}
+		applyMotion(times, rays);
+	}
+
+	Vector2f pixelFootprint(int image_height) const override { return Vector2f(size / image_height, 0.0f); }
 
 	bool isOrtho() const override { return true; }
 	float getSize() const { return size; }
@@ -86,7 +135,7 @@ public:
 	}
 
 private:
-	float size ; 
+	float size ;
 };
 
 
@@ -99,15 +148,14 @@ public:
 		this->direction = direction_.normalized();
 		this->horizontal = direction_.cross(up_).normalized();
 		this->up = horizontal.cross(direction_).normalized();
-		this->fov_y = fov_y;
+		setFov(fov_y);
 	}
 
 	virtual Ray generateRay( const Vector2f& point, float fAspect ) override
-	{	
+	{
 		// YOUR CODE HERE (R3)
 		// Generate a ray with the given screen coordinates, which you should assume lie in [-1,1]^2
 		// How to do this is described in the lecture notes.
-		float d = 1.0f / tan(fov_y / 2.0f);
 		Vector3f newDirection =
 			(point.x() * horizontal * fAspect) +
 			(point.y() * up) +
@@ -116,15 +164,110 @@ public:
 		newDirection.normalize();
 		return Ray(center, newDirection);
 	}
+	using Camera::generateRay;
+
+	void generateRays(const Array2Xf& points, float fAspect, const Array2Xf* lens_samples, const ArrayXf* times, RayBatch& rays) const override
+	{
+		rays.resize(int(points.cols()));
+		for (int c = 0; c < 3; ++c)
+		{
+			rays.origin.row(c).setConstant(center(c));
+			rays.direction.row(c) = points.row(0) * horizontal(c) * fAspect + points.row(1) * up(c) + direction(c) * d;
+		}
+		rays.normalizeDirections();
+		applyMotion(times, rays);
+	}
+
+	// The angle that a pixel at the center of the image subtends. The lens of ThinLensCamera is ignored.
+	Vector2f pixelFootprint(int image_height) const override { return Vector2f(0.0f, 2.0f / (d * image_height)); }
 
 	bool isOrtho() const override { return false; }
 	float getFov() const { return fov_y; }
-	void setFov(float new_fov) { fov_y = new_fov; }
+	void setFov(float new_fov) { fov_y = new_fov; d = 1.0f / tan(fov_y / 2.0f); }
 
-	virtual float getTMin() const { 
+	virtual float getTMin() const {
 		return 0.0f;
 	}
 
-private:
+protected:
 	float fov_y;
-};
\ No newline at end of file
+	float d;		// distance to the image plane, 1/tan(fov_y/2); cached as it is needed for every ray
+};
+
+
+// Thin lens model for depth of field. Rays start from a point on a disk-shaped lens of the
+// given radius and pass through the point on the plane of focus that the pinhole ray would hit.
+class ThinLensCamera : public PerspectiveCamera
+{
+public:
+	ThinLensCamera(const Vector3f& center_, const Vector3f& direction_, const Vector3f& up_, float fov_y, float lens_radius, float focal_distance) :
+		PerspectiveCamera(center_, direction_, up_, fov_y),
+		lens_radius_(lens_radius),
+		focal_distance_(focal_distance)
+	{}
+
+	Ray generateRay(const Vector2f& point, float fAspect, const Vector2f& lens_sample, float time) override
+	{
+		Vector3f pinhole_dir = (point.x() * horizontal * fAspect) + (point.y() * up) + direction * d;
+
+		// The pinhole direction reaches d units along the view direction, so scaling it by focal_distance_/d lands on the plane of focus.
+		Vector3f focus_point = center + (focal_distance_ / d) * pinhole_dir;
+		Vector2f lens = lens_radius_ * concentricDisk(lens_sample);
+		Vector3f origin = center + lens(0) * horizontal + lens(1) * up + time * motion;
+		return Ray(origin, (focus_point + time * motion - origin).normalized());
+	}
+	using PerspectiveCamera::generateRay;
+
+	void generateRays(const Array2Xf& points, float fAspect, const Array2Xf* lens_samples, const ArrayXf* times, RayBatch& rays) const override
+	{
+		if (lens_samples == nullptr || lens_radius_ == 0.0f)
+		{
+			PerspectiveCamera::generateRays(points, fAspect, lens_samples, times, rays);
+			return;
+		}
+
+		// Concentric mapping of the whole batch of lens samples onto the unit disk.
+		Array2Xf ab = 2.0f * (*lens_samples) - 1.0f;
+		ArrayXf a = ab.row(0).transpose(), b = ab.row(1).transpose();
+		ArrayXf r = (a.abs() > b.abs()).select(a, b);
+		ArrayXf phi = (a.abs() > b.abs()).select(float(EIGEN_PI / 4) * (b / a), float(EIGEN_PI / 2) - float(EIGEN_PI / 4) * (a / b));
+		phi = (a == 0.0f && b == 0.0f).select(0.0f, phi);
+		ArrayXf lx = lens_radius_ * r * phi.cos();
+		ArrayXf ly = lens_radius_ * r * phi.sin();
+
+		const float focus_scale = focal_distance_ / d;
+		rays.resize(int(points.cols()));
+		for (int c = 0; c < 3; ++c)
+		{
+			ArrayXf pinhole = points.row(0).transpose() * horizontal(c) * fAspect + points.row(1).transpose() * up(c) + direction(c) * d;
+			ArrayXf lens_offset = horizontal(c) * lx + up(c) * ly;
+			rays.origin.row(c) = (center(c) + lens_offset).transpose();
+			rays.direction.row(c) = (focus_scale * pinhole - lens_offset).transpose();
+		}
+		rays.normalizeDirections();
+		applyMotion(times, rays);
+	}
+
+	bool needsSamples() const override { return lens_radius_ > 0.0f || Camera::needsSamples(); }
+
+	float getLensRadius() const { return lens_radius_; }
+	void setLensRadius(float r) { lens_radius_ = r; }
+	float getFocalDistance() const { return focal_distance_; }
+	void setFocalDistance(float f) { focal_distance_ = f; }
+
+private:
+	// Shirley-Chiu concentric mapping from the unit square to the unit disk.
+	static Vector2f concentricDisk(const Vector2f& u)
+	{
+		float a = 2.0f * u(0) - 1.0f, b = 2.0f * u(1) - 1.0f;
+		if (a == 0.0f && b == 0.0f)
+			return Vector2f::Zero();
+		float r, phi;
+		if (fabs(a) > fabs(b)) { r = a; phi = float(EIGEN_PI / 4) * (b / a); }
+		else { r = b; phi = float(EIGEN_PI / 2) - float(EIGEN_PI / 4) * (a / b); }
+		return Vector2f(r * cos(phi), r * sin(phi));
+	}
+
+	float lens_radius_;
+	float focal_distance_;
+};
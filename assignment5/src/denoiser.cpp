@@ -0,0 +1,164 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "denoiser.h"
+
+#include <algorithm>
+
+namespace {
+
+// The weights fall off with these differences between a tap and the center pixel.
+const float ColorSigma  = 2.0f;     // of the demodulated color in the first pass; halves with every pass
+const float AlbedoSigma = 0.2f;
+const float DepthSigma  = 0.1f;     // relative to the depth of the center pixel
+const int   NormalPower = 8;        // the weight is max(0, cos)^NormalPower; a power of two
+
+// B3 spline, the 1D kernel of the A-trous filter.
+const float Kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// Pixels with a smaller albedo are not demodulated, as the division would only blow up their noise.
+const float MinAlbedo = 0.01f;
+
+} // namespace
+
+Denoiser::Denoiser(const Vector2i& size) :
+    size_(size)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        albedo_[c].setZero(size(1), size(0));
+        normal_[c].setZero(size(1), size(0));
+    }
+    depth_.setConstant(size(1), size(0), FLT_MAX);
+}
+
+void Denoiser::setGuides(int x, int y, const Vector3f& albedo, const Vector3f& normal, float depth)
+{
+    // The average of the normals of the samples is shorter than they are; the weights need unit length.
+    Vector3f n = normal.squaredNorm() > 0.0f ? normal.normalized() : Vector3f::Zero();
+    for (int c = 0; c < 3; ++c)
+    {
+        albedo_[c](y, x) = albedo(c);
+        normal_[c](y, x) = n(c);
+    }
+    depth_(y, x) = depth;
+}
+
+void Denoiser::denoise(Image4f& image, int iterations) const
+{
+    // Filter the incident light rather than the final color: dividing out the albedo keeps
+    // textures sharp, as the filter then only sees the noise of the lighting.
+    Plane color[3], filtered[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        color[c].resize(size_(1), size_(0));
+        filtered[c].resize(size_(1), size_(0));
+    }
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int y = 0; y < size_(1); ++y)
+        for (int x = 0; x < size_(0); ++x)
+            for (int c = 0; c < 3; ++c)
+            {
+                float a = albedo_[c](y, x);
+                color[c](y, x) = image.pixel(x, y)(c) / (a > MinAlbedo ? a : 1.0f);
+            }
+
+    float color_sigma = ColorSigma;
+    for (int i = 0; i < iterations; ++i)
+    {
+        pass(color, filtered, 1 << i, color_sigma);
+        for (int c = 0; c < 3; ++c)
+            color[c].swap(filtered[c]);
+        color_sigma *= 0.5f;
+    }
+
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int y = 0; y < size_(1); ++y)
+        for (int x = 0; x < size_(0); ++x)
+            for (int c = 0; c < 3; ++c)
+            {
+                float a = albedo_[c](y, x);
+                image.pixel(x, y)(c) = color[c](y, x) * (a > MinAlbedo ? a : 1.0f);
+            }
+}
+
+void Denoiser::pass(const Plane* color, Plane* filtered, int step, float color_sigma) const
+{
+    const int width = size_(0), height = size_(1);
+    const float color_scale = 1.0f / (color_sigma * color_sigma);
+    const float albedo_scale = 1.0f / (AlbedoSigma * AlbedoSigma);
+
+    // Rows are independent; each is filtered as whole arrays over the pixels, one tap at a time.
+    // Taps that fall outside the image are left out, the weights being normalized anyway.
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 4)
+#endif
+    for (int y = 0; y < height; ++y)
+    {
+        ArrayXf sum_weight = ArrayXf::Zero(width);
+        ArrayXf sum[3] = { ArrayXf::Zero(width), ArrayXf::Zero(width), ArrayXf::Zero(width) };
+        const ArrayXf depth_scale = 1.0f / (DepthSigma * depth_.row(y).transpose().max(1e-6f));
+
+        for (int ky = 0; ky < 5; ++ky)
+        {
+            int yy = y + (ky - 2) * step;
+            if (yy < 0 || yy >= height)
+                continue;
+            for (int kx = 0; kx < 5; ++kx)
+            {
+                int dx = (kx - 2) * step;
+                int x0 = max(0, -dx), x1 = min(width, width - dx);
+                int n = x1 - x0;
+                if (n <= 0)
+                    continue;
+
+                // The center pixels x0..x1-1 on row y and their taps x0+dx.. on row yy.
+                auto at = [&](const Plane& p, int row, int first) { return p.row(row).segment(first, n).transpose(); };
+
+                ArrayXf exponent = ArrayXf::Zero(n);
+                ArrayXf cos_normal = ArrayXf::Zero(n);
+                for (int c = 0; c < 3; ++c)
+                {
+                    exponent += (at(color[c], yy, x0 + dx) - at(color[c], y, x0)).square() * color_scale;
+                    exponent += (at(albedo_[c], yy, x0 + dx) - at(albedo_[c], y, x0)).square() * albedo_scale;
+                    cos_normal += at(normal_[c], yy, x0 + dx) * at(normal_[c], y, x0);
+                }
+                exponent += (at(depth_, yy, x0 + dx) - at(depth_, y, x0)).abs() * depth_scale.segment(x0, n);
+
+                ArrayXf normal_weight = cos_normal.max(0.0f);
+                for (int k = 1; k < NormalPower; k *= 2)
+                    normal_weight = normal_weight.square();
+
+                // Misses have no normal; they are only averaged with each other. A hit and a miss
+                // have a zero dot product, so the hits already leave out the misses.
+                ArrayXf center_normal2 = at(normal_[0], y, x0).square() + at(normal_[1], y, x0).square() + at(normal_[2], y, x0).square();
+                ArrayXf tap_normal2 = at(normal_[0], yy, x0 + dx).square() + at(normal_[1], yy, x0 + dx).square() + at(normal_[2], yy, x0 + dx).square();
+                normal_weight = (center_normal2 > 0.0f).select(normal_weight, (tap_normal2 > 0.0f).select(0.0f, ArrayXf::Ones(n)));
+
+                ArrayXf weight = (Kernel[kx] * Kernel[ky]) * normal_weight * (-exponent).exp();
+                sum_weight.segment(x0, n) += weight;
+                for (int c = 0; c < 3; ++c)
+                    sum[c].segment(x0, n) += weight * at(color[c], yy, x0 + dx);
+            }
+        }
+
+        // The center tap always has a positive weight, so the sum is never zero.
+        for (int c = 0; c < 3; ++c)
+            filtered[c].row(y) = (sum[c] / sum_weight).transpose();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "image.h"
+
+// Edge-avoiding A-trous wavelet filter (Dammertz et al. 2010) for renders with few samples per pixel.
+// Each pass averages a 5x5 neighborhood whose taps spread twice as far as in the pass before, weighted
+// down where the color, albedo, normal or depth of the primary hits differs from the center pixel, so
+// that the noise is blurred away but the edges and the texture detail stay.
+class Denoiser
+{
+public:
+    explicit Denoiser(const Vector2i& size);
+
+    // Features of the primary hits of pixel (x, y), averaged over its samples: albedo is the diffuse
+    // color and depth the distance to the hit. For misses, pass a zero normal and a huge depth.
+    void setGuides(int x, int y, const Vector3f& albedo, const Vector3f& normal, float depth);
+
+    // Filters the color channels of the image in place with the given number of passes.
+    void denoise(Image4f& image, int iterations) const;
+
+private:
+    // One plane per channel and row-major, so that runs of pixels on a row can be processed as arrays.
+    typedef Array<float, Dynamic, Dynamic, RowMajor> Plane;
+
+    void pass(const Plane* color, Plane* filtered, int step, float color_sigma) const;
+
+    Vector2i    size_;
+    Plane       albedo_[3];
+    Plane       normal_[3];
+    Plane       depth_;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "args.h"
+#include "hit.h"
+#include "ray.h"
+
+#include <memory>
+#include <vector>
+
+class GroupObject;
+
+// Cache of the primary visibility of a rendered image ("G-buffer"): the primary ray and its closest hit
+// (distance, normal and material) for every sample. When only the lights or the materials change,
+// render() re-shades the image from the cached hits instead of tracing the primary rays again.
+// Anything that moves the primary hits must invalidate it. Changes in the image size, sample positions
+// and scene geometry are caught by matches(), the latter through the group and the geometry generation
+// of the SceneParser (bumped by buildArena() and refitArena()); camera changes have to be reported with invalidate().
+struct GBuffer
+{
+	// Is the cache filled in for rendering with these arguments and this geometry?
+	bool matches(const Args& args, const shared_ptr<GroupObject>& group, unsigned geometry_generation) const
+	{
+		return valid &&
+			group_ == group &&
+			geometry_generation_ == geometry_generation &&
+			width_ == args.width &&
+			height_ == args.height &&
+			samples_per_pixel_ == args.samples_per_pixel &&
+			sampling_pattern_ == args.sampling_pattern &&
+			random_seed_ == args.random_seed &&
+			deterministic_ == args.deterministic;
+	}
+
+	// Allocates the storage for a render with these arguments. The cache becomes valid once it has been filled in.
+	void reset(const Args& args, const shared_ptr<GroupObject>& group, unsigned geometry_generation)
+	{
+		valid = false;
+		group_ = group;
+		geometry_generation_ = geometry_generation;
+		width_ = args.width;
+		height_ = args.height;
+		samples_per_pixel_ = args.samples_per_pixel;
+		sampling_pattern_ = args.sampling_pattern;
+		random_seed_ = args.random_seed;
+		deterministic_ = args.deterministic;
+
+		int n = width_ * height_ * samples_per_pixel_;
+		rays.resize(n);
+		hits.assign(n, Hit(FLT_MAX));
+	}
+
+	void invalidate() { valid = false; }
+
+	// Index of sample n of pixel (i,j). The samples of a scanline are contiguous, like in render().
+	int index(int i, int j, int n) const { return (j * width_ + i) * samples_per_pixel_ + n; }
+
+	RayBatch		rays;
+	vector<Hit>		hits;		// a hit without a material is a miss
+	bool			valid = false;
+
+private:
+	shared_ptr<GroupObject>	group_;
+	unsigned		geometry_generation_ = 0;
+	int				width_ = 0;
+	int				height_ = 0;
+	int				samples_per_pixel_ = 0;
+	int				sampling_pattern_ = 0;
+	int				random_seed_ = 0;
+	bool			deterministic_ = false;
+};
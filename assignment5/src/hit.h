@@ -16,18 +16,30 @@ public:
         t = h.t;
         material = h.material; 
         normal = h.normal;
+        uv = h.uv;
+        uv_footprint = h.uv_footprint;
     }
 
-    void set(float tnew, shared_ptr<Material> m, const Vector3f& n)
+    void set(float tnew, shared_ptr<Material> m, const Vector3f& n, const Vector2f& tex = Vector2f::Zero(), float tex_footprint = 0.0f)
     {
-        t = tnew;
+        setGeometry(tnew, n, tex, tex_footprint);
         material = m;
+    }
+
+    // Everything but the material, for intersection code that keeps track of the material itself.
+    void setGeometry(float tnew, const Vector3f& n, const Vector2f& tex = Vector2f::Zero(), float tex_footprint = 0.0f)
+    {
+        t = tnew;
         normal = n;
+        uv = tex;
+        uv_footprint = tex_footprint;
     }
 
     float		            t           = FLT_MAX;// closest hit found so far
     shared_ptr<Material>	material    = nullptr;
     Vector3f	            normal      = Vector3f::Zero();
+    Vector2f	            uv          = Vector2f::Zero();	// texture coordinates
+    float		            uv_footprint = 0.0f;	// width of the ray's footprint in texture coordinates, for mip-mapping
 };
 
 inline std::ostream& operator<<(std::ostream &os, const Hit& h) {
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <type_traits>
 #include <fmt/core.h>
 
 #include "lodepng.h"
@@ -11,22 +15,186 @@
 
 typedef Vector<uint8_t, 4> Vector4u8;
 
+// ----------------------------------------------------------------------------
+// Compact pixel formats.
+// Both convert implicitly from and to Vector4f, so that an ImageBase<Half4> or
+// ImageBase<RGB9E5> can be written to with the same code as an Image4f.
+
+// IEEE 754 binary16 conversions, round-to-nearest-even.
+inline uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t abs = x & 0x7fffffffu;
+    if (abs >= 0x7f800000u)                         // inf or nan
+        return uint16_t(sign | 0x7c00u | (abs > 0x7f800000u ? 0x200u : 0u));
+    if (abs >= 0x477ff000u)                         // rounds to inf
+        return uint16_t(sign | 0x7c00u);
+    if (abs < 0x38800000u)                          // denormal or zero
+    {
+        if (abs < 0x33000000u)
+            return uint16_t(sign);
+        uint32_t e = abs >> 23;
+        uint32_t m = (abs & 0x7fffffu) | 0x800000u;
+        uint32_t shift = 126 - e;
+        uint32_t h = m >> shift;
+        uint32_t rem = m & ((1u << shift) - 1);
+        uint32_t half_way = 1u << (shift - 1);
+        if (rem > half_way || (rem == half_way && (h & 1u)))
+            ++h;
+        return uint16_t(sign | h);
+    }
+    uint32_t h = ((abs - 0x38000000u) >> 13);
+    uint32_t rem = abs & 0x1fffu;
+    if (rem > 0x1000u || (rem == 0x1000u && (h & 1u)))
+        ++h;
+    return uint16_t(sign | h);
+}
+
+inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000u) << 16;
+    uint32_t e = (h >> 10) & 0x1fu;
+    uint32_t m = h & 0x3ffu;
+    uint32_t x;
+    if (e == 0)
+    {
+        if (m == 0)
+            x = sign;
+        else
+        {
+            // renormalize the denormal
+            e = 113;
+            while ((m & 0x400u) == 0) { m <<= 1; --e; }
+            x = sign | (e << 23) | ((m & 0x3ffu) << 13);
+        }
+    }
+    else if (e == 31)
+        x = sign | 0x7f800000u | (m << 13);
+    else
+        x = sign | ((e + 112) << 23) | (m << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// RGBA in four half floats, 8 bytes per pixel instead of 16.
+struct Half4
+{
+    Half4() : v{ 0, 0, 0, 0 } {}
+    Half4(const Vector4f& c) { for (int d = 0; d < 4; ++d) v[d] = float_to_half(c(d)); }
+    operator Vector4f() const { return Vector4f(half_to_float(v[0]), half_to_float(v[1]), half_to_float(v[2]), half_to_float(v[3])); }
+
+    uint16_t v[4];
+};
+
+// Unsigned RGB with 9-bit mantissas and a shared 5-bit exponent, 4 bytes per pixel.
+// Suited for non-negative HDR data such as radiance or visualisation buffers; alpha is always 1.
+// See the EXT_texture_shared_exponent specification for the encoding.
+struct RGB9E5
+{
+    RGB9E5() : v(0) {}
+    RGB9E5(const Vector4f& c)
+    {
+        const int N = 9, B = 15, Emax = 31;
+        const float sharedexp_max = float((1 << N) - 1) / (1 << N) * float(1 << (Emax - B));
+        float r = clip(c(0), 0.0f, sharedexp_max);
+        float g = clip(c(1), 0.0f, sharedexp_max);
+        float b = clip(c(2), 0.0f, sharedexp_max);
+        float max_c = max(r, max(g, b));
+        int exp_shared = max(-B - 1, int(floorf(log2f(max(max_c, 1e-30f))))) + 1 + B;
+        float denom = ldexpf(1.0f, exp_shared - B - N);
+        int max_s = int(floorf(max_c / denom + 0.5f));
+        if (max_s == (1 << N))
+        {
+            denom *= 2.0f;
+            ++exp_shared;
+        }
+        uint32_t rs = uint32_t(floorf(r / denom + 0.5f));
+        uint32_t gs = uint32_t(floorf(g / denom + 0.5f));
+        uint32_t bs = uint32_t(floorf(b / denom + 0.5f));
+        v = rs | (gs << 9) | (bs << 18) | (uint32_t(exp_shared) << 27);
+    }
+    operator Vector4f() const
+    {
+        float scale = ldexpf(1.0f, int(v >> 27) - 15 - 9);
+        return Vector4f(float(v & 0x1ffu) * scale, float((v >> 9) & 0x1ffu) * scale, float((v >> 18) & 0x1ffu) * scale, 1.0f);
+    }
+
+    uint32_t v;
+};
+
+// ----------------------------------------------------------------------------
+// Per-pixel-type information used by the generic image code.
+
+template<class PixelType>
+struct pixel_traits_t
+{
+    // Eigen vectors of floats: can be converted in place without unpacking
+    static constexpr int    channels        = PixelType::RowsAtCompileTime;
+    static constexpr bool   is_float_vector = std::is_same<typename PixelType::Scalar, float>::value;
+    static Vector4f         to_float4(const PixelType& p)
+    {
+        Vector4f r(0.0f, 0.0f, 0.0f, 1.0f);
+        for (int d = 0; d < min(4, channels); ++d)
+            r(d) = float(p(d));
+        return r;
+    }
+};
+
+template<> struct pixel_traits_t<float>
+{
+    static constexpr int    channels        = 1;
+    static constexpr bool   is_float_vector = true;
+    static Vector4f         to_float4(float p) { return Vector4f(p, 0.0f, 0.0f, 1.0f); }
+};
+
+template<> struct pixel_traits_t<Half4>
+{
+    static constexpr int    channels        = 4;
+    static constexpr bool   is_float_vector = false;
+    static Vector4f         to_float4(const Half4& p) { return p; }
+};
+
+template<> struct pixel_traits_t<RGB9E5>
+{
+    static constexpr int    channels        = 4;
+    static constexpr bool   is_float_vector = false;
+    static Vector4f         to_float4(const RGB9E5& p) { return p; }
+};
+
+// ----------------------------------------------------------------------------
+
 template<class PixelType>
 class ImageBase
 {
 public:
-    ImageBase(const Vector2i& size, const PixelType& initializer)
+    // With tile_size > 0 (a power of two), the pixels are stored in square tiles of
+    // tile_size^2 pixels each, so that pixels that are close in 2D are close in memory.
+    // The size is padded up to a multiple of the tile size internally.
+    ImageBase(const Vector2i& size, const PixelType& initializer, int tile_size = 0)
     {
         size_ = size;
-        data_ = make_unique<PixelType[]>(size(0) * size(1));
-        std::fill(&data_[0], &data_[size(0) * size(1)], initializer);
+        tile_log2_ = 0;
+        while (tile_size > 1 && (1 << tile_log2_) < tile_size)
+            ++tile_log2_;
+        assert(tile_size <= 1 || (1 << tile_log2_) == tile_size);
+        int tile = 1 << tile_log2_;
+        tiles_x_ = (size(0) + tile - 1) >> tile_log2_;
+        int tiles_y = (size(1) + tile - 1) >> tile_log2_;
+        num_pixels_ = size_t(tiles_x_) * tiles_y * tile * tile;
+        data_ = make_unique<PixelType[]>(num_pixels_);
+        std::fill(&data_[0], &data_[0] + num_pixels_, initializer);
     }
 
-    shared_ptr<ImageBase<Vector<uint8_t, 4>>> to_uint8() const;
+    // Converts to 8 bits per channel, optionally applying the sRGB transfer curve to the
+    // color channels. The result always has a row-major layout.
+    shared_ptr<ImageBase<Vector<uint8_t, 4>>> to_uint8(bool srgb = false) const;
 
-    void exportPNG(const string& filename)
+    void exportPNG(const string& filename, bool srgb = false)
     {
-        shared_ptr<ImageBase<Vector<uint8_t, 4>>> u8img = to_uint8();
+        shared_ptr<ImageBase<Vector<uint8_t, 4>>> u8img = to_uint8(srgb);
         vector<uint8_t> eightbit((uint8_t*)u8img->data(), (uint8_t*)(u8img->data() + size_(0) * size_(1)));
         vector<uint8_t> out;
         lodepng::State S;
@@ -38,30 +206,151 @@ public:
     }
 
     inline Vector2i             getSize() const                 { return size_; }
-    inline PixelType&           pixel(int x, int y)             { return data_[y * size_(0) + x]; }
-    inline const PixelType&     pixel(int x, int y) const       { return data_[y * size_(0) + x]; }
-    inline const PixelType*     data() const                    { return data_.get(); }
+    inline bool                 isTiled() const                 { return tile_log2_ > 0; }
+    inline size_t               memoryFootprint() const         { return num_pixels_ * sizeof(PixelType); }
+    inline PixelType&           pixel(int x, int y)             { return data_[index(x, y)]; }
+    inline const PixelType&     pixel(int x, int y) const       { return data_[index(x, y)]; }
+    inline const PixelType*     data() const                    { assert(!isTiled()); return data_.get(); }
+
+    // Number of pixels starting from (x, y) that are stored contiguously on the same row.
+    inline int                  contiguousRun(int x) const      { return isTiled() ? min((1 << tile_log2_) - (x & ((1 << tile_log2_) - 1)), size_(0) - x) : size_(0) - x; }
 
 protected:
+    inline size_t index(int x, int y) const
+    {
+        assert(x >= 0 && x < size_(0) && y >= 0 && y < size_(1));
+        if (tile_log2_ == 0)
+            return size_t(y) * size_(0) + x;
+        const int mask = (1 << tile_log2_) - 1;
+        size_t tile = size_t(y >> tile_log2_) * tiles_x_ + (x >> tile_log2_);
+        return (tile << (2 * tile_log2_)) + (size_t(y & mask) << tile_log2_) + (x & mask);
+    }
+
     unique_ptr<PixelType[]>     data_;
     Vector2i                    size_;
+    size_t                      num_pixels_ = 0;
+    int                         tile_log2_  = 0;
+    int                         tiles_x_    = 0;
 };
 
 
 template<class PixelType>
-shared_ptr<ImageBase<Vector<uint8_t, 4>>> ImageBase<PixelType>::to_uint8() const
+shared_ptr<ImageBase<Vector<uint8_t, 4>>> ImageBase<PixelType>::to_uint8(bool srgb) const
 {
+    typedef pixel_traits_t<PixelType> traits;
+    const int channels = min(4, traits::channels);
+    const int color_channels = min(3, channels);
+
     Vector<uint8_t, 4> initializer = Vector<uint8_t, 4>{ 0, 0, 0, 255 };
     auto u8img = make_shared<ImageBase<Vector<uint8_t, 4>>>(size_, initializer);
+
+    // Each row is processed in contiguous runs of pixels as whole arrays, so that Eigen can vectorize
+    // the clamping, transfer curve and conversion instead of going through the pixels one channel at a time.
+#ifdef CS_C3100_USE_OPENMP
+    #pragma omp parallel for
+#endif
     for (int j = 0; j < size_(1); ++j)
-        for (int i = 0; i < size_(0); ++i)
-            //u8img->pixel(i, j) = pixel_traits_t<PixelType>::to_uint8(pixel(i, j));
-            for (int d = 0; d < min(4, (int)PixelType::RowsAtCompileTime); ++d)
-                u8img->pixel(i, j)[d] = uint8_t(clip(pixel(i, j)[d] * 255.0f, 0.0f, 255.0f));
+    {
+        // Sized once for the longest run, so that the runs of a row (one per tile when tiled) don't allocate.
+        const int max_run = contiguousRun(0);
+        Array<float, 4, Dynamic> scratch(4, max_run);
+        Array<float, Dynamic, Dynamic> buffer(channels, max_run);
+        Map<Array<uint8_t, 4, Dynamic>> out_row(u8img->pixel(0, j).data(), 4, size_(0));
+        for (int i = 0; i < size_(0); )
+        {
+            int run = contiguousRun(i);
+            auto values = buffer.leftCols(run);
+            if constexpr (traits::is_float_vector)
+            {
+                Map<const Array<float, Dynamic, Dynamic>> in((const float*)&pixel(i, j), traits::channels, run);
+                values = in.topRows(channels).max(0.0f).min(1.0f);
+            }
+            else
+            {
+                for (int k = 0; k < run; ++k)
+                    scratch.col(k) = traits::to_float4(pixel(i + k, j));
+                values = scratch.leftCols(run).topRows(channels).max(0.0f).min(1.0f);
+            }
+
+            if (srgb)
+            {
+                auto c = values.topRows(color_channels);
+                values.topRows(color_channels) = (c <= 0.0031308f).select(12.92f * c, 1.055f * c.pow(1.0f / 2.4f) - 0.055f);
+            }
+
+            out_row.block(0, i, channels, run) = (values * 255.0f).template cast<uint8_t>();
+            i += run;
+        }
+    }
     return u8img;
 }
 
 typedef ImageBase<float> Image1f;
 typedef ImageBase<Vector2f> Image2f;
 typedef ImageBase<Vector4f> Image4f;
+typedef ImageBase<Half4> Image4h;
+typedef ImageBase<RGB9E5> Image4e;
 typedef ImageBase<Vector4u8> Image4u8;
+
+// ----------------------------------------------------------------------------
+// Side buffer for auxiliary outputs (depth, normals, ...), whose storage
+// precision is chosen at runtime. Reads and writes go through Vector4f.
+
+class AovImage
+{
+public:
+    enum Storage
+    {
+        Storage_Float,              // 16 bytes per pixel
+        Storage_Half,               // 8 bytes per pixel
+        Storage_SharedExponent      // 4 bytes per pixel, RGB only
+    };
+
+    AovImage(const Vector2i& size, Storage storage, int tile_size = 0) : storage_(storage)
+    {
+        switch (storage)
+        {
+        case Storage_Float:             float_ = make_shared<Image4f>(size, Vector4f::Zero(), tile_size); break;
+        case Storage_Half:              half_ = make_shared<Image4h>(size, Half4(Vector4f::Zero()), tile_size); break;
+        case Storage_SharedExponent:    rgbe_ = make_shared<Image4e>(size, RGB9E5(Vector4f::Zero()), tile_size); break;
+        }
+    }
+
+    void set(int x, int y, const Vector4f& v)
+    {
+        switch (storage_)
+        {
+        case Storage_Float:             float_->pixel(x, y) = v; break;
+        case Storage_Half:              half_->pixel(x, y) = v; break;
+        case Storage_SharedExponent:    rgbe_->pixel(x, y) = v; break;
+        }
+    }
+
+    Vector4f get(int x, int y) const
+    {
+        switch (storage_)
+        {
+        case Storage_Half:              return half_->pixel(x, y);
+        case Storage_SharedExponent:    return rgbe_->pixel(x, y);
+        default:                        return float_->pixel(x, y);
+        }
+    }
+
+    void exportPNG(const string& filename)
+    {
+        switch (storage_)
+        {
+        case Storage_Float:             float_->exportPNG(filename); break;
+        case Storage_Half:              half_->exportPNG(filename); break;
+        case Storage_SharedExponent:    rgbe_->exportPNG(filename); break;
+        }
+    }
+
+    Storage     getStorage() const { return storage_; }
+
+private:
+    Storage                 storage_;
+    shared_ptr<Image4f>     float_;
+    shared_ptr<Image4h>     half_;
+    shared_ptr<Image4e>     rgbe_;
+};
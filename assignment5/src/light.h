@@ -25,6 +25,10 @@ public:
 	// dir_to_light, incident_intensity and distance are evaluated
 	// in this function.
 	virtual void getIncidentIllumination(const Vector3f& p, Vector3f& dir_to_light, Vector3f& incident_intensity, float& distance) const = 0;
+
+	// For editing the lights interactively.
+	virtual Vector3f getIntensity() const = 0;
+	virtual void setIntensity(const Vector3f& intensity) = 0;
 };
 
 class DirectionalLight : public Light
@@ -35,6 +39,9 @@ public:
 
 	// You need to fill in the implementation.
 	void getIncidentIllumination(const Vector3f& p, Vector3f& dir_to_light, Vector3f& incident_intensity, float& distance) const override;
+
+	Vector3f getIntensity() const override { return intensity_; }
+	void setIntensity(const Vector3f& intensity) override { intensity_ = intensity; }
 private:
 	Vector3f direction_;
 	Vector3f intensity_;
@@ -51,6 +58,9 @@ public:
 	// You need to fill in the implementation.
 	void getIncidentIllumination(const Vector3f& p, Vector3f& dir_to_light, Vector3f& incident_intensity, float& distance) const override;
 
+	Vector3f getIntensity() const override { return intensity_; }
+	void setIntensity(const Vector3f& intensity) override { intensity_ = intensity; }
+
 private:
 	PointLight();
 
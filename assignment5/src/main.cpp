@@ -42,10 +42,16 @@ using namespace std;
 #include "material.h"
 #include "object.h"
 #include "ray_tracer.h"
+#include "ray_recorder.h"
 #include "sampler.h"
+#include "scene_arena.h"
 #include "filter.h"
+#include "denoiser.h"
+#include "gbuffer.h"
+#include "texture.h"
+#include "trace_stats.h"
 
-shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args& args, bool parallelize);
+shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args& args, bool parallelize, GBuffer* gbuffer = nullptr);
 
 // The raytracer in this assignment is a command line application.
 // While working on the assignment, if you want to run the raytracer from within Visual
@@ -76,32 +82,104 @@ int main(int argcp, char *argvp[]) {
     if (!scene_parser.getGroup())
         args.display_uv = true;
 
+    // Freeze the scene and build the acceleration structures before the first pixel; measure time
+    if (scene_parser.getGroup())
+    {
+        auto start = chrono::steady_clock::now();
+        scene_parser.buildArena(args.bvh);
+        auto end = chrono::steady_clock::now();
+        const SceneArena* arena = scene_parser.getArena();
+        cout << "Built the scene arena in " << chrono::duration_cast<chrono::milliseconds>(end-start).count() << "ms: "
+             << arena->numPrimitives() << " primitives, " << (arena->memoryUsage() + 1023) / 1024 << " KB." << endl;
+    }
+
     // Render; measure time
     auto start = chrono::steady_clock::now();
     render(ray_tracer, scene_parser, args, true);
     auto end = chrono::steady_clock::now();
 
     cout << "Rendered " << args.output_file << " in " << chrono::duration_cast<chrono::milliseconds>(end-start).count() << "ms." << endl;
+    if (TextureCache::instance().misses() > 0)
+        cout << "Texture cache: " << TextureCache::instance().hits() << " hits, " << TextureCache::instance().misses() << " misses." << endl;
     return 0;
 }
 
+// Writes one channel of an image as a grayscale PFM (portable float map), bottom row first.
+void exportPFM(const Image4f& image, int channel, const string& filename)
+{
+    Vector2i size = image.getSize();
+    ofstream file(filename.c_str(), std::ios::binary);
+    file << "Pf\n" << size(0) << " " << size(1) << "\n-1.0\n";   // negative scale: little-endian
+    vector<float> row(size(0));
+    for (int j = size(1) - 1; j >= 0; --j)
+    {
+        for (int i = 0; i < size(0); ++i)
+            row[i] = image.pixel(i, j)(channel);
+        file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+// Writes one channel of an image as a false-color PNG, from blue through green and yellow to red.
+// The scale saturates at the 99th percentile so that a few extreme pixels don't flatten the rest.
+float exportHeatmap(const Image4f& image, int channel, const string& filename)
+{
+    Vector2i size = image.getSize();
+    vector<float> values;
+    values.reserve(size_t(size(0)) * size(1));
+    for (int j = 0; j < size(1); ++j)
+        for (int i = 0; i < size(0); ++i)
+            values.push_back(image.pixel(i, j)(channel));
+    if (values.empty())
+        return 0.0f;
+    auto percentile = values.begin() + (values.size() - 1) * 99 / 100;
+    nth_element(values.begin(), percentile, values.end());
+    float scale = max(*percentile, FLT_MIN);
+
+    static const Vector3f ramp[] = { { 0.0f, 0.0f, 0.5f }, { 0.0f, 0.3f, 1.0f }, { 0.0f, 0.9f, 0.3f }, { 1.0f, 0.9f, 0.0f }, { 1.0f, 0.0f, 0.0f } };
+    const int num_stops = int(sizeof(ramp) / sizeof(ramp[0]));
+    Image4f heatmap(size, Vector4f::Zero());
+    for (int j = 0; j < size(1); ++j)
+        for (int i = 0; i < size(0); ++i)
+        {
+            float x = min(image.pixel(i, j)(channel) / scale, 1.0f) * (num_stops - 1);
+            int k = min(int(x), num_stops - 2);
+            Vector3f c = ramp[k] + (x - k) * (ramp[k + 1] - ramp[k]);
+            heatmap.pixel(i, j) = Vector4f(c(0), c(1), c(2), 1.0f);
+        }
+    heatmap.exportPNG(filename);
+    return scale;
+}
+
 // Actual renderer, called by both the command line and the interactive application.
 // Pass num_threads == 0 to use maximum supported number.
-shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args& args, bool parallelize)
+// If a G-buffer is given, the primary hits are stored in it, or, if it already holds them
+// for these arguments, the image is only re-shaded from it without tracing the primary rays.
+shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args& args, bool parallelize, GBuffer* gbuffer)
 {
     auto image_size = Vector2i(args.width, args.height);
     float fAspect = float(args.width) / args.height;
 
     // Construct images
-    shared_ptr<Image4f> color_image, normal_image, depth_image;
+    shared_ptr<Image4f> color_image;
+    shared_ptr<AovImage> normal_image, depth_image;
 
-    color_image = make_shared<Image4f>(image_size, Vector4f::Zero());
+    color_image = make_shared<Image4f>(image_size, Vector4f::Zero(), args.tile_size);
+
+    // The depth and normal visualizations only ever end up as 8-bit PNGs, so they can be kept at reduced precision.
+    auto aov_storage = AovImage::Storage(args.aov_storage);
 
     if (!args.depth_file.empty())
-        depth_image = make_shared<Image4f>(image_size, Vector4f::Zero());
+        depth_image = make_shared<AovImage>(image_size, aov_storage, args.tile_size);
 
     if (!args.normals_file.empty())
-        normal_image = make_shared<Image4f>(image_size, Vector4f::Zero());
+        normal_image = make_shared<AovImage>(image_size, aov_storage, args.tile_size);
+
+    // The cost of each pixel: time in cycles, rays cast and primitive tests in the first three channels.
+    // The counts need full float precision. The scanline setup (primary ray generation) is not included.
+    shared_ptr<Image4f> cost_image;
+    if (!args.cost_file.empty())
+        cost_image = make_shared<Image4f>(image_size, Vector4f::Zero(), args.tile_size);
+    trace_stats_enabled = cost_image != nullptr;
 
     // EXTRA
     // The Filter and Film objects are for implementing smarter supersampling extra credit.
@@ -115,6 +193,34 @@ shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args
     //mutex m;  // You need to wrap calls to Film::addSample() with std::lock_guard<std::mutex> guard(m)
     //          // in order not to cause issues with many threads writing to the same pixels at the same time.
 
+    // The features of the primary hits that guide the denoiser.
+    unique_ptr<Denoiser> denoiser;
+    if (args.denoise > 0)
+        denoiser = make_unique<Denoiser>(image_size);
+
+    TextureCache::instance().setBudget(size_t(args.texture_cache_mb) << 20);
+
+    // The footprint of each sample for choosing texture mip levels. The samples split the pixel between them.
+    Vector2f sample_footprint = Vector2f::Zero();
+    if (scene.getCamera())
+        sample_footprint = scene.getCamera()->pixelFootprint(args.height) / sqrtf(float(args.samples_per_pixel));
+
+    // The crop window: pixels [x0, x1) x [y0, y1) at the full resolution.
+    int x0 = clamp(args.crop_x, 0, args.width), y0 = clamp(args.crop_y, 0, args.height);
+    int x1 = args.crop_width > 0 ? min(x0 + args.crop_width, args.width) : args.width;
+    int y1 = args.crop_height > 0 ? min(y0 + args.crop_height, args.height) : args.height;
+
+    // The G-buffer only caches whole images rendered in one pass.
+    if (x1 - x0 < args.width || y1 - y0 < args.height || args.time_budget_ms > 0)
+        gbuffer = nullptr;
+
+    // The rays of the pixels in the region being recorded, if any, go to the debug visualisation.
+    const RayRecorder& recorder = RayRecorder::instance();
+
+    bool reshade = gbuffer && gbuffer->matches(args, scene.getGroup(), scene.getGeometryGeneration());
+    if (gbuffer && !reshade)
+        gbuffer->reset(args, scene.getGroup(), scene.getGeometryGeneration());
+
     // progress counter (atomic to enable updating from different threads)
     atomic<int> lines_done = 0;
 
@@ -134,139 +240,258 @@ shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args
     cout << "Using " << num_threads << " threads" << endl;
 #endif
 
-    // Loop over scanlines.
+    // Render passes until the time budget runs out. Each pass takes a new set of samples_per_pixel samples
+    // for every pixel, from samplers seeded past those of the previous pass, and the image is their average.
+    // Another pass is only started if it should fit in the budget at the speed of the last one.
+    auto budget_start = chrono::steady_clock::now();
+    int pass = 0;
+    for (;; ++pass)
+    {
+        auto pass_start = chrono::steady_clock::now();
+        int pass_seed = args.random_seed + pass * 2 * args.height;
+        lines_done = 0;
+
+        // Loop over scanlines.
 #ifdef CS_C3100_USE_OPENMP
-    #pragma omp parallel for
+        #pragma omp parallel for
 #endif
-    for (int j = 0; j < args.height; ++j)
-    {
-        // Print progress info
+        for (int j = y0; j < y1; ++j)
+        {
+            // Print progress info
 #ifdef CS_C3100_USE_OPENMP
-        if (omp_get_thread_num() == 0 && args.show_progress)
-            ::printf("%.2f%% \r", lines_done * 100.0f / image_size(1));
+            if (omp_get_thread_num() == 0 && args.show_progress)
+                ::printf("%.2f%% \r", lines_done * 100.0f / (y1 - y0));
 #else
-        if (args.show_progress)
-            ::printf("%.2f%% \r", lines_done * 100.0f / image_size(1));
+            if (args.show_progress)
+                ::printf("%.2f%% \r", lines_done * 100.0f / (y1 - y0));
 #endif
 
-        // Construct sampler for this scanline.
-        // Done this way so that we can retain determinism even when running parallel for loops.
-        auto sampler = unique_ptr<Sampler>(Sampler::constructSampler(args.sampling_pattern, args.samples_per_pixel, args.random_seed + j));
-
-        // Loop over pixels on a scanline
-        for (int i = 0; i < args.width; ++i)
-        {
-            // When working on R9, use these to accumulate the results before writing to the respective images
-            Vector3f color = Vector3f::Zero();
-            Vector3f normal_color = Vector3f::Zero();
-            float depth_color = 0.0f;
-            // Loop through all the samples for this pixel.
-            for (int n = 0; n < args.samples_per_pixel; ++n)
+            // Construct sampler for this scanline.
+            // Done this way so that we can retain determinism even when running parallel for loops.
+            // With args.deterministic, the numbers of each sample are keyed to the pixel and the sample too,
+            // so that they don't depend on the order in which the pixels of the scanline are taken either.
+            auto sampler = unique_ptr<Sampler>(Sampler::constructSampler(args.sampling_pattern, args.samples_per_pixel, pass_seed + j));
+
+            // Generate the primary rays of the whole scanline in one batch.
+            // The sample positions are drawn in the same order as the pixel loop below consumes them.
+            // Those of the pixels left of the crop window are drawn too, so that cropping doesn't move the samples.
+            const int spp = args.samples_per_pixel;
+            RayBatch primary_rays;
+            if (scene.getCamera() && !reshade)
             {
-                // Get the offset of the sample inside the pixel. 
-                // You need to fill in the implementation for this function when implementing supersampling.
-                // The starter implementation only supports one sample per pixel through the pixel center.
-                Vector2f subpixel_offset = sampler->getSamplePosition(n);
-                //cout << "sampleposition of n: " << n << " = " << subpixel_offset.x() << ", " << subpixel_offset.y();
-                Vector2f pixel_coordinates = Vector2f(float(i), float(j)) + subpixel_offset;
-
-                // Convert floating-point pixel coordinate to canonical view coordinates in [-1,1]^2
-                // You need to fill in the implementation for Camera::normalizedImageCoordinateFromPixelCoordinate.
-                Vector2f normalized_image_coordinates = Camera::normalizedImageCoordinateFromPixelCoordinate(pixel_coordinates, image_size);
-
-                // Generate the ray using the view coordinates
-                // You need to fill in the implementation for this function.
-                Ray r = scene.getCamera()->generateRay(normalized_image_coordinates, fAspect);
-
-                // Trace the ray!
-                Hit hit;
-                float tmin = scene.getCamera()->getTMin();
-
-                // You should fill in the gaps in the implementation of traceRay().
-                // args.bounces gives the maximum number of reflections/refractions that should be traced.
-                Vector3f sample_color = ray_tracer.traceRay(r, tmin, args.bounces, 1.0f, hit, Vector3f::Ones());
-
-                // YOUR CODE HERE (R0)
-                // If args.display_uv is true, we want to render a test UV image where the color of each pixel
-                // is a simple function of its position in the image. The red component should linearly increase
-                // from 0 to 1 with the x coordinate increasing from 0 to args.width. Likewise the green component
-                // should linearly increase from 0 to 1 as the y coordinate increases from 0 to args.height. Since
-                // our image is two-dimensional we can't map blue to a simple linear function and just set it to 1.
-
-                if (args.display_uv)
+                Array2Xf points(2, (x1 - x0) * spp);
+                for (int i = 0; i < x1; ++i)
+                    for (int n = 0; n < spp; ++n)
+                    {
+                        // Get the offset of the sample inside the pixel.
+                        // You need to fill in the implementation for this function when implementing supersampling.
+                        // The starter implementation only supports one sample per pixel through the pixel center.
+                        if (args.deterministic)
+                            sampler->keyTo(i, j, n);
+                        Vector2f subpixel_offset = sampler->getSamplePosition(n);
+                        if (i < x0)
+                            continue;
+                        Vector2f pixel_coordinates = Vector2f(float(i), float(j)) + subpixel_offset;
+
+                        // Convert floating-point pixel coordinate to canonical view coordinates in [-1,1]^2
+                        // You need to fill in the implementation for Camera::normalizedImageCoordinateFromPixelCoordinate.
+                        points.col((i - x0) * spp + n) = Camera::normalizedImageCoordinateFromPixelCoordinate(pixel_coordinates, image_size);
+                    }
+
+                // Depth of field and motion blur need lens positions and shutter times too. These come from
+                // a separate generator, seeded past the range of the scanline samplers, so that turning them
+                // on doesn't change the pixel sample positions.
+                Array2Xf lens_samples;
+                ArrayXf times;
+                bool camera_samples = scene.getCamera()->needsSamples();
+                if (camera_samples)
                 {
-                    float intervalX = 1.0 / (args.width - 1);
-                    float intervalY = 1.0 / (args.height - 1);
-                    float red = 0.0 + i * intervalX;
-                    float green = 0.0 + j * intervalY;
-                    sample_color = Vector3f(red, green, 1.0);
-                };
-
-                // YOUR CODE HERE (R9)
-                // This starter code only supports one sample per pixel and consequently directly
-                // puts the returned color to the image. You should extend this code to handle
-                // multiple samples per pixel. Also sample the depth and normal visualization like the color.
-                // The requirement is just to take an average of all the samples within the pixel
-                // (so-called "box filtering"). Note that this starter code does not take an average,
-                // it just assumes the first and only sample is the final color.
-
-                color += sample_color;
-
-                // For extra credit, you can implement more sophisticated ones, such as "tent" and bicubic
-                // "Mitchell-Netravali" filters. This requires you to implement the addSample()
-                // function in the Film class and use it instead of directly setting pixel values in the image.
-
-                Vector4f s;
-                if (n == args.samples_per_pixel - 1) {
-                    color = color / args.samples_per_pixel;
-                    s << color, 1.0f;
-                    color_image->pixel(i, j) = s;
+                    UniformSampler camera_sampler(-1, pass_seed + args.height + j);
+                    lens_samples.resize(2, points.cols());
+                    times.resize(points.cols());
+                    for (int k = -x0 * spp; k < points.cols(); ++k)
+                    {
+                        if (args.deterministic)
+                        {
+                            int sample = k + x0 * spp;  // counted from the start of the scanline
+                            camera_sampler.keyTo(sample / spp, j, sample % spp);
+                        }
+                        Vector2f lens_sample = camera_sampler.random_Vector2f();
+                        float time = camera_sampler.random_Vector2f()(0);
+                        if (k < 0)
+                            continue;
+                        lens_samples.col(k) = lens_sample;
+                        times(k) = time;
+                    }
                 }
-            
-                if (depth_image)
-                {
-                    // new ray for depth to get rid of reflections of rays
-                    Ray rDepth = scene.getCamera()->generateRay(normalized_image_coordinates, fAspect);
-
-                    Hit hitDepth;
-                    float tminDepth = scene.getCamera()->getTMin();
-
-                    Vector3f sample_colorDepth = ray_tracer.traceRay(rDepth, tminDepth, 0, 1.0f, hitDepth, Vector3f::Ones());
-
-                    // YOUR CODE HERE (R2)
-                    // Here you should linearly map the t range [depth_min, depth_max] to the inverted range [1,0] for visualization
-                    // Note the inversion; closer objects should appear brighter.
 
-                    if (hitDepth.t > args.depth_max) { hitDepth.t = args.depth_max; }
-                    if (hitDepth.t < args.depth_min) { hitDepth.t = args.depth_min; }
+                // Generate the rays using the view coordinates
+                // You need to fill in the implementation for generateRay(); generateRays() does the same for a batch.
+                scene.getCamera()->generateRays(points, fAspect, camera_samples ? &lens_samples : nullptr, camera_samples ? &times : nullptr, primary_rays);
 
-                    float f = 1.0f - (hitDepth.t - args.depth_min) / (args.depth_max - args.depth_min);
-
-                    if (f > 1.0) { f = 1.0f; }
-                    if (f < 0) { f = 0.0f; }
-                    
-                    depth_image->pixel(i, j) = Vector4f{ f, f, f, 1.0f };
-                }
-                if (normal_image)
+                if (gbuffer)
                 {
+                    int first = gbuffer->index(x0, j, 0);
+                    gbuffer->rays.origin.middleCols(first, primary_rays.size()) = primary_rays.origin;
+                    gbuffer->rays.direction.middleCols(first, primary_rays.size()) = primary_rays.direction;
+                }
+            }
 
-                    // new ray for normal to get rid of reflections of rays
-                    Ray rNormal = scene.getCamera()->generateRay(normalized_image_coordinates, fAspect);
-
-                    Hit hitNormal;
-                    float tminNormal = scene.getCamera()->getTMin();
-
-                    Vector3f sample_colorDepth = ray_tracer.traceRay(rNormal, tminNormal, 0, 1.0f, hitNormal, Vector3f::Ones());
+            // Loop over pixels on a scanline
+            for (int i = x0; i < x1; ++i)
+            {
+                recorder.beginPixel(i, j);
+                TraceStats pixel_start_stats = trace_stats;
+                uint64_t pixel_start_cycles = cost_image ? readCycleCounter() : 0;
+
+                // When working on R9, use these to accumulate the results before writing to the respective images
+                Vector3f color = Vector3f::Zero();
+                Vector3f normal_color = Vector3f::Zero();
+                float depth_color = 0.0f;
+                Vector3f guide_albedo = Vector3f::Zero();
+                Vector3f guide_normal = Vector3f::Zero();
+                float guide_depth = 0.0f;
+                int guide_hits = 0;
+                // Loop through all the samples for this pixel.
+                for (int n = 0; n < args.samples_per_pixel; ++n)
+                {
+                    // Fetch the primary ray generated for this sample above, or the cached one when re-shading.
+                    Ray r = reshade ? gbuffer->rays.ray(gbuffer->index(i, j, n)) : primary_rays.ray((i - x0) * spp + n);
+                    r.width = sample_footprint(0);
+                    r.spread = sample_footprint(1);
+
+                    // Find the primary hit, unless it is cached already.
+                    Hit hit;
+                    float tmin = scene.getCamera()->getTMin();
+                    if (reshade)
+                        hit = gbuffer->hits[gbuffer->index(i, j, n)];
+                    else
+                    {
+                        ray_tracer.intersect(r, tmin, hit);
+                        if (gbuffer)
+                            gbuffer->hits[gbuffer->index(i, j, n)] = hit;
+                    }
+                    // shade() reuses hit for the secondary rays, so keep the primary hit for the depth and normal images.
+                    Hit primary_hit = hit;
+
+                    if (denoiser && pass == 0)
+                    {
+                        // Misses have zero albedo. The pixel is a miss for the denoiser only if all its samples are.
+                        if (primary_hit.material)
+                        {
+                            guide_albedo += primary_hit.material->diffuse_color(r.pointAtParameter(primary_hit.t), primary_hit);
+                            guide_normal += primary_hit.normal;
+                            guide_depth += primary_hit.t;
+                            ++guide_hits;
+                        }
+                        if (n == args.samples_per_pixel - 1)
+                            denoiser->setGuides(i, j, guide_albedo / args.samples_per_pixel, guide_normal, guide_hits ? guide_depth / guide_hits : FLT_MAX);
+                    }
+
+                    // Trace the ray! This is traceRay() with the primary intersection done above.
+                    // You should fill in the gaps in the implementation of traceRay().
+                    // args.bounces gives the maximum number of reflections/refractions that should be traced.
+                    Vector3f sample_color = ray_tracer.shade(r, hit, args.bounces, 1.0f, Vector3f::Ones());
+
+                    // YOUR CODE HERE (R0)
+                    // If args.display_uv is true, we want to render a test UV image where the color of each pixel
+                    // is a simple function of its position in the image. The red component should linearly increase
+                    // from 0 to 1 with the x coordinate increasing from 0 to args.width. Likewise the green component
+                    // should linearly increase from 0 to 1 as the y coordinate increases from 0 to args.height. Since
+                    // our image is two-dimensional we can't map blue to a simple linear function and just set it to 1.
+
+                    if (args.display_uv)
+                    {
+                        float intervalX = 1.0 / (args.width - 1);
+                        float intervalY = 1.0 / (args.height - 1);
+                        float red = 0.0 + i * intervalX;
+                        float green = 0.0 + j * intervalY;
+                        sample_color = Vector3f(red, green, 1.0);
+                    };
+
+                    // YOUR CODE HERE (R9)
+                    // This starter code only supports one sample per pixel and consequently directly
+                    // puts the returned color to the image. You should extend this code to handle
+                    // multiple samples per pixel. Also sample the depth and normal visualization like the color.
+                    // The requirement is just to take an average of all the samples within the pixel
+                    // (so-called "box filtering"). Note that this starter code does not take an average,
+                    // it just assumes the first and only sample is the final color.
+
+                    color += sample_color;
+
+                    // For extra credit, you can implement more sophisticated ones, such as "tent" and bicubic
+                    // "Mitchell-Netravali" filters. This requires you to implement the addSample()
+                    // function in the Film class and use it instead of directly setting pixel values in the image.
+
+                    Vector4f s;
+                    if (n == args.samples_per_pixel - 1) {
+                        color = color / args.samples_per_pixel;
+                        s << color, 1.0f;
+                        // The running average of the passes so far.
+                        color_image->pixel(i, j) = pass == 0 ? s : (color_image->pixel(i, j) * float(pass) + s) / float(pass + 1);
+                    }
+                
+                    if (depth_image)
+                    {
+                        // the primary hit, to get rid of reflections of rays
+                        Hit hitDepth = primary_hit;
+
+                        // YOUR CODE HERE (R2)
+                        // Here you should linearly map the t range [depth_min, depth_max] to the inverted range [1,0] for visualization
+                        // Note the inversion; closer objects should appear brighter.
+
+                        if (hitDepth.t > args.depth_max) { hitDepth.t = args.depth_max; }
+                        if (hitDepth.t < args.depth_min) { hitDepth.t = args.depth_min; }
+
+                        float f = 1.0f - (hitDepth.t - args.depth_min) / (args.depth_max - args.depth_min);
+
+                        if (f > 1.0) { f = 1.0f; }
+                        if (f < 0) { f = 0.0f; }
+                        
+                        depth_image->set(i, j, Vector4f{ f, f, f, 1.0f });
+                    }
+                    if (normal_image)
+                    {
+
+                        // the primary hit, to get rid of reflections of rays
+                        Hit hitNormal = primary_hit;
+
+                        Vector3f normal = hitNormal.normal;
+                        Vector3f col(fabs(normal[0]), fabs(normal[1]), fabs(normal[2]));
+                        col = clip(col, Vector3f::Zero(), Vector3f::Ones());
+                        normal_image->set(i, j, Vector4f{ col(0), col(1), col(2), 1.0f });
+                    }
+                }
 
-                    Vector3f normal = hitNormal.normal;
-                    Vector3f col(fabs(normal[0]), fabs(normal[1]), fabs(normal[2]));
-                    col = clip(col, Vector3f::Zero(), Vector3f::Ones());
-                    normal_image->pixel(i, j) = Vector4f{ col(0), col(1), col(2), 1.0f };
+                if (cost_image)
+                {
+                    uint64_t cycles = readCycleCounter() - pixel_start_cycles;
+                    Vector4f cost(float(cycles),
+                                  float(trace_stats.rays - pixel_start_stats.rays),
+                                  float(trace_stats.primitive_tests - pixel_start_stats.primitive_tests),
+                                  1.0f);
+                    // Summed over the passes.
+                    if (pass > 0)
+                        cost.head<3>() += cost_image->pixel(i, j).head<3>();
+                    cost_image->pixel(i, j) = cost;
                 }
             }
+            RayRecorder::endPixel();
+            ++lines_done;
         }
-        ++lines_done;
+
+        auto now = chrono::steady_clock::now();
+        if (args.time_budget_ms <= 0 || (now - budget_start) + (now - pass_start) > chrono::milliseconds(args.time_budget_ms))
+            break;
     }
+    if (args.time_budget_ms > 0)
+        cout << fmt::format("Rendered {} passes of {} samples per pixel within the time budget", pass + 1, args.samples_per_pixel) << endl;
+
+    if (gbuffer)
+        gbuffer->valid = true;
+
+    if (denoiser)
+        denoiser->denoise(*color_image, args.denoise);
 
     // YOUR CODE HERE (EXTRA)
     // When working on the better antialias filtering, the
@@ -280,7 +505,7 @@ shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args
     //    film_normal.normalize_weights();
 
     if (!args.output_file.empty())
-        color_image->exportPNG(args.output_file);
+        color_image->exportPNG(args.output_file, args.srgb);
 
     if (depth_image && !args.depth_file.empty())
         depth_image->exportPNG(args.depth_file);
@@ -288,5 +513,22 @@ shared_ptr<Image4f> render(RayTracer& ray_tracer, SceneParser& scene, const Args
     if (normal_image && !args.normals_file.empty())
     	normal_image->exportPNG(args.normals_file);
 
+    if (cost_image)
+    {
+        static const char* names[] = { "time", "rays", "tests" };
+        float scales[3];
+        double totals[3] = {};
+        for (int c = 0; c < 3; ++c)
+        {
+            scales[c] = exportHeatmap(*cost_image, c, args.cost_file + "_" + names[c] + ".png");
+            exportPFM(*cost_image, c, args.cost_file + "_" + names[c] + ".pfm");
+            for (int j = 0; j < args.height; ++j)
+                for (int i = 0; i < args.width; ++i)
+                    totals[c] += cost_image->pixel(i, j)(c);
+        }
+        cout << fmt::format("Cost: {:.0f} rays, {:.0f} primitive tests; heatmaps saturate at {:.0f} cycles, {:.0f} rays, {:.0f} tests per pixel",
+            totals[1], totals[2], scales[0], scales[1], scales[2]) << endl;
+    }
+
     return color_image;
 }
@@ -43,7 +43,7 @@ Vector3f PhongMaterial::shade(const Ray &ray, const Hit &hit,
 	float d = (dot > 0) ? dot : 0;
 
 	Vector3f point = ray.pointAtParameter(hit.t);
-	Vector3f dif = d * (incident_intensity.cwiseProduct(hit.material->diffuse_color(point))); // diffuse
+	Vector3f dif = d * (incident_intensity.cwiseProduct(hit.material->diffuse_color(point, hit))); // diffuse
 
 	// specular
 	auto lightNorm = dir_to_light.normalized();
@@ -57,6 +57,13 @@ Vector3f PhongMaterial::shade(const Ray &ray, const Hit &hit,
 	return dif + Si;
 }
 
+Vector3f PhongMaterial::diffuse_color(const Vector3f& point, const Hit& hit) const
+{
+	if (!texture_)
+		return diffuse_color_;
+	return diffuse_color_.cwiseProduct(texture_->sample(hit.uv, hit.uv_footprint, texture_mipmap_, texture_bilinear_));
+}
+
 Vector3f ProceduralMaterial::diffuse_color(const Vector3f& point) const
 {
 	Vector3f a1 = m1_->diffuse_color(point);
@@ -66,6 +73,15 @@ Vector3f ProceduralMaterial::diffuse_color(const Vector3f& point) const
 	return a1 * v + a2 * (1 - v);
 }
 
+Vector3f ProceduralMaterial::diffuse_color(const Vector3f& point, const Hit& hit) const
+{
+	Vector3f a1 = m1_->diffuse_color(point, hit);
+	Vector3f a2 = m2_->diffuse_color(point, hit);
+	Vector3f pt = VecUtils::transformPoint(matrix_, point);
+	float v = interpolation(pt);
+	return a1 * v + a2 * (1 - v);
+}
+
 Vector3f ProceduralMaterial::reflective_color(const Vector3f& point) const
 {
 	Vector3f a1 = m1_->reflective_color(point);
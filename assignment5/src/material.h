@@ -2,6 +2,7 @@
 
 #include "hit.h"
 #include "ray.h"
+#include "texture.h"
 
 //#include "gui/Image.h"
 //#include "io/File.h"
@@ -23,15 +24,16 @@ public:
 		diffuse_color_(diffuse_color),
 		reflective_color_(reflective_color),
 		transparent_color_(transparent_color),
-		refraction_index_(refraction_index),
-		texture_()
+		refraction_index_(refraction_index)
 	{
-		//if (texture_filename)
-		//	texture_.reset(FW::importImage(texture_filename));
+		if (texture_filename)
+			texture_ = Texture::load(texture_filename);
 	}
 	virtual ~Material() {}
 
 	virtual Vector3f diffuse_color(const Vector3f& point) const = 0;
+	// The diffuse color at a hit. Textured materials look it up at the texture coordinates of the hit.
+	virtual Vector3f diffuse_color(const Vector3f& point, const Hit& hit) const { return diffuse_color(point); }
 	virtual Vector3f reflective_color(const Vector3f& point) const = 0;
 	virtual Vector3f transparent_color(const Vector3f& point) const = 0;
 	virtual float refraction_index(const Vector3f& point) const = 0;
@@ -41,14 +43,22 @@ public:
 	// light incident from dirToLight at the specified intensity.
 	virtual Vector3f shade(const Ray& ray, const Hit& hit, const Vector3f& dir_to_light, const Vector3f& incident_intensity, bool shade_back ) const = 0;
 
+	// For editing the materials interactively.
+	void set_diffuse_color(const Vector3f& c) { diffuse_color_ = c; }
+	void set_reflective_color(const Vector3f& c) { reflective_color_ = c; }
+	void set_transparent_color(const Vector3f& c) { transparent_color_ = c; }
+	// The "mipmap" and "linearInterpolation" options of the scene file; both are off by default.
+	void set_texture_filtering(bool mipmap, bool bilinear) { texture_mipmap_ = mipmap; texture_bilinear_ = bilinear; }
+
 protected:
 	Vector3f diffuse_color_;
 	Vector3f reflective_color_;
 	Vector3f transparent_color_;
 	float refraction_index_;
 
-	//std::unique_ptr<FW::Image> texture_;
-	void* texture_;
+	shared_ptr<Texture> texture_;		// modulates the diffuse color
+	bool texture_mipmap_ = false;
+	bool texture_bilinear_ = false;
 };
 
 // This class implements the Phong shading model.
@@ -62,11 +72,14 @@ public:
 	{}
 
 	Vector3f	diffuse_color(const Vector3f&) const override { return diffuse_color_; }
+	Vector3f	diffuse_color(const Vector3f& point, const Hit& hit) const override;
 	Vector3f	reflective_color(const Vector3f&) const override { return reflective_color_; }
 	Vector3f	transparent_color(const Vector3f&) const { return transparent_color_; }
 	float		refraction_index(const Vector3f&) const override { return refraction_index_; }
 	Vector3f	specular_color() const { return specular_color_; }
 	float		exponent() const { return exponent_; }
+	void		set_specular_color(const Vector3f& c) { specular_color_ = c; }
+	void		set_exponent(float e) { exponent_ = e; }
 
 	// You need to fill in this implementation of this function.
 	Vector3f shade(const Ray& ray, const Hit& hit, const Vector3f& dir_to_light, const Vector3f& incident_intensity, bool shade_back) const override;
@@ -85,6 +98,7 @@ public:
 	{ assert(m1 != nullptr && m2 != nullptr); }
 
 	Vector3f	diffuse_color(const Vector3f& point) const override;
+	Vector3f	diffuse_color(const Vector3f& point, const Hit& hit) const override;
 	Vector3f	reflective_color(const Vector3f& point) const override;
 	Vector3f	transparent_color(const Vector3f& point) const override;
 	float		refraction_index(const Vector3f& point) const override;
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cassert>
+#include <cstdio>
 #include <memory>
 #include <vector>
 
+#include "bvh.h"
 #include "material.h"
 //#include "base/Math.h"
 //#include "3d/Mesh.h"
@@ -10,6 +13,8 @@
 struct Ray;
 struct Hit;
 class Material;
+class PreviewScene;
+class SceneArena;
 
 // This is the base class for the all the kinds of objects in the scene.
 // Its subclasses are Groups, Transforms, Triangles, Planes, Spheres, etc.
@@ -31,6 +36,15 @@ public:
 
     virtual void preview_render(const Matrix4f& objectToWorld) const = 0;
 
+	// Adds the object to the retained preview, in world space.
+	virtual void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const = 0;
+
+	// Adds the primitives of the object to the given list of the frozen scene.
+	virtual void arena_collect(SceneArena& arena, int list) const = 0;
+
+	// Axis-aligned bounding box of the object. Unbounded objects such as planes return AABB::infinite().
+	virtual AABB bounds() const = 0;
+
 	shared_ptr<Material> material() const { return material_; }
 	void set_material(shared_ptr<Material> m) { material_ = m; }
 
@@ -59,6 +73,12 @@ public:
 	}
 	bool intersect(const Ray& r, Hit& h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override { return AABB(min_, max_); }
+
+	// The intersection test itself, shared with SceneArena. Fills in everything in h but the material.
+	static bool intersectGeometry(const Vector3f& min, const Vector3f& max, const Ray& r, Hit& h, float tmin);
 
 private:
 	Vector3f	min_;
@@ -73,6 +93,9 @@ public:
 
 	bool intersect(const Ray& r, Hit& h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override;
 
 	size_t size() const { return objects_.size(); }
 	shared_ptr<ObjectBase> operator[](int i) const;
@@ -92,10 +115,16 @@ public:
 
 	bool intersect(const Ray& r, Hit& h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override { return AABB::infinite(); }
 
 	const Vector3f& normal() const { return normal_; }
 	float offset() const { return offset_; }
 
+	// The intersection test itself, shared with SceneArena. Fills in everything in h but the material.
+	static bool intersectGeometry(const Vector3f& normal, float offset, const Ray& r, Hit& h, float tmin);
+
 private:
 	Vector3f normal_;
 	float offset_;
@@ -112,6 +141,12 @@ public:
 
 	bool intersect(const Ray& r, Hit& h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override { return AABB(center_ - Vector3f::Constant(radius_), center_ + Vector3f::Constant(radius_)); }
+
+	// The intersection test itself, shared with SceneArena. Fills in everything in h but the material.
+	static bool intersectGeometry(const Vector3f& center, float radius, const Ray& r, Hit& h, float tmin);
 
 private:
 	Vector3f center_;
@@ -128,6 +163,14 @@ public:
 
 	bool intersect(const Ray &r, Hit &h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override { return object_->bounds().transformed(matrix_); }
+
+	// The ray in the coordinate system inside the transform, and the normal of a hit found with it back outside;
+	// shared with SceneArena.
+	static Ray objectRay(const Matrix4f& inverse, const Ray& r);
+	static Vector3f worldNormal(const Matrix4f& inverse_transpose, const Vector3f& normal);
 
 private:
 	Matrix4f                matrix_;
@@ -142,12 +185,193 @@ public:
 	// a triangle contains, in addition to the vertices, 2D texture coordinates,
 	// often called "uv coordinates".
 	TriangleObject(const Vector3f& a, const Vector3f& b, const Vector3f &c, shared_ptr<Material> m);
+	TriangleObject(const Vector3f& a, const Vector3f& b, const Vector3f &c,
+		const Vector2f& ta, const Vector2f& tb, const Vector2f& tc, shared_ptr<Material> m);
 
 	bool intersect(const Ray &r, Hit &h, float tmin) const override;
 	void preview_render(const Matrix4f& objectToWorld) const override;
+	void preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const override;
+	void arena_collect(SceneArena& arena, int list) const override;
+	AABB bounds() const override;
 
 	const Vector3f& vertex(int i) const;
+	void set_vertex(int i, const Vector3f& v);	// call SceneParser::refitArena() afterwards for the ray tracer to see it
+
+	// The intersection test itself, shared with SceneArena. Fills in everything in h but the material.
+	static bool intersectGeometry(const Vector3f* vertices, const Vector2f* texcoords, float uv_scale, const Ray& r, Hit& h, float tmin);
 
 private:
+	void update_uv_scale();
+
 	Vector3f vertices_[3];
+	Vector2f texcoords_[3];
+	float uv_scale_;	// length in texture coordinates per unit length on the triangle, on average
 };
+
+// The intersection tests of the primitives, inline so that the objects and SceneArena both get them inlined.
+// The compilers leave functions this big out of line otherwise, and the call costs as much as the test.
+#ifdef _MSC_VER
+#define PRIMITIVE_INLINE __forceinline
+#else
+#define PRIMITIVE_INLINE inline __attribute__((always_inline))
+#endif
+
+PRIMITIVE_INLINE bool BoxObject::intersectGeometry(const Vector3f& min, const Vector3f& max, const Ray& r, Hit& h, float tmin) {
+// YOUR CODE HERE (EXTRA)
+// Intersect the box with the ray!
+
+	float t_far = FLT_MAX;
+	float t_near = -FLT_MAX;
+	for (int i = 0; i < 3; ++i) { //x,y,z
+		float t1 = (min[i] - r.origin[i]) / r.direction[i];
+		float t2 = (max[i] - r.origin[i]) / r.direction[i];
+
+		if (t1 > t2) {
+			float tmp = t1;
+			t1 = t2;
+			t2 = tmp;
+		}
+
+		if (t_near < t1) t_near = t1;
+		if (t_far > t2) t_far = t2;
+
+		if (t_near > t_far) return false; 
+	}
+	if (t_near < tmin) return false; 
+
+	h.setGeometry(t_near, h.normal); 
+	return true;
+
+}
+
+PRIMITIVE_INLINE bool PlaneObject::intersectGeometry(const Vector3f& normal, float offset, const Ray& r, Hit& h, float tmin) {
+	// YOUR CODE HERE (R5)
+	// Intersect the ray with the plane.
+	// Pay attention to respecting tmin and h.t!
+	// Equation for a plane:
+	// ax + by + cz = d;
+	// normal . p - d = 0
+	// (plug in ray)
+	// origin + direction * t = p(t)
+	// origin . normal + t * direction . normal = d;
+	// t = (d - origin . normal) / (direction . normal);
+	//auto D = normal * offset;
+	const float t = (offset - r.origin.dot(normal)) / (r.direction.dot(normal));
+	if (h.t > t && t > tmin) {
+		h.setGeometry(t, normal);
+		return true;
+	}
+
+	return false;
+}
+
+inline Ray TransformObject::objectRay(const Matrix4f& inverse, const Ray& r) {
+	Vector4f origin_os = inverse * Vector4f(r.origin(0), r.origin(1), r.origin(2), 1.0f);
+	Vector4f dir_os = inverse * Vector4f(r.direction(0), r.direction(1), r.direction(2), 0.0f);
+
+	Ray ray2(origin_os.head<3>(), dir_os.head<3>());
+	// Distances scale with the length of the direction; the angle of the footprint stays.
+	if (r.width > 0.0f)
+		ray2.width = r.width * ray2.direction.norm() / r.direction.norm();
+	ray2.spread = r.spread;
+	return ray2;
+}
+
+inline Vector3f TransformObject::worldNormal(const Matrix4f& inverse_transpose, const Vector3f& normal) {
+	Vector4f normal_h_back = inverse_transpose * Vector4f(normal(0), normal(1), normal(2), 0.0f);
+	return normal_h_back.head<3>().normalized();
+}
+
+PRIMITIVE_INLINE bool SphereObject::intersectGeometry(const Vector3f& center, float radius, const Ray& r, Hit& h, float tmin) {
+	// Note that the sphere is not necessarily centered at the origin.
+	
+	Vector3f tmp = center - r.origin;
+	Vector3f dir = r.direction;
+
+	float A = dir.dot(dir);
+	float B = - 2 * dir.dot(tmp);
+    float C = tmp.dot(tmp) - (radius* radius);
+	float radical = B*B - 4*A*C;
+	if (radical < 0)
+		return false;
+
+	radical = sqrtf(radical);
+	float t_m = ( -B - radical ) / ( 2 * A );
+	float t_p = ( -B + radical ) / ( 2 * A );
+	Vector3f pt_m = r.pointAtParameter( t_m );
+	Vector3f pt_p = r.pointAtParameter( t_p );
+
+	assert(r.direction.norm() > 0.9f);
+
+	bool flag = t_m <= t_p;
+	if (!flag) {
+		::printf( "sphere ts: %f %f %f\n", tmin, t_m, t_p );
+		return false;
+	}
+	assert( t_m <= t_p );
+
+	// choose the closest hit in front of tmin
+	float t = (t_m < tmin) ? t_p : t_m;
+
+	if (h.t > t  && t > tmin) {
+		Vector3f normal = r.pointAtParameter(t);
+		normal -= center;
+		normal.normalize();
+		h.setGeometry(t, normal);
+		return true;
+	}
+	return false;
+}
+
+PRIMITIVE_INLINE bool TriangleObject::intersectGeometry(const Vector3f* vertices, const Vector2f* texcoords, float uv_scale, const Ray& r, Hit& h, float tmin)
+{
+	// YOUR CODE HERE (R6)
+	// Intersect the triangle with the ray!
+	// Again, pay attention to respecting tmin and h.t!
+	const Vector3f a = vertices[0];
+	const Vector3f b = vertices[1];
+	const Vector3f c = vertices[2];
+
+	Matrix3f A; 
+	A <<
+		a.x() - b.x(), a.x() - c.x(), r.direction.x(),
+		a.y() - b.y(), a.y() - c.y(), r.direction.y(),
+		a.z() - b.z(), a.z() - c.z(), r.direction.z();
+
+	Matrix3f At;
+	At <<
+		(a.x() - b.x()), (a.x() - c.x()), (a.x() - r.origin.x()),
+		(a.y() - b.y()), (a.y() - c.y()), (a.y() - r.origin.y()),
+		(a.z() - b.z()), (a.z() - c.z()), (a.z() - r.origin.z());
+
+	Matrix3f Ab;
+	Ab <<
+		(a.x() - r.origin.x()), (a.x() - c.x()), (r.direction.x()),
+		(a.y() - r.origin.y()), (a.y() - c.y()), (r.direction.y()),
+		(a.z() - r.origin.z()), (a.z() - c.z()), (r.direction.z());
+
+	Matrix3f Ay;
+	Ay <<
+		(a.x() - b.x()), (a.x() - r.origin.x()), (r.direction.x()),
+		(a.y() - b.y()), (a.y() - r.origin.y()), (r.direction.y()),
+		(a.z() - b.z()), (a.z() - r.origin.z()), (r.direction.z());
+
+	const float t = At.determinant() / A.determinant();
+	const float baryB = Ab.determinant() / A.determinant();
+	const float baryY = Ay.determinant() / A.determinant();
+
+	if (baryB + baryY >= 1 || baryB <= 0 || baryY <= 0) { return false; };
+
+	if (h.t > t && t > tmin) {
+		//Vector3f normal = r.pointAtParameter(t);
+		Vector3f normal((b - a).cross(c - a));
+
+		normal.normalize();
+		Vector2f uv = (1.0f - baryB - baryY) * texcoords[0] + baryB * texcoords[1] + baryY * texcoords[2];
+		// The footprint stretches along the surface as the ray comes in at a grazing angle.
+		float cos_angle = max(fabs(normal.dot(r.direction)) / r.direction.norm(), 0.1f);
+		h.setGeometry(t, normal, uv, r.footprint(t) * uv_scale / cos_angle);
+		return true;
+	}
+	return false;
+}
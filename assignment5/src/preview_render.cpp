@@ -17,36 +17,53 @@ using namespace std;
 #include "object.h"
 
 #include "hit.h"
+#include "preview_scene.h"
 #include "vec_utils.h"
 
 #include <cassert>
 
+namespace {
 
-void GroupObject::preview_render(const Matrix4f& objectToWorld) const
+Vector3f previewColor(const shared_ptr<Material>& m, const Vector3f& point)
 {
-    for (auto& o : objects_)
-        o->preview_render(objectToWorld);
+    return m ? m->diffuse_color(point) : Vector3f::Constant(0.8f);
 }
 
-void TransformObject::preview_render(const Matrix4f& objectToWorld) const
-{
-    object_->preview_render(objectToWorld*matrix_);
-}
-
-void PlaneObject::preview_render(const Matrix4f& objectToWorld) const
+// Frame with the y axis along the plane normal, as drawn by PlaneObject::preview_render().
+Matrix4f planeMatrix(const Vector3f& normal, float offset)
 {
     Matrix4f matrix = Matrix4f::Identity();
-    auto n = normal_.normalized(); Vector3f b, c;
+    auto n = normal.normalized(); Vector3f b, c;
     if (n.cross(Vector3f(1.0f, .0f, .0f)).norm() > .0001f)
         b = n.cross(Vector3f(1.0f, 0.0f, 0.0f));
     else
         b = n.cross(Vector3f(0.0f, 1.0f, 0.0f));
     c = b.cross(n);
-    
+
     matrix.block(0, 0, 3, 1) = c;
     matrix.block(0, 1, 3, 1) = n;
     matrix.block(0, 2, 3, 1) = b;
-    matrix.block(0, 3, 3, 1) = offset_*normal_;
+    matrix.block(0, 3, 3, 1) = offset*normal;
+    return matrix;
+}
+
+} // namespace
+
+
+void GroupObject::preview_render(const Matrix4f& objectToWorld) const
+{
+    for (auto& o : objects_)
+        o->preview_render(objectToWorld);
+}
+
+void TransformObject::preview_render(const Matrix4f& objectToWorld) const
+{
+    object_->preview_render(objectToWorld*matrix_);
+}
+
+void PlaneObject::preview_render(const Matrix4f& objectToWorld) const
+{
+    Matrix4f matrix = planeMatrix(normal_, offset_);
 
     Vector3f color = material_->diffuse_color(Vector3f::Zero());
     Im3d::SetColor(color(0), color(1), color(2));
@@ -92,3 +109,43 @@ void TriangleObject::preview_render(const Matrix4f& objectToWorld) const
     Im3d::End();
     Im3d::PopMatrix();
 }
+
+void GroupObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    for (auto& o : objects_)
+        o->preview_collect(preview, objectToWorld);
+}
+
+void TransformObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    object_->preview_collect(preview, objectToWorld*matrix_);
+}
+
+void PlaneObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    preview.addInstance(PreviewScene::Shape_Plane, objectToWorld*planeMatrix(normal_, offset_), previewColor(material_, Vector3f::Zero()));
+}
+
+void SphereObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    Matrix4f matrix = Matrix4f::Identity();
+    matrix.block(0, 0, 3, 3) *= radius_;
+    matrix.block(0, 3, 3, 1) = center_;
+    preview.addInstance(PreviewScene::Shape_Sphere, objectToWorld*matrix, previewColor(material_, Vector3f::Zero()));
+}
+
+void BoxObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    Matrix4f matrix = Matrix4f::Identity();
+    matrix.block(0, 0, 3, 3) = (max_ - min_).asDiagonal();
+    matrix.block(0, 3, 3, 1) = min_;
+    preview.addInstance(PreviewScene::Shape_Box, objectToWorld*matrix, previewColor(material_, Vector3f::Zero()));
+}
+
+void TriangleObject::preview_collect(PreviewScene& preview, const Matrix4f& objectToWorld) const
+{
+    Vector3f v[3];
+    for (int i = 0; i < 3; ++i)
+        v[i] = (objectToWorld * vertices_[i].homogeneous()).hnormalized();
+    preview.addTriangle(v[0], v[1], v[2], previewColor(material_, vertices_[0]));
+}
@@ -0,0 +1,278 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "preview_scene.h"
+
+#include "object.h"
+#include "ShaderProgram.h"
+
+#include <cstddef>
+
+namespace {
+
+// Vertex of the unit meshes that the instances are drawn with. Their color comes from the instance.
+struct MeshVertex
+{
+    Vector3f    position;
+    Vector3f    normal;
+};
+
+void sphereMesh(vector<MeshVertex>& vertices, vector<uint32_t>& indices)
+{
+    const int stacks = 16, slices = 32;
+    for (int i = 0; i <= stacks; ++i)
+    {
+        float theta = EIGEN_PI * i / stacks;
+        for (int j = 0; j <= slices; ++j)
+        {
+            float phi = 2.0f * EIGEN_PI * j / slices;
+            Vector3f p(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+            vertices.push_back(MeshVertex{ p, p });
+        }
+    }
+    for (int i = 0; i < stacks; ++i)
+    {
+        for (int j = 0; j < slices; ++j)
+        {
+            uint32_t a = i * (slices + 1) + j, b = a + slices + 1;
+            indices.insert(indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+        }
+    }
+}
+
+void boxMesh(vector<MeshVertex>& vertices, vector<uint32_t>& indices)
+{
+    // Four corners for each face so that the faces get their own normals.
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            Vector3f normal = Vector3f::Zero();
+            normal(axis) = side ? 1.0f : -1.0f;
+            int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            uint32_t first = uint32_t(vertices.size());
+            for (int corner = 0; corner < 4; ++corner)
+            {
+                Vector3f p = Vector3f::Zero();
+                p(axis) = float(side);
+                p(u) = float(corner & 1);
+                p(v) = float(corner >> 1);
+                vertices.push_back(MeshVertex{ p, normal });
+            }
+            indices.insert(indices.end(), { first, first + 1, first + 2, first + 2, first + 1, first + 3 });
+        }
+    }
+}
+
+void planeMesh(vector<MeshVertex>& vertices, vector<uint32_t>& indices)
+{
+    for (int corner = 0; corner < 4; ++corner)
+        vertices.push_back(MeshVertex{ Vector3f(corner & 1 ? 10.0f : -10.0f, 0.0f, corner & 2 ? 10.0f : -10.0f), Vector3f(0.0f, 1.0f, 0.0f) });
+    indices = { 0, 1, 2, 2, 1, 3 };
+}
+
+} // namespace
+
+PreviewScene::PreviewScene() = default;
+PreviewScene::~PreviewScene() = default;
+
+void PreviewScene::initRendering()
+{
+    // Position, normal and color in locations 0-2, and the columns of the object-to-world matrix in 3-6.
+    // The normals go through the cofactor matrix, which is the inverse transpose up to scale but never singular.
+    program_.reset(new ShaderProgram(
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+        layout(location = 0) in vec3 aPosition;
+        layout(location = 1) in vec3 aNormal;
+        layout(location = 2) in vec3 aColor;
+        layout(location = 3) in mat4 aModel;
+
+        out vec3 vColor;
+
+        uniform mat4 uWorldToClip;
+
+        const vec3 directionToLight = normalize(vec3(0.5, 0.3, 0.6));
+
+        void main()
+        {
+            mat3 m = mat3(aModel);
+            mat3 cofactor = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+            vec3 normal = normalize(cofactor * aNormal);
+            float shade = 0.4 + 0.6 * abs(dot(normal, directionToLight));
+            gl_Position = uWorldToClip * aModel * vec4(aPosition, 1);
+            vColor = shade * aColor;
+        }
+        ),
+        "#version 330\n"
+        FW_GL_SHADER_SOURCE(
+        in vec3 vColor;
+        out vec4 fColor;
+        void main()
+        {
+            fColor = vec4(vColor, 1);
+        }
+        )));
+    world_to_clip_uniform_ = program_->getUniformLoc("uWorldToClip");
+
+    // The triangles are in world space already and carry their own colors.
+    glGenVertexArrays(1, &triangle_vao_);
+    glBindVertexArray(triangle_vao_);
+    glGenBuffers(1, &triangle_buffer_);
+    glBindBuffer(GL_ARRAY_BUFFER, triangle_buffer_);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, color));
+
+    void (*generators[Shape_Count])(vector<MeshVertex>&, vector<uint32_t>&) = { sphereMesh, boxMesh, planeMesh };
+    for (int s = 0; s < Shape_Count; ++s)
+    {
+        vector<MeshVertex> vertices;
+        vector<uint32_t> indices;
+        generators[s](vertices, indices);
+
+        Mesh& mesh = meshes_[s];
+        mesh.num_indices = int(indices.size());
+        glGenVertexArrays(1, &mesh.vao);
+        glBindVertexArray(mesh.vao);
+
+        glGenBuffers(1, &mesh.vertex_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (GLvoid*)offsetof(MeshVertex, position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (GLvoid*)offsetof(MeshVertex, normal));
+
+        glGenBuffers(1, &mesh.index_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * indices.size(), indices.data(), GL_STATIC_DRAW);
+
+        // The color and the matrix advance once per instance.
+        glGenBuffers(1, &mesh.instance_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.instance_buffer);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)offsetof(Instance, color));
+        glVertexAttribDivisor(2, 1);
+        for (int k = 0; k < 4; ++k)
+        {
+            glEnableVertexAttribArray(3 + k);
+            glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*)(offsetof(Instance, model) + 4 * sizeof(float) * k));
+            glVertexAttribDivisor(3 + k, 1);
+        }
+    }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void PreviewScene::build(const ObjectBase& root)
+{
+    if (!program_)
+        initRendering();
+
+    triangles_.clear();
+    for (auto& instances : instances_)
+        instances.clear();
+    root.preview_collect(*this, Matrix4f::Identity());
+
+    glBindBuffer(GL_ARRAY_BUFFER, triangle_buffer_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * triangles_.size(), triangles_.data(), GL_STATIC_DRAW);
+    num_triangle_vertices_ = int(triangles_.size());
+    for (int s = 0; s < Shape_Count; ++s)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, meshes_[s].instance_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * instances_[s].size(), instances_[s].data(), GL_STATIC_DRAW);
+        meshes_[s].num_instances = int(instances_[s].size());
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // The GPU has its own copy now.
+    vector<Vertex>().swap(triangles_);
+    for (auto& instances : instances_)
+        vector<Instance>().swap(instances);
+}
+
+void PreviewScene::draw(const Matrix4f& world_to_clip) const
+{
+    if (!program_)
+        return;
+
+    glUseProgram(program_->getHandle());
+    glUniformMatrix4fv(world_to_clip_uniform_, 1, GL_FALSE, world_to_clip.data());
+
+    if (num_triangle_vertices_ > 0)
+    {
+        // Without an array behind them, the matrix attributes read this constant identity.
+        glBindVertexArray(triangle_vao_);
+        for (int k = 0; k < 4; ++k)
+            glVertexAttrib4f(3 + k, k == 0, k == 1, k == 2, k == 3);
+        glDrawArrays(GL_TRIANGLES, 0, num_triangle_vertices_);
+    }
+
+    for (const Mesh& mesh : meshes_)
+    {
+        if (mesh.num_instances == 0)
+            continue;
+        glBindVertexArray(mesh.vao);
+        glDrawElementsInstanced(GL_TRIANGLES, mesh.num_indices, GL_UNSIGNED_INT, 0, mesh.num_instances);
+    }
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+void PreviewScene::release()
+{
+    if (!program_)
+        return;
+
+    glDeleteVertexArrays(1, &triangle_vao_);
+    glDeleteBuffers(1, &triangle_buffer_);
+    for (Mesh& mesh : meshes_)
+    {
+        glDeleteVertexArrays(1, &mesh.vao);
+        glDeleteBuffers(1, &mesh.vertex_buffer);
+        glDeleteBuffers(1, &mesh.index_buffer);
+        glDeleteBuffers(1, &mesh.instance_buffer);
+        mesh = Mesh();
+    }
+    triangle_vao_ = triangle_buffer_ = 0;
+    num_triangle_vertices_ = 0;
+    program_.reset();
+}
+
+int PreviewScene::numInstances() const
+{
+    int count = 0;
+    for (const Mesh& mesh : meshes_)
+        count += mesh.num_instances;
+    return count;
+}
+
+void PreviewScene::addTriangle(const Vector3f& a, const Vector3f& b, const Vector3f& c, const Vector3f& color)
+{
+    Vector3f normal = (b - a).cross(c - a).normalized();
+    triangles_.push_back(Vertex{ a, normal, color });
+    triangles_.push_back(Vertex{ b, normal, color });
+    triangles_.push_back(Vertex{ c, normal, color });
+}
+
+void PreviewScene::addInstance(Shape shape, const Matrix4f& model, const Vector3f& color)
+{
+    instances_[shape].push_back(Instance{ model, color });
+}
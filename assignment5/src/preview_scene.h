@@ -0,0 +1,79 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+class ObjectBase;
+class ShaderProgram;
+
+// Retained GPU copy of the scene for the interactive preview. The scene is flattened into world space
+// once when it is loaded: all the triangles go into one vertex buffer with their colors, and the spheres,
+// boxes and planes become instances of one unit mesh per kind. The whole scene then draws with four draw
+// calls per frame instead of walking the objects and sending them through Im3d one by one.
+class PreviewScene
+{
+public:
+    enum Shape
+    {
+        Shape_Sphere,
+        Shape_Box,      // unit cube [0,1]^3
+        Shape_Plane,    // 20x20 square in the xz plane, centered at the origin
+        Shape_Count
+    };
+
+    PreviewScene();
+    ~PreviewScene();    // doesn't touch GL; call release() while the context still exists
+
+    // Collects the geometry of the scene and uploads it to the GPU.
+    // Call again when the scene or the colors of its materials change.
+    void            build(const ObjectBase& root);
+    void            draw(const Matrix4f& world_to_clip) const;
+    void            release();  // frees the GL objects; the GL context must still be current
+
+    int             numTriangles() const { return num_triangle_vertices_ / 3; }
+    int             numInstances() const;
+
+    // Called by ObjectBase::preview_collect() while building.
+    void            addTriangle(const Vector3f& a, const Vector3f& b, const Vector3f& c, const Vector3f& color);
+    void            addInstance(Shape shape, const Matrix4f& model, const Vector3f& color);
+
+private:
+                    PreviewScene    (const PreviewScene&) = delete;
+    PreviewScene&   operator=       (const PreviewScene&) = delete;
+
+    void            initRendering();
+
+    struct Vertex
+    {
+        Vector3f    position;
+        Vector3f    normal;
+        Vector3f    color;
+    };
+
+    struct Instance
+    {
+        Matrix4f    model;
+        Vector3f    color;
+    };
+
+    struct Mesh
+    {
+        GLuint      vao             = 0;
+        GLuint      vertex_buffer   = 0;
+        GLuint      index_buffer    = 0;
+        GLuint      instance_buffer = 0;
+        int         num_indices     = 0;
+        int         num_instances   = 0;
+    };
+
+    // Filled in by build() and freed after uploading.
+    vector<Vertex>                  triangles_;
+    vector<Instance>                instances_[Shape_Count];
+
+    unique_ptr<ShaderProgram>       program_;
+    GLint                           world_to_clip_uniform_  = -1;
+    GLuint                          triangle_vao_           = 0;
+    GLuint                          triangle_buffer_        = 0;
+    int                             num_triangle_vertices_  = 0;
+    Mesh                            meshes_[Shape_Count];
+};
@@ -15,8 +15,45 @@ struct Ray
 		return origin + direction * t;
 	}
 
+	// Width of the footprint of the ray at parameter t; see width and spread.
+	float footprint(float t) const {
+		return width + spread * t * direction.norm();
+	}
+
 	Vector3f origin;
 	Vector3f direction;
+
+	// The ray stands for a cone of rays around it, as wide as the image sample it was shot for: width at
+	// the origin, widening by spread per unit of distance travelled. This is an isotropic stand-in for ray
+	// differentials that chooses the mip level of textures. Rays without a footprint sample the finest level.
+	float width = 0.0f;
+	float spread = 0.0f;
+};
+
+// Structure-of-arrays storage for a batch of rays, e.g. all the primary rays of a scanline or a tile.
+// Each row holds one coordinate of all the rays, so that operations over the batch vectorize.
+struct RayBatch
+{
+	void resize(int n) {
+		origin.resize(3, n);
+		direction.resize(3, n);
+	}
+
+	int size() const { return int(origin.cols()); }
+
+	Ray ray(int i) const {
+		return Ray(Vector3f(origin(0, i), origin(1, i), origin(2, i)), Vector3f(direction(0, i), direction(1, i), direction(2, i)));
+	}
+
+	void normalizeDirections() {
+		Array<float, 1, Dynamic> len2 = direction.row(0).square() + (direction.row(1).square() + direction.row(2).square());
+		Array<float, 1, Dynamic> len = (len2 > 0.0f).select(len2.sqrt(), 1.0f);
+		for (int c = 0; c < 3; ++c)
+			direction.row(c) /= len;
+	}
+
+	Array<float, 3, Dynamic, RowMajor> origin;
+	Array<float, 3, Dynamic, RowMajor> direction;
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Vector3f& v) {
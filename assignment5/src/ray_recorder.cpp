@@ -0,0 +1,76 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "ray_recorder.h"
+
+RayRecorder& RayRecorder::instance()
+{
+    static RayRecorder recorder;
+    return recorder;
+}
+
+void RayRecorder::start(int x0, int y0, int x1, int y1, size_t capacity)
+{
+    lock_guard<mutex> guard(lock_);
+    buffers_.clear();
+    // The threads notice the new generation and take new buffers the next time they record.
+    ++generation_;
+    x0_ = x0;
+    y0_ = y0;
+    x1_ = x1;
+    y1_ = y1;
+    capacity_ = capacity;
+    recording_ = true;
+}
+
+void RayRecorder::record(const RaySegment& segment)
+{
+    ThreadState& state = current_;
+    if (state.generation != generation_)
+    {
+        lock_guard<mutex> guard(lock_);
+        buffers_.push_back(make_unique<Buffer>());
+        state.buffer = buffers_.back().get();
+        state.generation = generation_;
+    }
+
+    Buffer& buffer = *state.buffer;
+    if (buffer.ring.size() < capacity_)
+        buffer.ring.push_back(segment);
+    else if (capacity_ > 0)
+        buffer.ring[buffer.count % capacity_] = segment;
+    ++buffer.count;
+}
+
+vector<RaySegment> RayRecorder::segments() const
+{
+    lock_guard<mutex> guard(lock_);
+    vector<RaySegment> all;
+    for (auto& buffer : buffers_)
+    {
+        size_t oldest = buffer->count > buffer->ring.size() ? size_t(buffer->count % capacity_) : 0;
+        all.insert(all.end(), buffer->ring.begin() + oldest, buffer->ring.end());
+        all.insert(all.end(), buffer->ring.begin(), buffer->ring.begin() + oldest);
+    }
+    return all;
+}
+
+uint64_t RayRecorder::numOverwritten() const
+{
+    lock_guard<mutex> guard(lock_);
+    uint64_t overwritten = 0;
+    for (auto& buffer : buffers_)
+        overwritten += buffer->count - buffer->ring.size();
+    return overwritten;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ray_tracer.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Records the rays traced for the pixels in a region of the image during a normal, parallel render, for
+// the debug visualisation. Each thread records into a ring buffer of its own, so recording takes no
+// locks; a full buffer overwrites its oldest segments, which bounds the memory however expensive the
+// pixels are. When nothing is recorded, a ray costs one test of a thread-local flag.
+class RayRecorder
+{
+public:
+    static RayRecorder& instance();
+
+    // Starts recording the pixels [x0, x1) x [y0, y1), keeping the last capacity segments of every
+    // thread, and forgets what was recorded before. Not to be called while rendering.
+    void            start(int x0, int y0, int x1, int y1, size_t capacity);
+    void            stop()                      { recording_ = false; }
+    bool            recording() const           { return recording_; }
+
+    // Called by render() before each pixel: the rays that the thread traces from then on belong to pixel
+    // (x,y). endPixel() after the last pixel of the thread stops it from recording.
+    void            beginPixel(int x, int y) const
+    {
+        current_.in_region = recording_ && x >= x0_ && x < x1_ && y >= y0_ && y < y1_;
+    }
+    static void     endPixel()                  { current_.in_region = false; }
+
+    // Does the calling thread record its rays now? Test this before making the segment for record().
+    static bool     active()                    { return current_.in_region; }
+    void            record(const RaySegment& segment);
+
+    // The segments recorded by all the threads, those of each thread oldest first.
+    vector<RaySegment>  segments() const;
+    uint64_t            numOverwritten() const;
+
+private:
+    RayRecorder() {}
+
+    // The segments of one thread. Once the ring is full, the oldest is at count % capacity.
+    struct Buffer
+    {
+        vector<RaySegment>  ring;
+        uint64_t            count = 0;          // recorded in all
+    };
+    struct ThreadState
+    {
+        bool                in_region   = false;
+        Buffer*             buffer      = nullptr;
+        uint64_t            generation  = 0;    // of the recording that the buffer belongs to
+    };
+    static thread_local ThreadState current_;
+
+    bool                        recording_  = false;
+    int                         x0_ = 0, y0_ = 0, x1_ = 0, y1_ = 0;
+    size_t                      capacity_   = 0;
+    uint64_t                    generation_ = 0;    // counts the calls to start()
+    mutable mutex               lock_;              // for adding to buffers_
+    vector<unique_ptr<Buffer>>  buffers_;
+};
+
+inline thread_local RayRecorder::ThreadState RayRecorder::current_;
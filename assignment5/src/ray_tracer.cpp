@@ -21,10 +21,21 @@ using namespace std;
 #include "material.h"
 #include "object.h"
 #include "ray.h"
+#include "ray_recorder.h"
+#include "scene_arena.h"
 #include "scene_parser.h"
+#include "trace_stats.h"
+
+#include <cstdint>
+#include <cstring>
 
 #define EPSILON 0.001f
 
+// Transparent shadow rays stop once less than this fraction of the light gets through.
+#define SHADOW_THROUGHPUT_CUTOFF 0.001f
+// ...or after passing this many surfaces.
+#define MAX_SHADOW_OCCLUDERS 16
+
 using namespace std;
 
 namespace {
@@ -57,17 +68,56 @@ bool transmittedDirection(const Vector3f& normal, const Vector3f& incoming,
 	return true;
 }
 
+// A secondary ray spawned where ray hit at t carries on from the width of its footprint there.
+// The curvature of the surface is ignored, so the spread stays as it was.
+void continueFootprint(Ray& secondary, const Ray& ray, float t) {
+	secondary.width = ray.footprint(t);
+	secondary.spread = ray.spread;
+}
+
+// Uniform number in [0,1) derived from the ray itself, so that Russian roulette needs no generator
+// state shared between threads and the same pixel always makes the same choices.
+float rouletteSample(const Ray& ray, int seed) {
+	uint32_t h = uint32_t(seed) * 0x9e3779b9u;
+	for (int i = 0; i < 3; ++i) {
+		uint32_t o, d;
+		memcpy(&o, &ray.origin(i), sizeof(o));
+		memcpy(&d, &ray.direction(i), sizeof(d));
+		h = (h ^ o) * 0x85ebca6bu;
+		h = (h ^ (h >> 13) ^ d) * 0xc2b2ae35u;
+		h ^= h >> 16;
+	}
+	return float(h >> 8) * (1.0f / 16777216.0f);
+}
+
 } // namespace
 
-Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index, Hit& hit, Vector3f debug_color) const
+bool RayTracer::intersect(const Ray& ray, float tmin, Hit& hit) const
 {
 	// initialize a hit to infinitely far away
 	hit = Hit(FLT_MAX);
-	
-	// Ask the root node (the single "Group" in the scene) for an intersection.
-	bool intersect = false;
-	if(scene_.getGroup() != nullptr)
-		intersect = scene_.getGroup()->intersect(ray, hit, tmin);
+	if (trace_stats_enabled)
+		++trace_stats.rays;
+
+	bool intersected = intersectScene(ray, hit, tmin);
+	if (RayRecorder::active())
+		RayRecorder::instance().record(RaySegment(ray.origin, ray.direction.normalized() * min(100.0f, hit.t), hit.normal, Vector3f::Ones()));
+	return intersected;
+}
+
+bool RayTracer::intersectScene(const Ray& ray, Hit& hit, float tmin) const
+{
+	// The frozen copy of the scene when there is one, otherwise the root node (the single "Group" in the scene).
+	if (const SceneArena* arena = scene_.getArena())
+		return arena->intersect(ray, hit, tmin);
+	if (scene_.getGroup() != nullptr)
+		return scene_.getGroup()->intersect(ray, hit, tmin);
+	return false;
+}
+
+Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index, Hit& hit, Vector3f debug_color, float weight) const
+{
+	bool intersect = this->intersect(ray, tmin, hit);
 
 	// Write out the ray segment if visualizing (for debugging purposes)
     if (debug_trace)
@@ -77,8 +127,71 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 	if (!intersect)
 		return scene_.getBackgroundColor();
 
+	return shade(ray, hit, bounces, refr_index, debug_color, weight);
+}
+
+// Decides whether a secondary ray whose color will count with the given weight is worth tracing.
+// Returns 0 to drop it, otherwise the factor to scale its color by. Below the Args::weight cutoff the
+// ray is dropped, or with Russian roulette kept with probability weight/cutoff and scaled up by the
+// inverse, which keeps the expected color the same; weight is then raised to the cutoff accordingly.
+float RayTracer::continuationScale(const Ray& ray, float& weight) const
+{
+	if (weight >= args_.weight)
+		return 1.0f;
+	if (!args_.russian_roulette || weight <= 0.0f)
+		return 0.0f;
+
+	float survival = weight / args_.weight;
+	if (rouletteSample(ray, args_.random_seed) >= survival)
+		return 0.0f;
+	weight = args_.weight;
+	return 1.0f / survival;
+}
+
+// Fraction of the light that reaches the origin of the shadow ray, which points towards the light.
+// Opaque occluders block it all. With args_.transparent_shadows, the ray walks through transparent ones
+// and is filtered by their transparent color at each surface it crosses, without refracting.
+Vector3f RayTracer::computeShadowColor(Ray& ray, float distanceToLight) const
+{
+	float eps = 0.0001f;
+	Vector3f throughput = Vector3f::Ones();
+	for (int i = 0; i < MAX_SHADOW_OCCLUDERS; ++i) {
+		Hit hit;
+		if (trace_stats_enabled)
+			++trace_stats.rays;
+		bool occluded = intersectScene(ray, hit, eps);
+		// Shadow rays show in yellow, up to the occluder or the light.
+		if (RayRecorder::active())
+			RayRecorder::instance().record(RaySegment(ray.origin, ray.direction.normalized() * min({ 100.0f, hit.t, distanceToLight }), hit.normal, Vector3f(1.0f, 1.0f, 0.0f)));
+		if (!occluded)
+			return throughput;
+
+		// A point light in front of the occluder; directional lights are infinitely far.
+		if (distanceToLight != FLT_MAX && hit.t >= distanceToLight - eps)
+			return throughput;
+
+		if (!args_.transparent_shadows || hit.material == nullptr)
+			return Vector3f::Zero();
+
+		Vector3f point = ray.pointAtParameter(hit.t);
+		throughput = throughput.cwiseProduct(hit.material->transparent_color(point));
+		if (throughput.maxCoeff() < SHADOW_THROUGHPUT_CUTOFF)
+			return Vector3f::Zero();
+
+		// Continue from the occluder towards the light.
+		ray = Ray(point, ray.direction);
+		if (distanceToLight != FLT_MAX)
+			distanceToLight -= hit.t;
+	}
+	return Vector3f::Zero();
+}
+
+Vector3f RayTracer::shade(Ray& ray, Hit& hit, int bounces, float refr_index, Vector3f debug_color, float weight) const
+{
+	if (hit.material == nullptr)
+		return scene_.getBackgroundColor();
+
 	const Material* m = hit.material.get();
-	assert(m != nullptr);
 
 	// get the intersection point and normal.
 	Vector3f normal = hit.normal;
@@ -90,9 +203,9 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 	
 	// kd * ka
 	Vector3f answer = Vector3f(
-		scene_.getAmbientLight().x() * m->diffuse_color(point).x(),
-		scene_.getAmbientLight().y() * m->diffuse_color(point).y(),
-		scene_.getAmbientLight().z() * m->diffuse_color(point).z())
+		scene_.getAmbientLight().x() * m->diffuse_color(point, hit).x(),
+		scene_.getAmbientLight().y() * m->diffuse_color(point, hit).y(),
+		scene_.getAmbientLight().z() * m->diffuse_color(point, hit).z())
 		;
 
 	// YOUR CODE HERE (R4 & R7)
@@ -116,23 +229,10 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 		
 		if (args_.shadows) {
 			Ray ray2(point + eps * hit.normal, dir);
-			Hit hit2;
-			bool intersect2 = scene_.getGroup()->intersect(ray2, hit2, eps);
-			bool addShade = true;
-			if (intersect2) {
-				// ray has hit something
-				if (dis == FLT_MAX) {
-					// directional light -> automatic shadow
-					addShade = false;
-				}
-				else if (hit2.t < dis - eps) {
-					// pointlight -> intersection before light source
-					addShade = false;
-				}
-			}
-			if (addShade) {
+			Vector3f shadow_color = computeShadowColor(ray2, dis);
+			if (shadow_color != Vector3f::Zero()) {
 				Vector3f d = m->shade(ray, hit, dir, intensity, false);
-				answer += d;
+				answer += shadow_color.cwiseProduct(d);
 			}
 		}
 		else {
@@ -143,6 +243,9 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 
 	// are there bounces left?
 	if (bounces >= 1) {
+		// The secondary rays get their own hit, so that one of them being cut off doesn't change what the others see.
+		Hit secondary_hit;
+
 		// reflection, but only if reflective coefficient > 0!
 		
 		if (m->reflective_color(point).norm() > 0.0f) {
@@ -154,7 +257,11 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 			Vector3f reflectiveColor = m->reflective_color(point);
 
 			Ray mirrorRay(point + eps * hit.normal, mirrorDirection(hit.normal, ray.direction));
-			answer += reflectiveColor.cwiseProduct(traceRay(mirrorRay, eps, bounces - 1, refr_index, hit, debug_color));
+			continueFootprint(mirrorRay, ray, hit.t);
+			float mirror_weight = weight * reflectiveColor.maxCoeff();
+			float scale = continuationScale(mirrorRay, mirror_weight);
+			if (scale > 0.0f)
+				answer += scale * reflectiveColor.cwiseProduct(traceRay(mirrorRay, eps, bounces - 1, refr_index, secondary_hit, debug_color, mirror_weight));
 			
 		}
 
@@ -191,16 +298,24 @@ Vector3f RayTracer::traceRay(Ray& ray, float tmin, int bounces, float refr_index
 			// does not have total intenal reflection
 			if (hasRefraction) {
 				Ray refractedRay(point + eps * dir_t, dir_t);
+				continueFootprint(refractedRay, ray, hit.t);
 				Vector3f transColor = m->transparent_color(point);
 
-				answer += transColor.cwiseProduct(traceRay(refractedRay, eps, bounces - 1, newIndex, hit, debug_color));
+				float refracted_weight = weight * transColor.maxCoeff();
+				float scale = continuationScale(refractedRay, refracted_weight);
+				if (scale > 0.0f)
+					answer += scale * transColor.cwiseProduct(traceRay(refractedRay, eps, bounces - 1, newIndex, secondary_hit, debug_color, refracted_weight));
 			}
 			else {
 				// has total internal reflection -> add the reflection
 				Vector3f reflectiveColor = m->reflective_color(point);
 
 				Ray mirrorRay(point + eps * hit.normal, mirrorDirection(hit.normal, ray.direction));
-				answer += reflectiveColor.cwiseProduct(traceRay(mirrorRay, eps, bounces - 1, refr_index, hit, debug_color));
+				continueFootprint(mirrorRay, ray, hit.t);
+				float mirror_weight = weight * reflectiveColor.maxCoeff();
+				float scale = continuationScale(mirrorRay, mirror_weight);
+				if (scale > 0.0f)
+					answer += scale * reflectiveColor.cwiseProduct(traceRay(mirrorRay, eps, bounces - 1, refr_index, secondary_hit, debug_color, mirror_weight));
 			}
 		}
 	}
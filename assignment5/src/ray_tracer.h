@@ -22,13 +22,22 @@ public:
 	{}
 
 	// You need to fill in the implementation for this function.
-    Vector3f traceRay(Ray& ray, float tmin, int bounces, float refr_index, Hit& hit, Vector3f debug_color) const;
+	// weight is how much the returned color counts towards the pixel, for cutting off paths that no longer matter (Args::weight).
+    Vector3f traceRay(Ray& ray, float tmin, int bounces, float refr_index, Hit& hit, Vector3f debug_color, float weight = 1.0f) const;
+
+	// The two halves of traceRay(), for when the primary hits are cached (see GBuffer).
+	// intersect() finds the closest hit along the ray; shade() computes the color from a hit found earlier.
+	// A hit without a material is a miss and shades to the background color.
+	bool intersect(const Ray& ray, float tmin, Hit& hit) const;
+	Vector3f shade(Ray& ray, Hit& hit, int bounces, float refr_index, Vector3f debug_color, float weight = 1.0f) const;
 	
 	// For the debug visualisation: mutable means that we can modify it inside the traceRay method even though it is const.
 	mutable std::vector < RaySegment > debug_rays;
 private:
 	RayTracer& operator=(const RayTracer&); // squelch compiler warning
+	bool intersectScene(const Ray& ray, Hit& hit, float tmin) const;
 	Vector3f computeShadowColor(Ray& ray, float distanceToLight) const;
+	float continuationScale(const Ray& ray, float& weight) const;
 
 	bool debug_trace;
 
@@ -4,10 +4,59 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <random>
 
 // for supersampling antialiasing
 
+// The random numbers of a sampler. Normally these are the next numbers of a Mersenne twister, so they
+// depend on how many numbers were drawn before. Keyed to a sample (Args::deterministic), they are instead
+// hashes of the seed, the pixel, the sample and the dimension, i.e., the count of numbers drawn for the
+// sample so far, so that every sample gets the same numbers in whatever order the samples are taken.
+class SampleGenerator
+{
+public:
+    typedef uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    void seed(result_type s)
+    {
+        twister_.seed(s);
+        seed_ = s;
+        keyed_ = false;
+    }
+
+    void key(int x, int y, int n)
+    {
+        key_ = mix(seed_ ^ mix((uint64_t(uint32_t(y)) << 32 | uint32_t(x)) ^ mix(uint64_t(uint32_t(n)))));
+        dimension_ = 0;
+        keyed_ = true;
+    }
+
+    result_type operator()()
+    {
+        if (!keyed_)
+            return twister_();
+        return mix(key_ + ++dimension_ * 0x9e3779b97f4a7c15ull);
+    }
+
+private:
+    // The finalizer of SplitMix64.
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    mt19937_64  twister_;
+    uint64_t    seed_       = 0;
+    uint64_t    key_        = 0;
+    uint64_t    dimension_  = 0;
+    bool        keyed_      = false;
+};
+
 // Base class for sampler. Only supports one sample through the center of the pixel.
 class Sampler
 {
@@ -16,6 +65,9 @@ public:
 	virtual ~Sampler() {};
     virtual Vector2f getSamplePosition(int n) = 0;
 
+    // From now on, draws the random numbers of sample n of pixel (x,y) instead of the next ones (see SampleGenerator).
+    void keyTo(int x, int y, int n) { generator_.key(x, y, n); }
+
     inline Vector2f random_Vector2f()
     {
         float x = distribution_(generator_);
@@ -28,7 +80,7 @@ public:
 
 protected:
     // Random generator not used by deterministic samplers
-    mt19937_64                          generator_;     // See https://en.cppreference.com/w/cpp/numeric/random
+    SampleGenerator                     generator_;     // See https://en.cppreference.com/w/cpp/numeric/random
     uniform_real_distribution<float>    distribution_;
     // num_samples_ can be set to -1 for random samplers that can
     // take an arbitrary number of samples in a pixel
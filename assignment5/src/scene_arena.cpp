@@ -0,0 +1,408 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "scene_arena.h"
+#include "object.h"
+#include "trace_stats.h"
+
+namespace {
+
+// Puts v in the given order: order[i] is the index in the old v of the new v[i].
+template<typename T>
+void permute(vector<T>& v, const vector<int>& order)
+{
+    vector<T> permuted;
+    permuted.reserve(order.size());
+    for (int i : order)
+        permuted.push_back(v[i]);
+    v.swap(permuted);
+}
+
+template<typename T>
+size_t bytes(const vector<T>& v)
+{
+    return v.size() * sizeof(T);
+}
+
+} // namespace
+
+void SceneArena::build(const ObjectBase& root, Args::BVHType type)
+{
+    *this = SceneArena();
+    addList();
+    root.arena_collect(*this, 0);
+
+    // The lists inside transforms come after the lists they are in, so building the hierarchies from
+    // the last list to the first gives every instance the box of its list before it is needed.
+    lists_.resize(list_refs_.size());
+    vector<AABB> list_bounds(lists_.size());
+    for (int l = int(lists_.size()) - 1; l >= 0; --l)
+    {
+        const vector<uint32_t>& refs = list_refs_[l];
+        List& list = lists_[l];
+        list.first = int(refs_.size());
+        list.count = int(refs.size());
+
+        vector<AABB> prim_bounds;
+        vector<uint32_t> unbounded;
+        for (uint32_t ref : refs)
+        {
+            AABB box = primitiveBounds(ref, list_bounds);
+            list_bounds[l].grow(box);
+            // Without a hierarchy, the primitives are intersected in the order they were added.
+            if (type != Args::BVH_None && box.isBounded())
+            {
+                refs_.push_back(ref);
+                prim_bounds.push_back(box);
+            }
+            else
+                unbounded.push_back(ref);
+        }
+        refs_.insert(refs_.end(), unbounded.begin(), unbounded.end());
+
+        list.bvh_count = int(prim_bounds.size());
+        if (list.bvh_count > 0)
+        {
+            list.binary = make_unique<BVH>();
+            list.binary->build(prim_bounds, type);
+            list.bvh.build(*list.binary);
+        }
+    }
+    sortPrimitives();
+
+    vector<vector<uint32_t>>().swap(list_refs_);
+    material_indices_.clear();
+}
+
+void SceneArena::refit(const ObjectBase& root)
+{
+    // The objects add their primitives in the same order as when building, so the add functions
+    // can find each one's place in the tables from table_index_ and overwrite its geometry.
+    refitting_ = true;
+    fill(refit_count_, refit_count_ + Kind_Count, 0);
+    refit_lists_ = 1;
+    root.arena_collect(*this, 0);
+    refitting_ = false;
+    assert(refit_lists_ == int(lists_.size()));
+
+    // As in build(), the lists inside transforms are refitted before the instances of them.
+    vector<AABB> list_bounds(lists_.size());
+    for (int l = int(lists_.size()) - 1; l >= 0; --l)
+    {
+        List& list = lists_[l];
+        vector<AABB> prim_bounds(list.count);
+#ifdef CS_C3100_USE_OPENMP
+        #pragma omp parallel for
+#endif
+        for (int i = 0; i < list.count; ++i)
+            prim_bounds[i] = primitiveBounds(refs_[list.first + i], list_bounds);
+        for (const AABB& box : prim_bounds)
+            list_bounds[l].grow(box);
+
+        if (list.bvh_count > 0)
+        {
+            prim_bounds.resize(list.bvh_count);
+            list.binary->refit(prim_bounds);
+            list.bvh.refit(*list.binary);
+        }
+    }
+}
+
+void SceneArena::sortPrimitives()
+{
+    // The order in which the lists and the leaves of their hierarchies reach the primitives of each kind.
+    vector<int> order[Kind_Count];
+    for (const List& list : lists_)
+    {
+        auto visit = [&](uint32_t ref) { order[ref >> KindShift].push_back(int(ref & IndexMask)); };
+        if (list.bvh_count > 0)
+            for (int i : list.bvh.indices())
+                visit(refs_[list.first + i]);
+        for (int i = list.bvh_count; i < list.count; ++i)
+            visit(refs_[list.first + i]);
+    }
+
+    vector<int> new_index[Kind_Count];
+    for (int k = 0; k < Kind_Count; ++k)
+    {
+        new_index[k].resize(order[k].size());
+        for (int i = 0; i < int(order[k].size()); ++i)
+            new_index[k][order[k][i]] = i;
+    }
+    for (uint32_t& ref : refs_)
+        ref = makeRef(Kind(ref >> KindShift), new_index[ref >> KindShift][ref & IndexMask]);
+    // The table indices were given in the order that the primitives were added.
+    for (int k = 0; k < Kind_Count; ++k)
+        table_index_[k].swap(new_index[k]);
+
+    permute(spheres_.geometry, order[Kind_Sphere]);
+    permute(spheres_.material, order[Kind_Sphere]);
+    permute(planes_.geometry, order[Kind_Plane]);
+    permute(planes_.material, order[Kind_Plane]);
+    permute(boxes_.geometry, order[Kind_Box]);
+    permute(boxes_.material, order[Kind_Box]);
+    permute(triangles_.geometry, order[Kind_Triangle]);
+    permute(triangles_.material, order[Kind_Triangle]);
+    permute(triangles_.texcoords, order[Kind_Triangle]);
+    permute(triangles_.uv_scale, order[Kind_Triangle]);
+    permute(instances_, order[Kind_Instance]);
+    permute(instance_matrices_, order[Kind_Instance]);
+}
+
+bool SceneArena::intersect(const Ray& r, Hit& h, float tmin) const
+{
+    if (lists_.empty())
+        return false;
+
+    // Only the closest hit takes a reference to its material.
+    int material = -1;
+    bool intersected = trace_stats_enabled ? intersectList<true>(0, r, h, tmin, material) : intersectList<false>(0, r, h, tmin, material);
+    if (!intersected)
+        return false;
+    h.material = materials_[material];
+    return true;
+}
+
+template<bool CountTests>
+bool SceneArena::intersectList(int list_index, const Ray& r, Hit& h, float tmin, int& material) const
+{
+    const List& list = lists_[list_index];
+    const uint32_t* refs = refs_.data() + list.first;
+
+    bool intersected = false;
+    if (list.bvh_count > 0)
+        intersected = list.bvh.intersect(r, h, tmin, [&](int i) { return intersectPrimitive<CountTests>(refs[i], r, h, tmin, material); });
+    for (int i = list.bvh_count; i < list.count; ++i)
+        if (intersectPrimitive<CountTests>(refs[i], r, h, tmin, material))
+            intersected = true;
+    return intersected;
+}
+
+template<bool CountTests>
+bool SceneArena::intersectPrimitive(uint32_t ref, const Ray& r, Hit& h, float tmin, int& material) const
+{
+    int i = int(ref & IndexMask);
+    // An instance is not a test of its own; the primitives inside it count.
+    if constexpr (CountTests)
+        if ((ref >> KindShift) != Kind_Instance)
+            ++trace_stats.primitive_tests;
+    switch (ref >> KindShift)
+    {
+    case Kind_Sphere:
+    {
+        const Sphere& sphere = spheres_.geometry[i];
+        if (!SphereObject::intersectGeometry(sphere.center, sphere.radius, r, h, tmin))
+            return false;
+        material = spheres_.material[i];
+        return true;
+    }
+    case Kind_Plane:
+    {
+        const Plane& plane = planes_.geometry[i];
+        if (!PlaneObject::intersectGeometry(plane.normal, plane.offset, r, h, tmin))
+            return false;
+        material = planes_.material[i];
+        return true;
+    }
+    case Kind_Box:
+    {
+        const Box& box = boxes_.geometry[i];
+        if (!BoxObject::intersectGeometry(box.min, box.max, r, h, tmin))
+            return false;
+        material = boxes_.material[i];
+        return true;
+    }
+    case Kind_Triangle:
+        // The texture coordinates are only read for a hit.
+        if (!TriangleObject::intersectGeometry(triangles_.geometry[i].v, triangles_.texcoords[i].t, triangles_.uv_scale[i], r, h, tmin))
+            return false;
+        material = triangles_.material[i];
+        return true;
+
+    case Kind_Instance:
+    {
+        const Instance& instance = instances_[i];
+        if (!intersectList<CountTests>(instance.list, TransformObject::objectRay(instance.inverse, r), h, tmin, material))
+            return false;
+        h.normal = TransformObject::worldNormal(instance.inverse_transpose, h.normal);
+        return true;
+    }
+    }
+    return false;
+}
+
+AABB SceneArena::primitiveBounds(uint32_t ref, const vector<AABB>& list_bounds) const
+{
+    int i = int(ref & IndexMask);
+    switch (ref >> KindShift)
+    {
+    case Kind_Sphere:
+    {
+        const Sphere& sphere = spheres_.geometry[i];
+        return AABB(sphere.center - Vector3f::Constant(sphere.radius), sphere.center + Vector3f::Constant(sphere.radius));
+    }
+    case Kind_Plane:
+        return AABB::infinite();
+    case Kind_Box:
+        return AABB(boxes_.geometry[i].min, boxes_.geometry[i].max);
+    case Kind_Triangle:
+    {
+        AABB box;
+        for (const Vector3f& v : triangles_.geometry[i].v)
+            box.grow(v);
+        return box;
+    }
+    case Kind_Instance:
+        return list_bounds[instances_[i].list].transformed(instance_matrices_[i]);
+    }
+    return AABB();
+}
+
+int SceneArena::numPrimitives() const
+{
+    return int(spheres_.geometry.size() + planes_.geometry.size() + boxes_.geometry.size() + triangles_.geometry.size() + instances_.size());
+}
+
+size_t SceneArena::memoryUsage() const
+{
+    size_t total = bytes(materials_) + bytes(instances_) + bytes(lists_) + bytes(refs_);
+    total += bytes(spheres_.geometry) + bytes(spheres_.material);
+    total += bytes(planes_.geometry) + bytes(planes_.material);
+    total += bytes(boxes_.geometry) + bytes(boxes_.material);
+    total += bytes(triangles_.geometry) + bytes(triangles_.material) + bytes(triangles_.texcoords) + bytes(triangles_.uv_scale);
+    for (const List& list : lists_)
+    {
+        total += bytes(list.bvh.nodes()) + bytes(list.bvh.indices());
+        if (list.binary)
+            total += bytes(list.binary->nodes()) + bytes(list.binary->indices());
+    }
+    return total;
+}
+
+int SceneArena::addList()
+{
+    if (refitting_)
+        return refit_lists_++;
+    list_refs_.emplace_back();
+    return int(list_refs_.size()) - 1;
+}
+
+int SceneArena::materialIndex(const shared_ptr<Material>& m)
+{
+    auto it = material_indices_.find(m.get());
+    if (it != material_indices_.end())
+        return it->second;
+    materials_.push_back(m);
+    material_indices_[m.get()] = int(materials_.size()) - 1;
+    return int(materials_.size()) - 1;
+}
+
+void SceneArena::addSphere(int list, const Vector3f& center, float radius, const shared_ptr<Material>& m)
+{
+    if (refitting_)
+    {
+        spheres_.geometry[refitIndex(Kind_Sphere)] = Sphere{ center, radius };
+        return;
+    }
+    list_refs_[list].push_back(makeRef(Kind_Sphere, int(spheres_.geometry.size())));
+    spheres_.geometry.push_back(Sphere{ center, radius });
+    spheres_.material.push_back(materialIndex(m));
+}
+
+void SceneArena::addPlane(int list, const Vector3f& normal, float offset, const shared_ptr<Material>& m)
+{
+    if (refitting_)
+    {
+        planes_.geometry[refitIndex(Kind_Plane)] = Plane{ normal, offset };
+        return;
+    }
+    list_refs_[list].push_back(makeRef(Kind_Plane, int(planes_.geometry.size())));
+    planes_.geometry.push_back(Plane{ normal, offset });
+    planes_.material.push_back(materialIndex(m));
+}
+
+void SceneArena::addBox(int list, const Vector3f& min, const Vector3f& max, const shared_ptr<Material>& m)
+{
+    if (refitting_)
+    {
+        boxes_.geometry[refitIndex(Kind_Box)] = Box{ min, max };
+        return;
+    }
+    list_refs_[list].push_back(makeRef(Kind_Box, int(boxes_.geometry.size())));
+    boxes_.geometry.push_back(Box{ min, max });
+    boxes_.material.push_back(materialIndex(m));
+}
+
+void SceneArena::addTriangle(int list, const Vector3f* vertices, const Vector2f* texcoords, float uv_scale, const shared_ptr<Material>& m)
+{
+    if (refitting_)
+    {
+        int i = refitIndex(Kind_Triangle);
+        triangles_.geometry[i] = TriangleVertices{ { vertices[0], vertices[1], vertices[2] } };
+        triangles_.uv_scale[i] = uv_scale;
+        return;
+    }
+    list_refs_[list].push_back(makeRef(Kind_Triangle, int(triangles_.geometry.size())));
+    triangles_.geometry.push_back(TriangleVertices{ { vertices[0], vertices[1], vertices[2] } });
+    triangles_.texcoords.push_back(TriangleTexcoords{ { texcoords[0], texcoords[1], texcoords[2] } });
+    triangles_.uv_scale.push_back(uv_scale);
+    triangles_.material.push_back(materialIndex(m));
+}
+
+void SceneArena::addInstance(int list, const Matrix4f& matrix, const Matrix4f& inverse, const Matrix4f& inverse_transpose, int instanced_list)
+{
+    if (refitting_)
+    {
+        int i = refitIndex(Kind_Instance);
+        instances_[i] = Instance{ inverse, inverse_transpose, instanced_list };
+        instance_matrices_[i] = matrix;
+        return;
+    }
+    list_refs_[list].push_back(makeRef(Kind_Instance, int(instances_.size())));
+    instances_.push_back(Instance{ inverse, inverse_transpose, instanced_list });
+    instance_matrices_.push_back(matrix);
+}
+
+void GroupObject::arena_collect(SceneArena& arena, int list) const
+{
+    for (auto& o : objects_)
+        o->arena_collect(arena, list);
+}
+
+void TransformObject::arena_collect(SceneArena& arena, int list) const
+{
+    int instanced_list = arena.addList();
+    object_->arena_collect(arena, instanced_list);
+    arena.addInstance(list, matrix_, inverse_, inverse_transpose_, instanced_list);
+}
+
+void PlaneObject::arena_collect(SceneArena& arena, int list) const
+{
+    arena.addPlane(list, normal_, offset_, material_);
+}
+
+void SphereObject::arena_collect(SceneArena& arena, int list) const
+{
+    arena.addSphere(list, center_, radius_, material_);
+}
+
+void BoxObject::arena_collect(SceneArena& arena, int list) const
+{
+    arena.addBox(list, min_, max_, material_);
+}
+
+void TriangleObject::arena_collect(SceneArena& arena, int list) const
+{
+    arena.addTriangle(list, vertices_, texcoords_, uv_scale_, material_);
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "args.h"
+#include "bvh.h"
+#include "hit.h"
+#include "ray.h"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Material;
+class ObjectBase;
+
+// Immutable copy of the scene that the ray tracer traverses, frozen from the tree of objects once it is
+// parsed (SceneParser::buildArena()). The object tree stays as it is for the preview and the GUI.
+//
+// The primitives are grouped by kind into tables, and refer to their materials by index into one table,
+// so that there are no per-object heap blocks, virtual calls or reference counts during traversal. Each
+// table keeps what the intersection test reads in one array and what is only needed for a hit (texture
+// coordinates, material) in others, so that the tests don't pull the latter into the cache. Groups are flattened: every transform gets a list of the primitives inside it with
+// its own hierarchy, and everything else goes into the list of the root, whose hierarchy is built over
+// all its primitives at once. After the hierarchies are built, the tables are put in the order in which
+// the leaves reference them, so that the primitives of a leaf sit next to each other in memory.
+//
+// The materials stay shared with the object tree: the table of materials holds references to them.
+class SceneArena
+{
+public:
+    // Freezes the objects under root and builds a hierarchy of the given type over every list.
+    void            build(const ObjectBase& root, Args::BVHType type);
+
+    // Reads the geometry again from the objects under root after they have moved (e.g., through
+    // TriangleObject::set_vertex()), and refits the boxes of the hierarchies in parallel, keeping their
+    // structure. The objects must be the same as in build(); materials are not updated. Not to be called
+    // while rendering.
+    void            refit(const ObjectBase& root);
+
+    // Like ObjectBase::intersect().
+    bool            intersect(const Ray& r, Hit& h, float tmin) const;
+
+    int             numPrimitives() const;
+    size_t          memoryUsage() const;    // in bytes, hierarchies included
+
+    // Called by ObjectBase::arena_collect() while building or refitting. addList() starts a new list of
+    // primitives for the inside of a transform; its index goes to addInstance() after it has been filled in.
+    int             addList();
+    void            addSphere(int list, const Vector3f& center, float radius, const shared_ptr<Material>& m);
+    void            addPlane(int list, const Vector3f& normal, float offset, const shared_ptr<Material>& m);
+    void            addBox(int list, const Vector3f& min, const Vector3f& max, const shared_ptr<Material>& m);
+    void            addTriangle(int list, const Vector3f* vertices, const Vector2f* texcoords, float uv_scale, const shared_ptr<Material>& m);
+    void            addInstance(int list, const Matrix4f& matrix, const Matrix4f& inverse, const Matrix4f& inverse_transpose, int instanced_list);
+
+private:
+    // A reference to a primitive: its kind in the top bits, the index in the table of the kind below.
+    enum Kind
+    {
+        Kind_Sphere,
+        Kind_Plane,
+        Kind_Box,
+        Kind_Triangle,
+        Kind_Instance,
+        Kind_Count
+    };
+    static const int        KindShift = 29;
+    static const uint32_t   IndexMask = (1u << KindShift) - 1;
+    static uint32_t         makeRef(Kind kind, int index)   { return (uint32_t(kind) << KindShift) | uint32_t(index); }
+
+    struct Sphere
+    {
+        Vector3f            center;
+        float               radius;
+    };
+    struct Plane
+    {
+        Vector3f            normal;
+        float               offset;
+    };
+    struct Box
+    {
+        Vector3f            min;
+        Vector3f            max;
+    };
+    struct TriangleVertices
+    {
+        Vector3f            v[3];
+    };
+    struct TriangleTexcoords
+    {
+        Vector2f            t[3];
+    };
+
+    template<typename Geometry>
+    struct Table
+    {
+        vector<Geometry>    geometry;
+        vector<int>         material;
+    };
+    struct Triangles : Table<TriangleVertices>
+    {
+        vector<TriangleTexcoords>   texcoords;
+        vector<float>               uv_scale;
+    };
+    struct Instance
+    {
+        Matrix4f            inverse;
+        Matrix4f            inverse_transpose;
+        int                 list;
+    };
+
+    // The primitives of a list are refs_[first, first + count). With a hierarchy, the first bvh_count
+    // of them are its primitives in the order it numbers them, and the rest are unbounded (planes).
+    struct List
+    {
+        int                 first       = 0;
+        int                 count       = 0;
+        int                 bvh_count   = 0;
+        WideBVH             bvh;
+        unique_ptr<BVH>     binary;             // the hierarchy bvh was collapsed from, for refitting
+    };
+
+    // With CountTests, every primitive test adds to trace_stats; the other instantiation has no trace of it.
+    template<bool CountTests>
+    bool            intersectList(int list, const Ray& r, Hit& h, float tmin, int& material) const;
+    template<bool CountTests>
+    bool            intersectPrimitive(uint32_t ref, const Ray& r, Hit& h, float tmin, int& material) const;
+    AABB            primitiveBounds(uint32_t ref, const vector<AABB>& list_bounds) const;
+    int             materialIndex(const shared_ptr<Material>& m);
+    void            sortPrimitives();
+    int             refitIndex(Kind kind)   { return table_index_[kind][refit_count_[kind]++]; }
+
+    vector<shared_ptr<Material>>        materials_;
+    Table<Sphere>                       spheres_;
+    Table<Plane>                        planes_;
+    Table<Box>                          boxes_;
+    Triangles                           triangles_;
+    vector<Instance>                    instances_;
+    vector<Matrix4f>                    instance_matrices_; // only needed for their boxes while building and refitting
+    vector<List>                        lists_;             // the root is list 0
+    vector<uint32_t>                    refs_;
+
+    // While building: the primitives added to each list, and the materials seen so far.
+    vector<vector<uint32_t>>            list_refs_;
+    unordered_map<const Material*, int> material_indices_;
+
+    // For refitting: the index in its table of the k'th primitive of each kind that arena_collect() adds,
+    // and while refitting, the number of primitives of each kind and of lists added so far.
+    vector<int>                         table_index_[Kind_Count];
+    bool                                refitting_          = false;
+    int                                 refit_count_[Kind_Count] = {};
+    int                                 refit_lists_        = 0;
+};
@@ -19,6 +19,7 @@ using namespace std;
 #include "light.h"
 #include "material.h"
 #include "object.h"
+#include "scene_arena.h"
 
 #include <cstdio>
 #include <cstring>
@@ -83,6 +84,23 @@ SceneParser::~SceneParser()
 {
 }
 
+void SceneParser::buildArena(Args::BVHType type)
+{
+	if (!group)
+		return;
+	arena = make_shared<SceneArena>();
+	arena->build(*group, type);
+	++geometry_generation;
+}
+
+void SceneParser::refitArena()
+{
+	if (!group || !arena)
+		return;
+	arena->refit(*group);
+	++geometry_generation;
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -126,8 +144,15 @@ void SceneParser::parseOrthographicCamera()
 	Vector3f up = readVector3f();
 	getToken( token ); assert (!strcmp(token, "size"));
 	float size = readFloat();
-	getToken( token ); assert (!strcmp(token, "}"));
+	Vector3f motion = Vector3f::Zero();
+	getToken( token );
+	if (!strcmp(token, "motion")) {
+		motion = readVector3f();
+		getToken( token );
+	}
+	assert (!strcmp(token, "}"));
 	camera = make_shared<OrthographicCamera>(center,direction,up,size);
+	camera->setMotion(motion);
 }
 
 
@@ -144,8 +169,28 @@ void SceneParser::parsePerspectiveCamera() {
 	getToken( token ); assert (!strcmp(token, "angle"));
 	float angle_degrees = readFloat();
     float angle_radians = angle_degrees * EIGEN_PI / 180.0f;
-	getToken( token ); assert (!strcmp(token, "}"));
-	camera = make_shared<PerspectiveCamera>(center,direction,up,angle_radians);
+	// optional depth of field and motion blur parameters
+	float lens_radius = 0.0f;
+	float focal_distance = 1.0f;
+	Vector3f motion = Vector3f::Zero();
+	while (1) {
+		getToken( token );
+		if (!strcmp(token, "lensRadius")) {
+			lens_radius = readFloat();
+		} else if (!strcmp(token, "focalDistance")) {
+			focal_distance = readFloat();
+		} else if (!strcmp(token, "motion")) {
+			motion = readVector3f();
+		} else {
+			assert (!strcmp(token, "}"));
+			break;
+		}
+	}
+	if (lens_radius > 0.0f)
+		camera = make_shared<ThinLensCamera>(center,direction,up,angle_radians,lens_radius,focal_distance);
+	else
+		camera = make_shared<PerspectiveCamera>(center,direction,up,angle_radians);
+	camera->setMotion(motion);
 }
 
 void SceneParser::parseBackground() {
@@ -319,6 +364,7 @@ shared_ptr<Material> SceneParser::parsePhongMaterial()
     shared_ptr<Material> answer = make_shared<PhongMaterial>(
         diffuseColor, specularColor, exponent,
         reflectiveColor, transparentColor, indexOfRefraction, texture);
+	answer->set_texture_filtering(mipmap != 0, linearInterp != 0);
 
 	return answer;
 }
@@ -477,9 +523,36 @@ shared_ptr<TriangleObject> SceneParser::parseTriangle()
 	Vector3f v2 = readVector3f();
 	getToken(token); assert(!strcmp(token, "}"));
 	assert (current_material != nullptr);
-    return make_shared<TriangleObject>(v0, v1, v2, current_material);
+    return make_shared<TriangleObject>(v0, v1, v2, t0, t1, t2, current_material);
 }
 
+namespace {
+
+// Reads one corner of an OBJ face: v, v/vt, v//vn or v/vt/vn. The indices start from 1, and negative
+// ones count back from the latest vertex. vt is -1 when the corner has no texture coordinates.
+bool readObjCorner(const char*& p, int num_vertices, int num_texcoords, int& v, int& vt)
+{
+	int n = 0;
+	if (sscanf(p, " %d%n", &v, &n) != 1)
+		return false;
+	p += n;
+	v = v < 0 ? num_vertices + v : v - 1;
+	vt = -1;
+	if (*p == '/') {
+		++p;
+		if (*p != '/' && sscanf(p, "%d%n", &vt, &n) == 1) {
+			p += n;
+			vt = vt < 0 ? num_texcoords + vt : vt - 1;
+		}
+		int vn;
+		if (*p == '/' && sscanf(++p, "%d%n", &vn, &n) == 1)
+			p += n;
+	}
+	return true;
+}
+
+} // namespace
+
 shared_ptr<GroupObject> SceneParser::parseTriangleMesh()
 {
 	char token[MAX_PARSER_TOKEN_LENGTH];
@@ -491,32 +564,42 @@ shared_ptr<GroupObject> SceneParser::parseTriangleMesh()
 	getToken( token ); assert (!strcmp(token, "}"));
 	const char *ext = &filename[strlen(filename)-4];
 	assert(!strcmp(ext,".obj"));
-	// read it once, get counts
 	FILE *mesh_file = fopen(filename,"r");
 	assert (mesh_file != nullptr);
-	int fcount = 0;
     vector<Vector3f> vertices;
+    vector<Vector2f> texcoords;
     vector<Vector3i> faces;
-	while (1) {
-		int c = fgetc(mesh_file);
-		if (c == EOF)
+    vector<Vector3i> face_texcoords;	// -1 where a corner has no texture coordinates
+	char line[1024];
+	while (fgets(line, sizeof(line), mesh_file)) {
+        if (line[0] == 'v' && line[1] == ' ')
         {
-            break;
-		}
-        else if (c == 'v' && fgetc(mesh_file)!='n')
-        {
-			assert(fcount == 0);
             float v0,v1,v2;
-            fscanf(mesh_file, "%f %f %f", &v0, &v1, &v2);
+            sscanf(line + 2, "%f %f %f", &v0, &v1, &v2);
             vertices.push_back(Vector3f(v0, v1, v2));
 		}
-        else if (c == 'f')
+        else if (line[0] == 'v' && line[1] == 't')
+        {
+            float u = 0, v = 0;
+            sscanf(line + 2, "%f %f", &u, &v);
+            texcoords.push_back(Vector2f(u, v));
+        }
+        else if (line[0] == 'f' && line[1] == ' ')
         {
-			int f0, f1, f2, t1, t2, t3;
-            fscanf(mesh_file, "%d//%d %d//%d %d//%d", &f0, &t1, &f1, &t2, &f2, &t3);
-            faces.push_back(Vector3i(f0-1, f1-1, f2-1));
-			fcount++; 
-		} // otherwise, must be whitespace
+            // Polygons with more than three corners are split into a fan of triangles.
+            const char* p = line + 1;
+            int v[3], vt[3], corners = 0;
+            while (readObjCorner(p, int(vertices.size()), int(texcoords.size()), v[min(corners, 2)], vt[min(corners, 2)]))
+            {
+                if (++corners >= 3)
+                {
+                    faces.push_back(Vector3i(v[0], v[1], v[2]));
+                    face_texcoords.push_back(Vector3i(vt[0], vt[1], vt[2]));
+                    v[1] = v[2];
+                    vt[1] = vt[2];
+                }
+            }
+		} // otherwise, normals, comments or whitespace
 	}
 	fclose(mesh_file);
 
@@ -528,7 +611,11 @@ shared_ptr<GroupObject> SceneParser::parseTriangleMesh()
         const Vector3f& v0 = vertices[faces[i][0]];
         const Vector3f& v1 = vertices[faces[i][1]];
         const Vector3f& v2 = vertices[faces[i][2]];
-        trimesh->insert(make_shared<TriangleObject>(v0, v1, v2, current_material));
+        const Vector3i& t = face_texcoords[i];
+        if (t.minCoeff() >= 0)
+            trimesh->insert(make_shared<TriangleObject>(v0, v1, v2, texcoords[t[0]], texcoords[t[1]], texcoords[t[2]], current_material));
+        else
+            trimesh->insert(make_shared<TriangleObject>(v0, v1, v2, current_material));
     }
 
     return trimesh;
@@ -2,6 +2,8 @@
 
 //#include "base/Math.h"
 
+#include "args.h"
+
 #include <cassert>
 #include <cstdio>
 #include <string>
@@ -15,6 +17,7 @@ class SphereObject;
 class PlaneObject;
 class TriangleObject;
 class TransformObject;
+class SceneArena;
 
 #define MAX_PARSER_TOKEN_LENGTH 100
 
@@ -47,6 +50,14 @@ public:
     Vector3f getAmbientLight() const {
         return ambient_light;
     }
+
+    void setBackgroundColor(const Vector3f& color) {
+        background_color = color;
+    }
+
+    void setAmbientLight(const Vector3f& color) {
+        ambient_light = color;
+    }
     
     int getNumLights() const {
         return num_lights;
@@ -71,6 +82,22 @@ public:
         return group;
     }
 
+    // Freezes the objects into the arena that the ray tracer traverses, with hierarchies of the given type.
+    // Call again after changing the objects; the lights and materials can change without it.
+    void buildArena(Args::BVHType type);
+
+    // Updates the arena after objects have only moved, without building it again (SceneArena::refit()).
+    void refitArena();
+
+    const SceneArena* getArena() const {
+        return arena.get();
+    }
+
+    // Changes whenever the arena is built or refitted, i.e. whenever the primary hits may have moved.
+    unsigned getGeometryGeneration() const {
+        return geometry_generation;
+    }
+
 private:
     void parseFile();
     void parseOrthographicCamera();
@@ -110,4 +137,6 @@ private:
     vector<shared_ptr<Material>> materials;
     shared_ptr<Material> current_material;
     shared_ptr<GroupObject> group;
+    shared_ptr<SceneArena> arena;
+    unsigned geometry_generation = 0;
 };
\ No newline at end of file
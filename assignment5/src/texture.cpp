@@ -0,0 +1,326 @@
+// Include libraries
+#include "glad/gl_core_33.h"                // OpenGL
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>             // Window manager
+#include <imgui.h>                  // GUI Library
+#include <imgui_impl_glfw.h>
+#include "imgui_impl_opengl3.h"
+
+#include <Eigen/Dense>              // Linear algebra
+#include <Eigen/Geometry>
+
+using namespace Eigen;
+using namespace std;
+
+#include "texture.h"
+
+#include "lodepng.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+const size_t TileTexels = Texture::TileSize * Texture::TileSize;
+
+int fseek64(FILE* f, int64_t offset)
+{
+#ifdef _MSC_VER
+    return _fseeki64(f, offset, SEEK_SET);
+#else
+    return fseeko(f, off_t(offset), SEEK_SET);
+#endif
+}
+
+// Uncompressed (type 2) and run-length encoded (type 10) true-color TGA files with 24 or 32 bits per pixel.
+bool loadTGA(const string& filename, vector<uint8_t>& rgba, int& width, int& height)
+{
+    ifstream file(filename, ios::binary);
+    uint8_t header[18];
+    if (!file.read((char*)header, sizeof(header)))
+        return false;
+    int type = header[2];
+    int bytes = header[16] / 8;
+    width = header[12] | (header[13] << 8);
+    height = header[14] | (header[15] << 8);
+    if ((type != 2 && type != 10) || (bytes != 3 && bytes != 4) || width == 0 || height == 0)
+        return false;
+    file.ignore(header[0]);     // image ID
+
+    rgba.assign(size_t(width) * height * 4, 255);
+    size_t n = size_t(width) * height;
+    uint8_t bgra[4] = { 0, 0, 0, 255 };
+    for (size_t i = 0; i < n; )
+    {
+        int run = 1;
+        bool repeat = false;
+        if (type == 10)
+        {
+            int packet = file.get();
+            run = (packet & 0x7f) + 1;
+            repeat = (packet & 0x80) != 0;
+        }
+        for (int k = 0; k < run && i < n; ++k, ++i)
+        {
+            if (!repeat || k == 0)
+                file.read((char*)bgra, bytes);
+            uint8_t* p = &rgba[i * 4];
+            p[0] = bgra[2]; p[1] = bgra[1]; p[2] = bgra[0]; p[3] = bgra[3];
+        }
+    }
+    if (!file)
+        return false;
+
+    // Rows go bottom to top unless bit 5 of the descriptor says otherwise.
+    if (!(header[17] & 0x20))
+        for (int y = 0; y < height / 2; ++y)
+            swap_ranges(&rgba[size_t(y) * width * 4], &rgba[size_t(y + 1) * width * 4], &rgba[size_t(height - 1 - y) * width * 4]);
+    return true;
+}
+
+// The tile looked up last by this thread. Neighboring texels and the texels of nearby rays are
+// mostly on the same tile, and finding them here doesn't need to lock the shared cache.
+struct LastTile
+{
+    uint64_t                                key = ~uint64_t(0);
+    shared_ptr<const TextureCache::Tile>    tile;
+};
+thread_local LastTile last_tile;
+
+uint64_t tileKey(uint32_t texture, int level, int tile_x, int tile_y)
+{
+    return (uint64_t(texture) << 40) ^ (uint64_t(level) << 34) ^ (uint64_t(tile_y) << 17) ^ uint64_t(tile_x);
+}
+
+} // namespace
+
+shared_ptr<Texture> Texture::load(const string& filename)
+{
+    static mutex registry_mutex;
+    static unordered_map<string, weak_ptr<Texture>> registry;
+    lock_guard<mutex> guard(registry_mutex);
+    // Scene files name their textures relative to themselves; see SceneParser.
+    string key = filesystem::absolute(filename).lexically_normal().string();
+    if (auto texture = registry[key].lock())
+        return texture;
+
+    vector<uint8_t> rgba;
+    int width = 0, height = 0;
+    string ext = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+    transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return char(tolower(c)); });
+    bool ok;
+    if (ext == ".tga")
+        ok = loadTGA(filename, rgba, width, height);
+    else
+    {
+        unsigned w, h;
+        ok = lodepng::decode(rgba, w, h, filename) == 0;
+        width = int(w);
+        height = int(h);
+    }
+    if (!ok)
+    {
+        cerr << "Warning: could not load texture " << filename << endl;
+        return nullptr;
+    }
+
+    static atomic<uint32_t> next_id{ 0 };
+    shared_ptr<Texture> texture(new Texture);
+    texture->id_ = next_id++;
+    if (!texture->build(move(rgba), width, height))
+    {
+        cerr << "Warning: could not create the tile file for texture " << filename << endl;
+        return nullptr;
+    }
+    registry[key] = texture;
+    return texture;
+}
+
+Texture::~Texture()
+{
+    if (file_)
+        fclose(file_);
+}
+
+bool Texture::build(vector<uint8_t> rgba, int width, int height)
+{
+    file_ = tmpfile();
+    if (file_ == nullptr)
+        return false;
+
+    vector<uint8_t> tile(TileTexels * 4);
+    int64_t num_tiles = 0;
+    while (true)
+    {
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = (width + TileSize - 1) >> TileLog2;
+        level.tiles_y = (height + TileSize - 1) >> TileLog2;
+        level.first_tile = num_tiles;
+        levels_.push_back(level);
+
+        // Tiles are written row by row; the parts of the edge tiles outside the image repeat the edge texels.
+        for (int ty = 0; ty < level.tiles_y; ++ty)
+        {
+            for (int tx = 0; tx < level.tiles_x; ++tx)
+            {
+                for (int y = 0; y < TileSize; ++y)
+                {
+                    int sy = min(ty * TileSize + y, height - 1);
+                    for (int x = 0; x < TileSize; ++x)
+                    {
+                        int sx = min(tx * TileSize + x, width - 1);
+                        memcpy(&tile[(y * TileSize + x) * 4], &rgba[(size_t(sy) * width + sx) * 4], 4);
+                    }
+                }
+                if (fwrite(tile.data(), 1, tile.size(), file_) != tile.size())
+                    return false;
+                ++num_tiles;
+            }
+        }
+
+        if (width == 1 && height == 1)
+            break;
+
+        // The next level averages 2x2 blocks. An odd last row or column is left out, except that a single one is taken twice.
+        int next_width = max(1, width / 2), next_height = max(1, height / 2);
+        vector<uint8_t> next(size_t(next_width) * next_height * 4);
+        for (int y = 0; y < next_height; ++y)
+        {
+            int y0 = min(2 * y, height - 1), y1 = min(2 * y + 1, height - 1);
+            for (int x = 0; x < next_width; ++x)
+            {
+                int x0 = min(2 * x, width - 1), x1 = min(2 * x + 1, width - 1);
+                for (int c = 0; c < 4; ++c)
+                {
+                    int sum = rgba[(size_t(y0) * width + x0) * 4 + c] + rgba[(size_t(y0) * width + x1) * 4 + c] +
+                              rgba[(size_t(y1) * width + x0) * 4 + c] + rgba[(size_t(y1) * width + x1) * 4 + c];
+                    next[(size_t(y) * next_width + x) * 4 + c] = uint8_t((sum + 2) / 4);
+                }
+            }
+        }
+        rgba.swap(next);
+        width = next_width;
+        height = next_height;
+    }
+    return fflush(file_) == 0;
+}
+
+void Texture::readTile(int level, int tile_x, int tile_y, uint8_t* rgba) const
+{
+    const Level& l = levels_[level];
+    int64_t index = l.first_tile + int64_t(tile_y) * l.tiles_x + tile_x;
+    lock_guard<mutex> guard(file_mutex_);
+    if (fseek64(file_, index * int64_t(TileTexels * 4)) != 0 || fread(rgba, 1, TileTexels * 4, file_) != TileTexels * 4)
+        memset(rgba, 0, TileTexels * 4);
+}
+
+Vector3f Texture::texel(int level, int x, int y) const
+{
+    uint64_t key = tileKey(id_, level, x >> TileLog2, y >> TileLog2);
+    if (last_tile.key != key)
+    {
+        last_tile.tile = TextureCache::instance().tile(*this, level, x >> TileLog2, y >> TileLog2);
+        last_tile.key = key;
+    }
+    const uint8_t* p = &last_tile.tile->rgba[(((y & (TileSize - 1)) << TileLog2) + (x & (TileSize - 1))) * 4];
+    return Vector3f(p[0], p[1], p[2]) * (1.0f / 255.0f);
+}
+
+Vector3f Texture::lookup(int level, const Vector2f& uv, bool bilinear) const
+{
+    const Level& l = levels_[level];
+    // Wrap to [0,1) first, so that far-away coordinates don't overflow the integer texel coordinates.
+    float x = (uv(0) - floor(uv(0))) * l.width;
+    float y = (1.0f - (uv(1) - floor(uv(1)))) * l.height;
+    auto wrap = [](int i, int n) { return i < 0 ? i + n : (i >= n ? i - n : i); };
+
+    if (!bilinear)
+        return texel(level, wrap(int(x), l.width), wrap(int(y), l.height));
+
+    x -= 0.5f;
+    y -= 0.5f;
+    float fx = floor(x), fy = floor(y);
+    float wx = x - fx, wy = y - fy;
+    int x0 = wrap(int(fx), l.width), x1 = wrap(int(fx) + 1, l.width);
+    int y0 = wrap(int(fy), l.height), y1 = wrap(int(fy) + 1, l.height);
+    return (1.0f - wy) * ((1.0f - wx) * texel(level, x0, y0) + wx * texel(level, x1, y0)) +
+           wy * ((1.0f - wx) * texel(level, x0, y1) + wx * texel(level, x1, y1));
+}
+
+Vector3f Texture::sample(const Vector2f& uv, float footprint, bool mipmap, bool bilinear) const
+{
+    // The level where one texel is about as wide as the footprint, blending the two nearest levels.
+    float level = 0.0f;
+    if (mipmap && footprint > 0.0f)
+        level = std::clamp(log2(footprint * max(width(), height())), 0.0f, float(numLevels() - 1));
+    int l0 = int(level);
+    float w = level - l0;
+    Vector3f color = lookup(l0, uv, bilinear);
+    if (w > 0.0f)
+        color = (1.0f - w) * color + w * lookup(l0 + 1, uv, bilinear);
+    return color;
+}
+
+TextureCache& TextureCache::instance()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+void TextureCache::setBudget(size_t bytes)
+{
+    max_tiles_per_shard_ = max(size_t(1), bytes / (sizeof(Tile) * NumShards));
+}
+
+shared_ptr<const TextureCache::Tile> TextureCache::tile(const Texture& texture, int level, int tile_x, int tile_y)
+{
+    uint64_t key = tileKey(texture.id_, level, tile_x, tile_y);
+    Shard& shard = shards_[(key * 0x9e3779b97f4a7c15ull) >> 60];
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end())
+        {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            ++hits_;
+            return it->second->second;
+        }
+    }
+
+    // Read without holding the lock, so that the other threads can go on using the shard.
+    // Another thread may load the same tile meanwhile; then its copy is kept.
+    ++misses_;
+    auto loaded = make_shared<Tile>();
+    texture.readTile(level, tile_x, tile_y, loaded->rgba);
+
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end())
+        return it->second->second;
+    shard.lru.emplace_front(key, loaded);
+    shard.index[key] = shard.lru.begin();
+    while (shard.lru.size() > max_tiles_per_shard_)
+    {
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+    return loaded;
+}
+
+void TextureCache::clear()
+{
+    for (Shard& shard : shards_)
+    {
+        lock_guard<mutex> guard(shard.lock);
+        shard.lru.clear();
+        shard.index.clear();
+    }
+    hits_ = 0;
+    misses_ = 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Mip-mapped texture image for Material. Only the sizes of the mip levels stay in memory: loading builds
+// the mip pyramid once, cuts every level into square tiles and writes them out to a temporary file, from
+// which the TextureCache pages them back in on demand. Scenes can thus use more texture than fits in RAM.
+class Texture
+{
+public:
+    enum
+    {
+        TileLog2    = 6,
+        TileSize    = 1 << TileLog2     // tiles are TileSize x TileSize texels, 8-bit RGBA
+    };
+
+    // Loads a PNG or TGA image. Materials naming the same file share one Texture.
+    // Returns null with a warning if the file can't be read.
+    static shared_ptr<Texture> load(const string& filename);
+
+    ~Texture();
+
+    // Color at texture coordinates uv, which repeat outside [0,1]^2, with v running up the image.
+    // footprint is the width of the area to average in uv units, which chooses the mip level with mipmap on;
+    // 0 samples the full-resolution image. With bilinear off, the nearest texel is taken.
+    Vector3f        sample(const Vector2f& uv, float footprint, bool mipmap, bool bilinear) const;
+
+    int             width() const       { return levels_[0].width; }
+    int             height() const      { return levels_[0].height; }
+    int             numLevels() const   { return int(levels_.size()); }
+
+private:
+    struct Level
+    {
+        int         width;
+        int         height;
+        int         tiles_x;
+        int         tiles_y;
+        int64_t     first_tile;         // index of the first tile of the level in the file
+    };
+
+                    Texture() {}
+                    Texture         (const Texture&) = delete;
+    Texture&        operator=       (const Texture&) = delete;
+
+    bool            build(vector<uint8_t> rgba, int width, int height);
+    Vector3f        lookup(int level, const Vector2f& uv, bool bilinear) const;
+    Vector3f        texel(int level, int x, int y) const;
+
+    // Called by the TextureCache on a miss.
+    void            readTile(int level, int tile_x, int tile_y, uint8_t* rgba) const;
+    friend class TextureCache;
+
+    uint32_t        id_ = 0;            // identifies the tiles in the cache; never reused
+    vector<Level>   levels_;
+    FILE*           file_ = nullptr;
+    mutable mutex   file_mutex_;
+};
+
+// The tiles of all the textures that are currently in memory, shared by all the render threads.
+// Holds at most a fixed budget of texels and evicts the least recently used tiles to make room.
+// The tiles are spread over independently locked shards so that the threads rarely wait for each other.
+class TextureCache
+{
+public:
+    struct Tile
+    {
+        uint8_t     rgba[Texture::TileSize * Texture::TileSize * 4];
+    };
+
+    static TextureCache& instance();
+
+    void            setBudget(size_t bytes);
+    size_t          budget() const { return max_tiles_per_shard_ * NumShards * sizeof(Tile); }
+
+    // Returns the tile, reading it from the file of the texture if it isn't in memory. The tile stays
+    // valid for as long as the caller holds on to it, even if the cache evicts it in the meanwhile.
+    shared_ptr<const Tile> tile(const Texture& texture, int level, int tile_x, int tile_y);
+
+    void            clear();
+    uint64_t        hits() const    { return hits_; }
+    uint64_t        misses() const  { return misses_; }
+
+private:
+    TextureCache() { setBudget(size_t(256) << 20); }
+
+    static const int NumShards = 16;
+
+    typedef list<pair<uint64_t, shared_ptr<const Tile>>> LruList;
+    struct Shard
+    {
+        mutex                                       lock;
+        LruList                                     lru;        // most recently used first
+        unordered_map<uint64_t, LruList::iterator>  index;
+    };
+
+    Shard                   shards_[NumShards];
+    atomic<size_t>          max_tiles_per_shard_;
+    atomic<uint64_t>        hits_{ 0 };
+    atomic<uint64_t>        misses_{ 0 };
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// Work done by the ray tracer, counted by each thread separately so that counting costs next to nothing.
+// The counters only ever grow; render() differences them around each pixel for the cost images (-cost).
+// Nothing is counted unless trace_stats_enabled is set: the ray tracer tests it once per ray, and
+// SceneArena traverses with a separate instantiation that counts the primitive tests.
+struct TraceStats
+{
+    uint64_t    rays            = 0;    // rays cast: primary, secondary and shadow rays
+    uint64_t    primitive_tests = 0;    // ray-primitive intersection tests
+};
+
+inline thread_local TraceStats trace_stats;
+
+// Set by render() for the whole render; not to be changed while rendering.
+inline bool trace_stats_enabled = false;
+
+// Timestamp for measuring short intervals: the time stamp counter on x86, otherwise a steady clock in nanoseconds.
+inline uint64_t readCycleCounter()
+{
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}